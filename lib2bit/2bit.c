@@ -7,9 +7,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "2bit.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define TWOBIT_X86_SIMD
+#include <immintrin.h>
+#endif
+
 uint64_t twobitTell(TwoBit *tb);
+void twobitIndexDestroy(TwoBit *tb);
 
 /*
     Read nmemb elements, each of size sz from the current file offset 
@@ -18,6 +28,7 @@ uint64_t twobitTell(TwoBit *tb);
 */
 size_t twobitRead(void *data, size_t sz, size_t nmemb, TwoBit *tb) {
     if(tb->data) {
+        if(tb->offset + nmemb * sz > tb->sz) return 0;
         if(memcpy(data, tb->data + tb->offset, nmemb * sz) == NULL) return 0;
         tb->offset += nmemb * sz;
         return nmemb;
@@ -41,6 +52,56 @@ int twobitSeek(TwoBit *tb, uint64_t offset) {
     }
 }
 
+/*
+    Read nmemb elements, each of size sz, starting at the given file offset into data.
+    Unlike twobitRead, this doesn't use or change any file position held in tb, so it's
+    safe to call from multiple threads at once. Return the number of elements read. On
+    error, the return value is either 0 or less than nmemb.
+*/
+size_t twobitReadAt(TwoBit *tb, void *data, size_t sz, size_t nmemb, uint64_t offset) {
+    size_t len = sz * nmemb, got = 0;
+    ssize_t rv;
+
+    if(offset >= tb->sz) return 0;
+    if(tb->data) {
+        if(len > tb->sz - offset) return 0;
+        memcpy(data, (uint8_t*) tb->data + offset, len);
+        return nmemb;
+    }
+
+    while(got < len) {
+        rv = pread(fileno(tb->fp), (uint8_t*) data + got, len - got, (off_t) (offset + got));
+        if(rv <= 0) break;
+        got += (size_t) rv;
+    }
+    return got / sz;
+}
+
+/*
+    Return a pointer to nBytes of the file starting at offset. If the file is memory mapped, then this
+    points directly into the mapping and nothing is copied. Otherwise, the bytes are read into *scratch,
+    which is grown as needed (*scratchSz holds its current size) so it can be reused over many calls.
+
+    Returns NULL on error.
+*/
+const uint8_t *twobitPackedBytes(TwoBit *tb, uint64_t offset, size_t nBytes, uint8_t **scratch, size_t *scratchSz) {
+    uint8_t *tmp;
+
+    if(tb->data) {
+        if(offset > tb->sz || nBytes > tb->sz - offset) return NULL;
+        return (const uint8_t*) tb->data + offset;
+    }
+
+    if(*scratchSz < nBytes) {
+        tmp = realloc(*scratch, nBytes);
+        if(!tmp) return NULL;
+        *scratch = tmp;
+        *scratchSz = nBytes;
+    }
+    if(twobitReadAt(tb, *scratch, nBytes, 1, offset) != 1) return NULL;
+    return *scratch;
+}
+
 /*
     Like ftell, but generalized to handle memmaped files
 
@@ -52,60 +113,689 @@ uint64_t twobitTell(TwoBit *tb) {
 }
 
 /*
-    Given a byte containing 4 bases, return the character representation of the offset'th base
+    Decoding of packed bases
+
+    Each byte holds 4 bases, with the first in the 2 most significant bits. twobitBaseLUT holds the 4 characters
+    for every possible byte, so a whole byte is decoded with a single 4 byte copy. Runs of whole bytes are decoded
+    by decodeBytes, which points to the fastest kernel the CPU supports (see twobitInitKernels()).
+*/
+static char twobitBaseLUT[256][4];
+static char twobitCodeLUT[256][4];
+static char twobitBaseRcLUT[256][4];
+static uint8_t twobitAlphaByte[256];
+static void (*decodeBytes)(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4]);
+static void (*decodeBytesRev)(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4]);
+static void (*countBytes)(const uint8_t *bytes, size_t nBytes, uint64_t counts[4]);
+static void (*countWindows)(const uint8_t *bytes, uint32_t nBytes, uint32_t first, const uint32_t *nStart, const uint32_t *nSize, uint32_t nBlocks, uint32_t blk, uint32_t start, uint32_t n, uint32_t width, uint32_t step, uint32_t *counts);
+static void (*countPairWindows)(const uint8_t *bytes, uint32_t nBytes, uint32_t first, const uint32_t *nStart, const uint32_t *nSize, uint32_t nBlocks, uint32_t blk, uint32_t start, uint32_t n, uint32_t width, uint32_t step, uint32_t *counts);
+static void (*swapWords)(uint32_t *words, size_t n);
+static pthread_once_t twobitKernelsOnce = PTHREAD_ONCE_INIT;
+
+static void decodeBytesScalar(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4]) {
+    size_t i;
+    for(i=0; i<nBytes; i++) memcpy(seq + 4 * i, lut[bytes[i]], 4);
+}
+
+/*
+    As decodeBytesScalar(), but starting from the last byte. With a LUT built by twobitBuildRcLUT(), which also reverses
+    the bases within each byte, this writes the reverse complement.
+*/
+static void decodeBytesRevScalar(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4]) {
+    size_t i;
+    for(i=0; i<nBytes; i++) memcpy(seq + 4 * i, lut[bytes[nBytes - 1 - i]], 4);
+}
+
+#ifdef TWOBIT_X86_SIMD
+/*
+    The SIMD kernels split each packed byte into its 4 2-bit codes, map those to characters with a byte shuffle
+    and then interleave the results so that the bases end up in order. The 4 characters are taken from the entry
+    of the LUT for 0x1B (i.e., codes 0, 1, 2 and 3), so these work for any LUT built by twobitBuildLUT().
+
+    If reverse is set, then the bytes are read from the end, reversed within each vector and split into codes
+    starting with the lowest 2 bits. The characters are then taken from the entry for 0xE4, which holds codes
+    0-3 once reversed by twobitBuildRcLUT().
+*/
+__attribute__((target("sse4.1"), always_inline))
+static inline void decodeBytesSSE41With(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4], int reverse) {
+    size_t i = 0;
+    int32_t alpha;
+    __m128i alphabet, three = _mm_set1_epi8(3);
+    __m128i rev = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m128i x, v0, v1, v2, v3, lo, hi, lo2, hi2;
+
+    memcpy(&alpha, lut[(reverse) ? 0xE4 : 0x1B], 4);
+    alphabet = _mm_set1_epi32(alpha);
+    for(; i + 16 <= nBytes; i += 16) {
+        if(reverse) {
+            x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (bytes + nBytes - i - 16)), rev);
+            v0 = _mm_shuffle_epi8(alphabet, _mm_and_si128(x, three));
+            v1 = _mm_shuffle_epi8(alphabet, _mm_and_si128(_mm_srli_epi16(x, 2), three));
+            v2 = _mm_shuffle_epi8(alphabet, _mm_and_si128(_mm_srli_epi16(x, 4), three));
+            v3 = _mm_shuffle_epi8(alphabet, _mm_and_si128(_mm_srli_epi16(x, 6), three));
+        } else {
+            x = _mm_loadu_si128((const __m128i*) (bytes + i));
+            v0 = _mm_shuffle_epi8(alphabet, _mm_and_si128(_mm_srli_epi16(x, 6), three));
+            v1 = _mm_shuffle_epi8(alphabet, _mm_and_si128(_mm_srli_epi16(x, 4), three));
+            v2 = _mm_shuffle_epi8(alphabet, _mm_and_si128(_mm_srli_epi16(x, 2), three));
+            v3 = _mm_shuffle_epi8(alphabet, _mm_and_si128(x, three));
+        }
+        lo = _mm_unpacklo_epi8(v0, v1);
+        hi = _mm_unpackhi_epi8(v0, v1);
+        lo2 = _mm_unpacklo_epi8(v2, v3);
+        hi2 = _mm_unpackhi_epi8(v2, v3);
+        _mm_storeu_si128((__m128i*) (seq + 4 * i), _mm_unpacklo_epi16(lo, lo2));
+        _mm_storeu_si128((__m128i*) (seq + 4 * i + 16), _mm_unpackhi_epi16(lo, lo2));
+        _mm_storeu_si128((__m128i*) (seq + 4 * i + 32), _mm_unpacklo_epi16(hi, hi2));
+        _mm_storeu_si128((__m128i*) (seq + 4 * i + 48), _mm_unpackhi_epi16(hi, hi2));
+    }
+    if(reverse) decodeBytesRevScalar(seq + 4 * i, bytes, nBytes - i, lut);
+    else decodeBytesScalar(seq + 4 * i, bytes + i, nBytes - i, lut);
+}
+
+__attribute__((target("sse4.1")))
+static void decodeBytesSSE41(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4]) {
+    decodeBytesSSE41With(seq, bytes, nBytes, lut, 0);
+}
+
+__attribute__((target("sse4.1")))
+static void decodeBytesRevSSE41(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4]) {
+    decodeBytesSSE41With(seq, bytes, nBytes, lut, 1);
+}
+
+/*
+    As above, but the unpacks operate within 128-bit lanes, so the results need to be reordered across lanes
+*/
+__attribute__((target("avx2"), always_inline))
+static inline void decodeBytesAVX2With(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4], int reverse) {
+    size_t i = 0;
+    int32_t alpha;
+    __m256i alphabet, three = _mm256_set1_epi8(3);
+    __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                   15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m256i x, v0, v1, v2, v3, lo, hi, lo2, hi2, o0, o1, o2, o3;
+
+    memcpy(&alpha, lut[(reverse) ? 0xE4 : 0x1B], 4);
+    alphabet = _mm256_set1_epi32(alpha);
+    for(; i + 32 <= nBytes; i += 32) {
+        if(reverse) {
+            x = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) (bytes + nBytes - i - 32)), rev);
+            x = _mm256_permute4x64_epi64(x, 0x4E); //swap the lanes
+            v0 = _mm256_shuffle_epi8(alphabet, _mm256_and_si256(x, three));
+            v1 = _mm256_shuffle_epi8(alphabet, _mm256_and_si256(_mm256_srli_epi16(x, 2), three));
+            v2 = _mm256_shuffle_epi8(alphabet, _mm256_and_si256(_mm256_srli_epi16(x, 4), three));
+            v3 = _mm256_shuffle_epi8(alphabet, _mm256_and_si256(_mm256_srli_epi16(x, 6), three));
+        } else {
+            x = _mm256_loadu_si256((const __m256i*) (bytes + i));
+            v0 = _mm256_shuffle_epi8(alphabet, _mm256_and_si256(_mm256_srli_epi16(x, 6), three));
+            v1 = _mm256_shuffle_epi8(alphabet, _mm256_and_si256(_mm256_srli_epi16(x, 4), three));
+            v2 = _mm256_shuffle_epi8(alphabet, _mm256_and_si256(_mm256_srli_epi16(x, 2), three));
+            v3 = _mm256_shuffle_epi8(alphabet, _mm256_and_si256(x, three));
+        }
+        lo = _mm256_unpacklo_epi8(v0, v1);
+        hi = _mm256_unpackhi_epi8(v0, v1);
+        lo2 = _mm256_unpacklo_epi8(v2, v3);
+        hi2 = _mm256_unpackhi_epi8(v2, v3);
+        o0 = _mm256_unpacklo_epi16(lo, lo2); //bytes 0-3 and 16-19
+        o1 = _mm256_unpackhi_epi16(lo, lo2); //bytes 4-7 and 20-23
+        o2 = _mm256_unpacklo_epi16(hi, hi2); //bytes 8-11 and 24-27
+        o3 = _mm256_unpackhi_epi16(hi, hi2); //bytes 12-15 and 28-31
+        _mm256_storeu_si256((__m256i*) (seq + 4 * i), _mm256_permute2x128_si256(o0, o1, 0x20));
+        _mm256_storeu_si256((__m256i*) (seq + 4 * i + 32), _mm256_permute2x128_si256(o2, o3, 0x20));
+        _mm256_storeu_si256((__m256i*) (seq + 4 * i + 64), _mm256_permute2x128_si256(o0, o1, 0x31));
+        _mm256_storeu_si256((__m256i*) (seq + 4 * i + 96), _mm256_permute2x128_si256(o2, o3, 0x31));
+    }
+    _mm256_zeroupper();
+    if(reverse) decodeBytesRevSSE41(seq + 4 * i, bytes, nBytes - i, lut);
+    else decodeBytesSSE41(seq + 4 * i, bytes + i, nBytes - i, lut);
+}
+
+__attribute__((target("avx2")))
+static void decodeBytesAVX2(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4]) {
+    decodeBytesAVX2With(seq, bytes, nBytes, lut, 0);
+}
+
+__attribute__((target("avx2")))
+static void decodeBytesRevAVX2(char *seq, const uint8_t *bytes, size_t nBytes, const char (*lut)[4]) {
+    decodeBytesAVX2With(seq, bytes, nBytes, lut, 1);
+}
+#endif
+
+/*
+    Base counting
+
+    With T=00, C=01, A=10 and G=11, the low and high bits of each 2-bit code can be separated with a mask, after which
+    the number of Gs is the popcount of (high & low), As are the remaining high bits, Cs the remaining low bits and Ts
+    whatever's left. This counts 32 bases per 64-bit word without looking at them individually. Since only totals are
+    needed, the byte order of the words doesn't matter.
+
+    The countBytes kernels count every base in nBytes whole bytes and add the results (in TCAG order) to counts.
+*/
+#define TWOBIT_LOW_BITS 0x5555555555555555ULL
+
+static inline void countWord(uint64_t w, int nBases, int (*popcount)(unsigned long long), uint64_t counts[4]) {
+    uint64_t lo = w & TWOBIT_LOW_BITS, hi = (w >> 1) & TWOBIT_LOW_BITS;
+    uint64_t g = popcount(hi & lo), a = popcount(hi) - g, c = popcount(lo) - g;
+    counts[0] += nBases - a - c - g;
+    counts[1] += c;
+    counts[2] += a;
+    counts[3] += g;
+}
+
+static int popcountGeneric(unsigned long long x) {
+    return __builtin_popcountll(x);
+}
+
+static inline void countBytesWith(const uint8_t *bytes, size_t nBytes, uint64_t counts[4], int (*popcount)(unsigned long long)) {
+    size_t i = 0;
+    uint64_t w;
+    for(; i + 8 <= nBytes; i += 8) {
+        memcpy(&w, bytes + i, 8);
+        countWord(w, 32, popcount, counts);
+    }
+    if(i < nBytes) {
+        //Zero padding would be counted as Ts, so those are excluded by the base count
+        w = 0;
+        memcpy(&w, bytes + i, nBytes - i);
+        countWord(w, 4 * (nBytes - i), popcount, counts);
+    }
+}
+
+static void countBytesScalar(const uint8_t *bytes, size_t nBytes, uint64_t counts[4]) {
+    countBytesWith(bytes, nBytes, counts, popcountGeneric);
+}
+
+#ifdef TWOBIT_X86_SIMD
+__attribute__((target("popcnt")))
+static int popcountHW(unsigned long long x) {
+    return __builtin_popcountll(x);
+}
+
+__attribute__((target("popcnt")))
+static void countBytesPopcnt(const uint8_t *bytes, size_t nBytes, uint64_t counts[4]) {
+    countBytesWith(bytes, nBytes, counts, popcountHW);
+}
+
+/*
+    The AVX2 kernel computes per-byte popcounts with a nibble lookup table and sums them with vpsadbw
+*/
+__attribute__((target("avx2")))
+static void countBytesAVX2(const uint8_t *bytes, size_t nBytes, uint64_t counts[4]) {
+    size_t i = 0;
+    uint64_t tmp[4], a, c, g;
+    const __m256i nibbles = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                             0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowBits = _mm256_set1_epi8(0x55), zero = _mm256_setzero_si256();
+    __m256i x, lo, hi, sumG = zero, sumHi = zero, sumLo = zero;
+
+    for(; i + 32 <= nBytes; i += 32) {
+        x = _mm256_loadu_si256((const __m256i*) (bytes + i));
+        lo = _mm256_and_si256(x, lowBits);
+        hi = _mm256_and_si256(_mm256_srli_epi16(x, 1), lowBits);
+        //Each masked byte only has bits in the low nibble after combining the two halves
+        sumG = _mm256_add_epi64(sumG, _mm256_sad_epu8(_mm256_add_epi8(
+            _mm256_shuffle_epi8(nibbles, _mm256_and_si256(_mm256_and_si256(hi, lo), _mm256_set1_epi8(0x0F))),
+            _mm256_shuffle_epi8(nibbles, _mm256_srli_epi16(_mm256_and_si256(_mm256_and_si256(hi, lo), _mm256_set1_epi8(0x50)), 4))), zero));
+        sumHi = _mm256_add_epi64(sumHi, _mm256_sad_epu8(_mm256_add_epi8(
+            _mm256_shuffle_epi8(nibbles, _mm256_and_si256(hi, _mm256_set1_epi8(0x0F))),
+            _mm256_shuffle_epi8(nibbles, _mm256_srli_epi16(_mm256_and_si256(hi, _mm256_set1_epi8(0x50)), 4))), zero));
+        sumLo = _mm256_add_epi64(sumLo, _mm256_sad_epu8(_mm256_add_epi8(
+            _mm256_shuffle_epi8(nibbles, _mm256_and_si256(lo, _mm256_set1_epi8(0x0F))),
+            _mm256_shuffle_epi8(nibbles, _mm256_srli_epi16(_mm256_and_si256(lo, _mm256_set1_epi8(0x50)), 4))), zero));
+    }
+
+    if(i) {
+        _mm256_storeu_si256((__m256i*) tmp, sumG);
+        g = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+        _mm256_storeu_si256((__m256i*) tmp, sumHi);
+        a = tmp[0] + tmp[1] + tmp[2] + tmp[3] - g;
+        _mm256_storeu_si256((__m256i*) tmp, sumLo);
+        c = tmp[0] + tmp[1] + tmp[2] + tmp[3] - g;
+        counts[0] += 4 * i - a - c - g;
+        counts[1] += c;
+        counts[2] += a;
+        counts[3] += g;
+    }
+    //The tail is counted with popcnt, which gcc may inline without clearing the upper halves of the ymm registers,
+    //and leaving them dirty makes any SSE code that follows (e.g., in the caller) very slow
+    _mm256_zeroupper();
+    countBytesPopcnt(bytes + i, nBytes - i, counts);
+}
+#endif
+
+/*
+    Sliding windows
+
+    A walk over the packed bases keeps totals of the high bits, low bits and both (i.e., Gs) of every whole 32-base
+    word before the current one, as in countWord(), from which the number of each base before any position follows
+    with one more (masked) word. The positions needed are the window starts and ends and N block boundaries, which
+    are all increasing, so they're merged into a single walk in which every word is read at most once, however much
+    the windows overlap. Words that aren't covered by any window are skipped.
+
+    Nothing is counted within an N block, so the totals at its start are used for any position within it, and
+    whatever the packed bases in it hold is added to an offset that's subtracted from all later totals. Skipping
+    words (or starting from 0 rather than the beginning of the chromosome) similarly shifts all of the later totals,
+    but never those of an open window, so it doesn't matter.
+*/
+typedef struct {
+    const uint8_t *bytes; //Packed bases, starting with base 0 of the walk
+    uint32_t nBytes; //The number of bytes that can be read
+    uint32_t word; //The next whole word to be added to the totals
+    uint64_t hi, lo, g; //The totals before word
+} windowWalk;
+
+//Load the 32 bases starting with byte i, with the first in the top bits. Nothing at or after nBytes is read.
+static inline __attribute__((always_inline)) uint64_t windowLoad(const windowWalk *w, uint32_t i) {
+    uint64_t x = 0;
+    uint32_t k;
+
+    if(w->nBytes - i >= 8) {
+        memcpy(&x, w->bytes + i, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        x = __builtin_bswap64(x);
+#endif
+    } else {
+        for(k=0; i + k < w->nBytes; k++) x |= ((uint64_t) w->bytes[i + k]) << (56 - 8 * k);
+    }
+    return x;
+}
+
+//Set t (in TCAG order) to the number of each base before p (relative to the start of the walk)
+static inline __attribute__((always_inline)) void windowTotals(windowWalk *w, uint32_t p, uint64_t t[4]) {
+    uint64_t x, lo, hi, loTotal, hiTotal, g;
+
+    //Whole words are always readable, and their totals don't depend on the order of the bases
+    for(; w->word < (p >> 5); w->word++) {
+        memcpy(&x, w->bytes + 8 * w->word, 8);
+        lo = x & TWOBIT_LOW_BITS;
+        hi = (x >> 1) & TWOBIT_LOW_BITS;
+        w->g += __builtin_popcountll(hi & lo);
+        w->hi += __builtin_popcountll(hi);
+        w->lo += __builtin_popcountll(lo);
+    }
+    hiTotal = w->hi;
+    loTotal = w->lo;
+    g = w->g;
+    if(p & 31) {
+        x = windowLoad(w, 8 * (p >> 5)) & (~0ULL << (64 - 2 * (p & 31)));
+        lo = x & TWOBIT_LOW_BITS;
+        hi = (x >> 1) & TWOBIT_LOW_BITS;
+        g += __builtin_popcountll(hi & lo);
+        hiTotal += __builtin_popcountll(hi);
+        loTotal += __builtin_popcountll(lo);
+    }
+    t[0] = p - hiTotal - loTotal + g;
+    t[1] = loTotal - g;
+    t[2] = hiTotal - g;
+    t[3] = g;
+}
+
+/*
+    Fill counts for n windows starting at start, where bytes holds the packed bases from first (a multiple of 4)
+    onwards and blk is the first N block ending after start. See twobitWindowCounts().
+
+    Everything is inlined into each kernel, so that __builtin_popcountll() becomes popcnt in countWindowsPopcnt().
+*/
+static inline __attribute__((always_inline)) void countWindowsWith(const uint8_t *bytes, uint32_t nBytes, uint32_t first, const uint32_t *nStart, const uint32_t *nSize, uint32_t nBlocks, uint32_t blk, uint32_t start, uint32_t n, uint32_t width, uint32_t step, uint32_t *counts) {
+    windowWalk w = {bytes, nBytes, 0, 0, 0, 0};
+    uint64_t t[4], atN[4] = {0, 0, 0, 0}, offset[4] = {0, 0, 0, 0};
+    uint32_t iStart = 0, iEnd = 0, s, e, b, p, j, inN = 0, cur[4], *c;
+
+    while(iEnd < n) {
+        s = (iStart < n) ? start + iStart * step : (uint32_t) -1;
+        e = start + iEnd * step + width;
+        b = (uint32_t) -1;
+        if(blk < nBlocks) b = inN ? nStart[blk] + nSize[blk] : ((nStart[blk] > start) ? nStart[blk] : start);
+        p = (s < e) ? s : e;
+        if(b < p) p = b;
+
+        if(iStart == iEnd && w.word < ((p - first) >> 5)) w.word = (p - first) >> 5;
+        windowTotals(&w, p - first, t);
+        while(p == b) {
+            if(inN) {
+                for(j=0; j<4; j++) offset[j] += t[j] - atN[j];
+                inN = 0;
+                blk++;
+                b = (blk < nBlocks) ? nStart[blk] : (uint32_t) -1;
+            } else {
+                for(j=0; j<4; j++) atN[j] = t[j];
+                inN = 1;
+                b = nStart[blk] + nSize[blk];
+            }
+        }
+        for(j=0; j<4; j++) cur[j] = (uint32_t) ((inN ? atN[j] : t[j]) - offset[j]);
+
+        //Windows are filled in ACGT order, and only need to be correct modulo 2^32
+        if(p == e) {
+            c = counts + 5 * iEnd++;
+            c[0] = cur[2] - c[0];
+            c[1] = cur[1] - c[1];
+            c[2] = cur[3] - c[2];
+            c[3] = cur[0] - c[3];
+            c[4] = width - c[0] - c[1] - c[2] - c[3];
+        }
+        if(p == s) {
+            c = counts + 5 * iStart++;
+            c[0] = cur[2];
+            c[1] = cur[1];
+            c[2] = cur[3];
+            c[3] = cur[0];
+        }
+    }
+}
+
+static void countWindowsScalar(const uint8_t *bytes, uint32_t nBytes, uint32_t first, const uint32_t *nStart, const uint32_t *nSize, uint32_t nBlocks, uint32_t blk, uint32_t start, uint32_t n, uint32_t width, uint32_t step, uint32_t *counts) {
+    countWindowsWith(bytes, nBytes, first, nStart, nSize, nBlocks, blk, start, n, width, step, counts);
+}
+
+#ifdef TWOBIT_X86_SIMD
+__attribute__((target("popcnt")))
+static void countWindowsPopcnt(const uint8_t *bytes, uint32_t nBytes, uint32_t first, const uint32_t *nStart, const uint32_t *nSize, uint32_t nBlocks, uint32_t blk, uint32_t start, uint32_t n, uint32_t width, uint32_t step, uint32_t *counts) {
+    countWindowsWith(bytes, nBytes, first, nStart, nSize, nBlocks, blk, start, n, width, step, counts);
+}
+#endif
+
+/*
+    Dinucleotides
+
+    For a word of 32 bases and the same word shifted by one base, the positions holding each base are simple masks of
+    the high and low bits, so the number of each of the 16 pairs is the popcount of the AND of two such masks. Pairs are
+    indexed by their first base, and those touching an N block are skipped. Counting the pairs in each window is then
+    a matter of taking running totals at the window starts and (one base before) the window ends, as above.
+*/
+
+//Add the pairs whose first base is at position j0 to j1-1 (0 < j1 <= 32) of word wi to c (in TCAG x TCAG order)
+static inline __attribute__((always_inline)) void pairsWord(const windowWalk *w, uint32_t wi, uint32_t j0, uint32_t j1, uint64_t c[16]) {
+    uint64_t x, y, valid, lo, hi, m1[4], m2[4];
+    int a, b;
+
+    x = windowLoad(w, 8 * wi);
+    y = x << 2;
+    if(8 * wi + 8 < w->nBytes) y |= w->bytes[8 * wi + 8] >> 6;
+    valid = (~0ULL >> (2 * j0)) & ~((j1 < 32) ? (~0ULL >> (2 * j1)) : 0) & TWOBIT_LOW_BITS;
+
+    lo = x & valid;
+    hi = (x >> 1) & valid;
+    m1[0] = valid & ~(hi | lo);
+    m1[1] = lo & ~hi;
+    m1[2] = hi & ~lo;
+    m1[3] = hi & lo;
+    lo = y & TWOBIT_LOW_BITS;
+    hi = (y >> 1) & TWOBIT_LOW_BITS;
+    m2[0] = ~(hi | lo);
+    m2[1] = lo & ~hi;
+    m2[2] = hi & ~lo;
+    m2[3] = hi & lo;
+    for(a=0; a<4; a++) {
+        for(b=0; b<4; b++) c[4 * a + b] += __builtin_popcountll(m1[a] & m2[b]);
+    }
+}
+
+//Add the pairs whose first base is in [a, b) (relative to the start of the walk) to c
+static inline __attribute__((always_inline)) void pairsRange(const windowWalk *w, uint32_t a, uint32_t b, uint64_t c[16]) {
+    uint32_t wi, last = (b - 1) >> 5;
+
+    for(wi=a >> 5; wi<=last; wi++) pairsWord(w, wi, (wi == a >> 5) ? a & 31 : 0, (wi == last) ? ((b - 1) & 31) + 1 : 32, c);
+}
+
+/*
+    As countWindowsWith(), but filling 16 dinucleotide counts per window, in ACGT x ACGT order. A pair is in a window if both of its bases are.
+*/
+static inline __attribute__((always_inline)) void countPairWindowsWith(const uint8_t *bytes, uint32_t nBytes, uint32_t first, const uint32_t *nStart, const uint32_t *nSize, uint32_t nBlocks, uint32_t blk, uint32_t start, uint32_t n, uint32_t width, uint32_t step, uint32_t *counts) {
+    static const int tcag[4] = {2, 1, 3, 0}; //The TCAG code of A, C, G and T
+    windowWalk w = {bytes, nBytes, 0, 0, 0, 0};
+    uint64_t c[16] = {0};
+    uint32_t iStart = 0, iEnd = 0, s, f, p, lim, invalid, blockEnd, done = start, j, cur[16], *o;
+
+    while(iEnd < n) {
+        //Pairs in a window start at s to f-1
+        s = (iStart < n) ? start + iStart * step : (uint32_t) -1;
+        f = start + iEnd * step + width - 1;
+        p = (s < f) ? s : f;
+
+        if(iStart == iEnd) {
+            //No window is open, so nothing before p needs counting
+            if(p > done) done = p;
+        }
+        while(done < p) {
+            while(blk < nBlocks && nStart[blk] + nSize[blk] <= done) blk++;
+            //A pair is invalid if its first base is in an N block or just before one
+            invalid = (uint32_t) -1;
+            if(blk < nBlocks) invalid = (nStart[blk] > 0) ? nStart[blk] - 1 : 0;
+            if(invalid <= done) {
+                blockEnd = nStart[blk] + nSize[blk];
+                done = (blockEnd < p) ? blockEnd : p;
+                continue;
+            }
+            lim = (invalid < p) ? invalid : p;
+            pairsRange(&w, done - first, lim - first, c);
+            done = lim;
+        }
+        for(j=0; j<16; j++) cur[j] = (uint32_t) c[4 * tcag[j >> 2] + tcag[j & 3]];
+
+        //Only needs to be correct modulo 2^32. A window may start where another ends, with the same totals.
+        if(p == s) {
+            o = counts + 16 * iStart++;
+            for(j=0; j<16; j++) o[j] = cur[j];
+        }
+        if(p == f) {
+            o = counts + 16 * iEnd++;
+            for(j=0; j<16; j++) o[j] = cur[j] - o[j];
+        }
+    }
+}
+
+static void countPairWindowsScalar(const uint8_t *bytes, uint32_t nBytes, uint32_t first, const uint32_t *nStart, const uint32_t *nSize, uint32_t nBlocks, uint32_t blk, uint32_t start, uint32_t n, uint32_t width, uint32_t step, uint32_t *counts) {
+    countPairWindowsWith(bytes, nBytes, first, nStart, nSize, nBlocks, blk, start, n, width, step, counts);
+}
+
+#ifdef TWOBIT_X86_SIMD
+__attribute__((target("popcnt")))
+static void countPairWindowsPopcnt(const uint8_t *bytes, uint32_t nBytes, uint32_t first, const uint32_t *nStart, const uint32_t *nSize, uint32_t nBlocks, uint32_t blk, uint32_t start, uint32_t n, uint32_t width, uint32_t step, uint32_t *counts) {
+    countPairWindowsWith(bytes, nBytes, first, nStart, nSize, nBlocks, blk, start, n, width, step, counts);
+}
+#endif
+
+/*
+    Byte swapping of the index in files written with the other endianness. The N and soft-masked block arrays can
+    hold millions of entries, so they're swapped with a byte shuffle. The packed sequence never needs swapping.
+*/
+static void swapWordsScalar(uint32_t *words, size_t n) {
+    size_t i;
+    for(i=0; i<n; i++) words[i] = __builtin_bswap32(words[i]);
+}
+
+#ifdef TWOBIT_X86_SIMD
+__attribute__((target("ssse3")))
+static void swapWordsSSSE3(uint32_t *words, size_t n) {
+    size_t i = 0;
+    const __m128i order = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m128i x;
+
+    for(; i + 4 <= n; i += 4) {
+        x = _mm_loadu_si128((const __m128i*) (words + i));
+        _mm_storeu_si128((__m128i*) (words + i), _mm_shuffle_epi8(x, order));
+    }
+    swapWordsScalar(words + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void swapWordsAVX2(uint32_t *words, size_t n) {
+    size_t i = 0;
+    const __m256i order = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i x;
+
+    for(; i + 8 <= n; i += 8) {
+        x = _mm256_loadu_si256((const __m256i*) (words + i));
+        _mm256_storeu_si256((__m256i*) (words + i), _mm256_shuffle_epi8(x, order));
+    }
+    swapWordsScalar(words + i, n - i);
+}
+#endif
+
+/*
+    Count the bases in [start, end) of a packed sequence, where the positions are relative to the first base in bytes[0].
+    The results are added to counts, which is in TCAG order.
+*/
+void countBases(const uint8_t *bytes, uint32_t start, uint32_t end, uint64_t counts[4]) {
+    uint32_t nBytes;
+
+    //Leading partial byte
+    while((start & 3) && start < end) {
+        counts[(bytes[start >> 2] >> (6 - 2 * (start & 3))) & 3]++;
+        start++;
+    }
+    if(start >= end) return;
+
+    //Whole bytes
+    nBytes = (end - start) >> 2;
+    countBytes(bytes + (start >> 2), nBytes, counts);
+    start += 4 * nBytes;
+
+    //Trailing partial byte
+    while(start < end) {
+        counts[(bytes[start >> 2] >> (6 - 2 * (start & 3))) & 3]++;
+        start++;
+    }
+}
+
+/*
+    Fill a LUT such that lut[byte] holds the 4 symbols encoded by byte, given the symbol for each 2-bit code
+*/
+static void twobitBuildLUT(char (*lut)[4], const char *symbols) {
+    int i, j;
+    for(i=0; i<256; i++) {
+        for(j=0; j<4; j++) lut[i][j] = symbols[(i >> (6 - 2 * j)) & 3];
+    }
+}
+
+/*
+    As twobitBuildLUT(), but lut[byte] holds the reverse complement of the 4 bases encoded by byte. The complement of each 2-bit code is simply code^2 (T<->A and C<->G).
+*/
+static void twobitBuildRcLUT(char (*lut)[4], const char *symbols) {
+    int i, j;
+    for(i=0; i<256; i++) {
+        for(j=0; j<4; j++) lut[i][j] = symbols[((i >> (2 * j)) & 3) ^ 2];
+    }
+}
+
+static void twobitInitKernelsOnce(void) {
+    int i, j;
+
+    twobitBuildLUT(twobitBaseLUT, "TCAG");
+    //T, C, A and G as 3, 1, 0 and 2, so that ACGT sort as 0-3
+    twobitBuildLUT(twobitCodeLUT, "\3\1\0\2");
+    twobitBuildRcLUT(twobitBaseRcLUT, "TCAG");
+    //Each byte with its 4 codes in ACGT order, for k-mer counting
+    for(i=0; i<256; i++) {
+        for(j=0; j<4; j++) twobitAlphaByte[i] |= twobitCodeLUT[i][j] << (6 - 2 * j);
+    }
+    decodeBytes = decodeBytesScalar;
+    decodeBytesRev = decodeBytesRevScalar;
+    countBytes = countBytesScalar;
+    countWindows = countWindowsScalar;
+    countPairWindows = countPairWindowsScalar;
+    swapWords = swapWordsScalar;
+#ifdef TWOBIT_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) decodeBytes = decodeBytesAVX2;
+    else if(__builtin_cpu_supports("sse4.1")) decodeBytes = decodeBytesSSE41;
+    if(__builtin_cpu_supports("avx2")) decodeBytesRev = decodeBytesRevAVX2;
+    else if(__builtin_cpu_supports("sse4.1")) decodeBytesRev = decodeBytesRevSSE41;
+    if(__builtin_cpu_supports("avx2")) countBytes = countBytesAVX2;
+    else if(__builtin_cpu_supports("popcnt")) countBytes = countBytesPopcnt;
+    if(__builtin_cpu_supports("popcnt")) countWindows = countWindowsPopcnt;
+    if(__builtin_cpu_supports("popcnt")) countPairWindows = countPairWindowsPopcnt;
+    if(__builtin_cpu_supports("avx2")) swapWords = swapWordsAVX2;
+    else if(__builtin_cpu_supports("ssse3")) swapWords = swapWordsSSSE3;
+#endif
+}
+
+/*
+    Set up the LUTs and select the decoding/counting/swapping kernels for this CPU. This is called by twobitOpen() and is cheap to call repeatedly.
 */
-char byte2base(uint8_t byte, int offset) {
-    int rev = 3 - offset;
-    uint8_t mask = 3 << (2 * rev);
-    int foo = (mask & byte) >> (2 * rev);
-    char bases[4] = "TCAG";
-    return bases[foo];
+void twobitInitKernels(void) {
+    pthread_once(&twobitKernelsOnce, twobitInitKernelsOnce);
 }
 
-void bytes2bases(char *seq, uint8_t *byte, uint32_t sz, int offset) {
-    uint32_t pos = 0, remainder = 0, i = 0;
-    char bases[4] = "TCAG";
-    uint8_t foo = byte[0];
+/*
+    Decode sz bases, starting at the offset'th base of byte[0], into seq using the given LUT
+*/
+void bytes2basesLUT(char *seq, const uint8_t *byte, uint32_t sz, int offset, const char (*lut)[4]) {
+    uint32_t pos = 0, nBytes;
 
     // Deal with the first partial byte
     if(offset != 0) {
-        while(offset < 4 && pos < sz) {
-           seq[pos++] = byte2base(foo, offset++);
-        }
+        while(offset < 4 && pos < sz) seq[pos++] = lut[*byte][offset++];
         if(pos >= sz) return;
-        foo = byte[++i];
+        byte++;
     }
 
-    // Deal with everything else, with the possible exception of the last fractional byte
-    remainder = (sz - pos) % 4;
-    while(pos < sz - remainder) {
-        foo = byte[i++];
-        seq[pos + 3] = bases[foo & 3];
-        foo >>= 2;
-        seq[pos + 2] = bases[foo & 3];
-        foo >>= 2;
-        seq[pos + 1] = bases[foo & 3];
-        foo >>= 2;
-        seq[pos] = bases[foo & 3];
-        foo >>= 2;
-        pos += 4;
+    // Deal with the whole bytes
+    nBytes = (sz - pos) / 4;
+    decodeBytes(seq + pos, byte, nBytes, lut);
+    pos += 4 * nBytes;
+    byte += nBytes;
+
+    // Deal with the last partial byte
+    for(offset=0; pos<sz; offset++) seq[pos++] = lut[*byte][offset];
+}
+
+void bytes2bases(char *seq, const uint8_t *byte, uint32_t sz, int offset) {
+    bytes2basesLUT(seq, byte, sz, offset, twobitBaseLUT);
+}
+
+/*
+    As bytes2basesLUT(), but writing the sz bases in reverse order (i.e., the base at offset goes to seq[sz-1]), using a LUT from twobitBuildRcLUT()
+*/
+static void bytes2basesRevLUT(char *seq, const uint8_t *byte, uint32_t sz, int offset, const char (*lut)[4]) {
+    uint32_t pos = 0, nBytes;
+
+    // Deal with the first partial byte
+    if(offset != 0) {
+        while(offset < 4 && pos < sz) seq[sz - 1 - pos++] = lut[*byte][3 - offset++];
+        if(pos >= sz) return;
+        byte++;
     }
 
+    // Deal with the whole bytes
+    nBytes = (sz - pos) / 4;
+    decodeBytesRev(seq + sz - pos - 4 * nBytes, byte, nBytes, lut);
+    pos += 4 * nBytes;
+    byte += nBytes;
+
     // Deal with the last partial byte
-    if(remainder > 0) foo = byte[i];
-    for(offset=0; offset<remainder; offset++) {
-        seq[pos++] = byte2base(foo, offset);
+    for(offset=0; pos<sz; offset++) seq[sz - 1 - pos++] = lut[*byte][3 - offset];
+}
+
+/*
+    Binary search a sorted list of non-overlapping blocks for the first one that ends after pos.
+    Returns n if there is no such block.
+*/
+uint32_t twobitFirstBlock(uint32_t *starts, uint32_t *sizes, uint32_t n, uint32_t pos) {
+    uint32_t lo = 0, hi = n, mid;
+
+    //Find the first block starting after pos
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(starts[mid] <= pos) lo = mid + 1;
+        else hi = mid;
     }
+
+    //The block before that may still contain pos
+    if(lo > 0 && starts[lo - 1] + sizes[lo - 1] > pos) return lo - 1;
+    return lo;
 }
 
 /*
-    Replace Ts (or whatever else is being used) with N as appropriate
+    Replace Ts (or whatever else is being used) in N blocks with n. If reverse is set, then seq holds the region in reverse order.
 */
-void NMask(char *seq, TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end) {
+static void NMaskWith(char *seq, TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, char n, int reverse) {
     uint32_t i, width, pos = 0;
     uint32_t blockStart, blockEnd;
 
-    for(i=0; i<tb->idx->nBlockCount[tid]; i++) {
+    i = twobitFirstBlock(tb->idx->nBlockStart[tid], tb->idx->nBlockSizes[tid], tb->idx->nBlockCount[tid], start);
+    for(; i<tb->idx->nBlockCount[tid]; i++) {
         blockStart = tb->idx->nBlockStart[tid][i];
         blockEnd = blockStart + tb->idx->nBlockSizes[tid][i];
         if(blockEnd <= start) continue;
@@ -119,23 +809,32 @@ void NMask(char *seq, TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end) {
             pos = blockStart - start;
             width = blockEnd - blockStart;
         }
-        width += pos;
-        for(; pos < width; pos++) seq[pos] = 'N';
+        if(reverse) pos = end - blockEnd;
+        memset(seq + pos, n, width);
     }
 }
 
 /*
-    Replace uppercase with lower-case letters, if required
+    Replace Ts (or whatever else is being used) with N as appropriate
 */
-void softMask(char *seq, TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end) {
-    uint32_t i, width, pos = 0;
+void NMask(char *seq, TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end) {
+    NMaskWith(seq, tb, tid, start, end, 'N', 0);
+}
+
+/*
+    Replace uppercase with lower-case letters, if required. If reverse is set, then seq holds the region in reverse order.
+*/
+static void softMaskWith(char *seq, TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, int reverse) {
+    uint32_t width, pos = 0;
     uint32_t blockStart, blockEnd;
+    TwoBitMaskIter it;
 
-    if(!tb->idx->maskBlockStart) return;
+    if(!tb->idx->maskBlocks) return;
 
-    for(i=0; i<tb->idx->maskBlockCount[tid]; i++) {
-        blockStart = tb->idx->maskBlockStart[tid][i];
-        blockEnd = blockStart + tb->idx->maskBlockSizes[tid][i];
+    twobitMaskIterInit(tb, tid, start, &it);
+    while(twobitMaskIterNext(&it)) {
+        blockStart = it.start;
+        blockEnd = it.end;
         if(blockEnd <= start) continue;
         if(blockStart >= end) break;
         if(blockStart < start) {
@@ -147,6 +846,7 @@ void softMask(char *seq, TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end)
             pos = blockStart - start;
             width = blockEnd - blockStart;
         }
+        if(reverse) pos = end - blockEnd;
         width += pos;
         for(; pos < width; pos++) {
             if(seq[pos] != 'N') seq[pos] = tolower(seq[pos]);
@@ -154,37 +854,64 @@ void softMask(char *seq, TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end)
     }
 }
 
+void softMask(char *seq, TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end) {
+    softMaskWith(seq, tb, tid, start, end, 0);
+}
+
 /*
-    This is the worker function for twobitSequence, which mostly does error checking
+    Decode the (already bounds checked) range into seq using lut, which must hold at least end-start characters. Bases in N blocks are then set to n and, if soft is set, soft-masked bases are lower-cased. No null terminator is added. If reverse is set, then the bases are written in reverse order, which with a LUT from twobitBuildRcLUT() gives the reverse complement.
+
+    If the file is memory mapped then the packed bytes are decoded directly from the mapping. Otherwise, they're read into *bytes, which is grown as needed (*bytesSz holds its current size). This allows a single scratch buffer to be reused over many calls.
+
+    Returns 0 on success and -1 on error.
 */
-char *constructSequence(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end) {
-    uint32_t sz = end - start + 1;
+static int decodeRegion(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, char *seq, const char (*lut)[4], char n, int soft, int reverse, uint8_t **bytes, size_t *bytesSz) {
     uint32_t blockStart, blockEnd;
-    char *seq = malloc(sz * sizeof(char));
-    uint8_t *bytes = NULL;
+    const uint8_t *packed;
     int offset;
-    if(!seq) return NULL;
 
     //There are 4 bases/byte
     blockStart = start/4;
     offset = start % 4;
     blockEnd = end/4 + ((end % 4) ? 1 : 0);
-    bytes = malloc(blockEnd - blockStart);
-    if(!bytes) goto error;
-
-    if(twobitSeek(tb, tb->idx->offset[tid] + blockStart) != 0) goto error;
-    if(twobitRead(bytes, blockEnd - blockStart, 1, tb) != 1) goto error;
-    bytes2bases(seq, bytes, sz - 1, offset);
-    free(bytes);
 
-    //Null terminate the output
-    seq[sz - 1] = '\0';
+    if(twobitLoadIndex(tb, tid) != 0) return -1;
+    packed = twobitPackedBytes(tb, tb->idx->offset[tid] + blockStart, blockEnd - blockStart, bytes, bytesSz);
+    if(!packed) return -1;
+    if(reverse) bytes2basesRevLUT(seq, packed, end - start, offset, lut);
+    else bytes2basesLUT(seq, packed, end - start, offset, lut);
 
     //N-mask everything
-    NMask(seq, tb, tid, start, end);
+    NMaskWith(seq, tb, tid, start, end, n, reverse);
 
     //Soft-mask if requested
-    softMask(seq, tb, tid, start, end);
+    if(soft) softMaskWith(seq, tb, tid, start, end, reverse);
+
+    return 0;
+}
+
+/*
+    Decode the (already bounds checked) range into seq as upper/lower case letters, see decodeRegion()
+*/
+int decodeSequence(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, char *seq, uint8_t **bytes, size_t *bytesSz) {
+    return decodeRegion(tb, tid, start, end, seq, twobitBaseLUT, 'N', 1, 0, bytes, bytesSz);
+}
+
+/*
+    This is the worker function for twobitSequence, which mostly does error checking
+*/
+char *constructSequence(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end) {
+    uint32_t sz = end - start + 1;
+    char *seq = malloc(sz * sizeof(char));
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    if(!seq) return NULL;
+
+    if(decodeSequence(tb, tid, start, end, seq, &bytes, &bytesSz) != 0) goto error;
+    free(bytes);
+
+    //Null terminate the output
+    seq[sz - 1] = '\0';
 
     return seq;
 
@@ -195,24 +922,15 @@ error:
 }
 
 /*
-    Given a chromosome, name, and optional range, return the corresponding sequence.
+    Given a chromosome ID and optional range, return the corresponding sequence.
 
     The start and end or 0-based half-open, so end-start is the number of bases.
     If both start and end are 0, then the whole chromosome is used.
 
-    On error (e.g., a missing chromosome), NULL is returned.
+    On error (e.g., an invalid tid), NULL is returned.
 */
-char *twobitSequence(TwoBit *tb, char *chrom, uint32_t start, uint32_t end) {
-    uint32_t i, tid=0;
-
-    //Get the chromosome ID
-    for(i=0; i<tb->hdr->nChroms; i++) {
-        if(strcmp(tb->cl->chrom[i], chrom) == 0) {
-            tid = i;
-            break;
-        }
-    }
-    if(tid == 0 && strcmp(tb->cl->chrom[i], chrom) != 0) return NULL;
+char *twobitSequenceTid(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end) {
+    if(tid >= tb->hdr->nChroms) return NULL;
 
     //Get the start/end if not specified
     if(start == end && end == 0) {
@@ -227,151 +945,309 @@ char *twobitSequence(TwoBit *tb, char *chrom, uint32_t start, uint32_t end) {
 }
 
 /*
-    Given a tid and a position, set the various mask variables to an appropriate block of Ns.
-
-     * If maskIdx is not -1, these are set to the first overlapping block (or maskIdx is set to the number of N blocks).
-     * If maskIdx is not -1 then it's incremented and maskStart/maskEnd set appropriately.
+    As twobitSequenceTid, but decoding into a caller-supplied buffer of at least end-start characters. No null terminator is added.
 
-    If the returned interval doesn't overlap the start/end range, then both values will be -1.
+    Returns 0 on success and -1 on error.
 */
-void getMask(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint32_t *maskIdx, uint32_t *maskStart, uint32_t *maskEnd) {
-    if(*maskIdx == (uint32_t) -1) {
-        for((*maskIdx)=0; (*maskIdx)<tb->idx->nBlockCount[tid]; (*maskIdx)++) {
-           *maskStart = tb->idx->nBlockStart[tid][*maskIdx];
-           *maskEnd = (*maskStart) + tb->idx->nBlockSizes[tid][*maskIdx];
-           if(*maskEnd < start) continue;
-           if(*maskEnd >= start) break;
-        }
-    } else if(*maskIdx >= tb->idx->nBlockCount[tid]) {
-        *maskStart = (uint32_t) -1;
-        *maskEnd = (uint32_t) -1;
-    } else {
-        *maskIdx += 1;
-        if(*maskIdx >= tb->idx->nBlockCount[tid]) {
-            *maskStart = (uint32_t) -1;
-            *maskEnd = (uint32_t) -1;
-        } else {
-            *maskStart = tb->idx->nBlockStart[tid][*maskIdx];
-            *maskEnd = (*maskStart) + tb->idx->nBlockSizes[tid][*maskIdx];
-        }
-    }
+int twobitSequenceInto(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, char *seq) {
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    int rv;
 
-    //maskStart = maskEnd = -1 if no overlap
-    if(*maskIdx >= tb->idx->nBlockCount[tid] || *maskStart >= end) {
-        *maskStart = (uint32_t) -1;
-        *maskEnd = (uint32_t) -1;
-    }
-}
+    if(tid >= tb->hdr->nChroms) return -1;
+    if(start == end && end == 0) end = tb->idx->size[tid];
+    if(end > tb->idx->size[tid]) return -1;
+    if(start >= end) return -1;
 
-uint8_t getByteMaskFromOffset(int offset) {
-    switch(offset) {
-        case 0:
-            return (uint8_t) 15;
-        case 1:
-            return (uint8_t) 7;
-        case 2:
-            return (uint8_t) 3;
-    }
-    return 1;
+    rv = decodeSequence(tb, tid, start, end, seq, &bytes, &bytesSz);
+    if(bytes) free(bytes);
+    return rv;
 }
 
-void *twobitBasesWorker(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, int fraction) {
-    void *out;
-    uint32_t tmp[4] = {0, 0, 0, 0}, len = end - start + (start % 4), i = 0, j = 0;
-    uint32_t seqLen = end - start;
-    uint32_t blockStart, blockEnd, maskIdx = (uint32_t) -1, maskStart, maskEnd, foo;
-    uint8_t *bytes = NULL, mask = 0, offset;
+/*
+    As twobitSequenceInto, but writing the reverse complement of the region. This is decoded directly from the packed bytes, which are read from the end.
 
-    if(fraction) {
-        out = malloc(4 * sizeof(double));
-    } else {
-        out = malloc(4 * sizeof(uint32_t));
-    }
-    if(!out) return NULL;
+    Returns 0 on success and -1 on error.
+*/
+int twobitRevCompInto(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, char *seq) {
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    int rv;
 
-    //There are 4 bases/byte
-    blockStart = start/4;
-    offset = start % 4;
-    blockEnd = end/4 + ((end % 4) ? 1 : 0);
-    bytes = malloc(blockEnd - blockStart);
-    if(!bytes) goto error;
-
-    //Set the initial mask, reset start/offset so we always deal with full bytes
-    mask = getByteMaskFromOffset(offset);
-    start = 4 * blockStart;
-    offset = 0;
-
-    if(twobitSeek(tb, tb->idx->offset[tid] + blockStart) != 0) goto error;
-    if(twobitRead(bytes, blockEnd - blockStart, 1, tb) != 1) goto error;
-
-    //Get the index/start/end of the next N-mask block
-    getMask(tb, tid, start, end, &maskIdx, &maskStart, &maskEnd);
-
-    while(i < len) {
-        // Check if we need to jump
-        if(maskIdx != -1 && start + i + 4 >= maskStart) {
-            if(start + i >= maskStart || start + i + 4 - offset > maskStart) {
-                //Jump iff the whole byte is inside an N block
-                if(start + i >= maskStart && start + i + 4 - offset < maskEnd) {
-                    //iff we're fully in an N block then jump
-                    i = maskEnd - start;
-                    getMask(tb, tid, i, end, &maskIdx, &maskStart, &maskEnd);
-                    offset = (start + i) % 4;
-                    j = i / 4;
-                    mask = getByteMaskFromOffset(offset);
-                    i = 4 * j; //Now that the mask has been set, reset i to byte offsets
-                    offset = 0;
-                    continue;
-                }
-
-                //Set the mask, if appropriate
-                foo = 4*j + 4*blockStart; // The smallest position in the byte
-                if(mask & 1 && (foo + 3 >= maskStart && foo + 3 < maskEnd)) mask -= 1;
-                if(mask & 2 && (foo + 2 >= maskStart && foo + 2 < maskEnd)) mask -= 2;
-                if(mask & 4 && (foo + 1 >= maskStart && foo + 1 < maskEnd)) mask -= 4;
-                if(mask & 8 && (foo >= maskStart && foo < maskEnd)) mask -= 8;
-                if(foo + 4 > maskEnd) {
-                    getMask(tb, tid, i, end, &maskIdx, &maskStart, &maskEnd);
-                    continue;
-                }
-            }
-        }
+    if(tid >= tb->hdr->nChroms) return -1;
+    if(start == end && end == 0) end = tb->idx->size[tid];
+    if(end > tb->idx->size[tid]) return -1;
+    if(start >= end) return -1;
 
-        //Ensure that anything after then end is masked
-        if(i+4>=len) {
-            if((mask & 1) && i+3>=len) mask -=1;
-            if((mask & 2) && i+2>=len) mask -=2;
-            if((mask & 4) && i+1>=len) mask -=4;
-            if((mask & 8) && i>=len) mask -=8;
-        }
+    rv = decodeRegion(tb, tid, start, end, seq, twobitBaseRcLUT, 'N', 1, 1, &bytes, &bytesSz);
+    if(bytes) free(bytes);
+    return rv;
+}
+
+/*
+    As twobitSequenceInto, but with bases coded as A=0, C=1, G=2, T=3 and N=4.
+
+    Returns 0 on success and -1 on error.
+*/
+int twobitCodesInto(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint8_t *codes) {
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    int rv;
+
+    if(tid >= tb->hdr->nChroms) return -1;
+    if(start == end && end == 0) end = tb->idx->size[tid];
+    if(end > tb->idx->size[tid]) return -1;
+    if(start >= end) return -1;
+
+    rv = decodeRegion(tb, tid, start, end, (char*) codes, twobitCodeLUT, 4, 0, 0, &bytes, &bytesSz);
+    if(bytes) free(bytes);
+    return rv;
+}
+
+/*
+    As twobitSequenceTid, but with a chromosome name. On error (e.g., a missing chromosome), NULL is returned.
+*/
+char *twobitSequence(TwoBit *tb, char *chrom, uint32_t start, uint32_t end) {
+    uint32_t tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) return NULL;
+
+    return twobitSequenceTid(tb, tid, start, end);
+}
+
+/*
+    Fetch many regions at once. All regions are checked before anything is decoded, so either every region is returned or NULL is.
+
+    The sequences are concatenated into a single null-terminated buffer, with sequence i spanning [offsets[i], offsets[i+1]). A single scratch buffer is used for the packed bytes of every region.
+*/
+char *twobitSequenceBatch(TwoBit *tb, uint32_t n, uint32_t *tids, uint32_t *starts, uint32_t *ends, uint64_t *offsets) {
+    uint32_t i, start, end;
+    uint64_t total = 0;
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    char *seq = NULL;
+
+    //Sanity check the bounds and get the total length
+    for(i=0; i<n; i++) {
+        if(tids[i] >= tb->hdr->nChroms) return NULL;
+        start = starts[i];
+        end = ends[i];
+        if(start == end && end == 0) end = tb->idx->size[tids[i]];
+        if(end > tb->idx->size[tids[i]]) return NULL;
+        if(start >= end) return NULL;
+        offsets[i] = total;
+        total += end - start;
+    }
+    offsets[n] = total;
+
+    seq = malloc(total + 1);
+    if(!seq) return NULL;
+
+    for(i=0; i<n; i++) {
+        start = starts[i];
+        end = start + (uint32_t) (offsets[i + 1] - offsets[i]);
+        if(decodeSequence(tb, tids[i], start, end, seq + offsets[i], &bytes, &bytesSz) != 0) goto error;
+    }
+    if(bytes) free(bytes);
+    seq[total] = '\0';
+
+    return seq;
+
+error:
+    if(bytes) free(bytes);
+    free(seq);
+    return NULL;
+}
 
-        foo = bytes[j++];
-        //Offset 3
-        if(mask & 1) {
-            tmp[foo & 3]++;
+/*
+    Return the index of the first N block on tid that ends after pos, or nBlockCount[tid] if there is none
+*/
+uint32_t firstNBlock(TwoBit *tb, uint32_t tid, uint32_t pos) {
+    return twobitFirstBlock(tb->idx->nBlockStart[tid], tb->idx->nBlockSizes[tid], tb->idx->nBlockCount[tid], pos);
+}
+
+/*
+    Count the A/C/G/T bases in [pos, end) of packed, which holds the bases from first onwards, adding them to counts
+    (in TCAG order). Only the stretches between N blocks are counted, so bases within N blocks are never looked at.
+
+    The N blocks are searched from *blk, which is left at the first block ending after end, so that successive
+    stretches in increasing order don't each need a binary search.
+*/
+static void countPacked(TwoBit *tb, uint32_t tid, const uint8_t *packed, uint32_t first, uint32_t pos, uint32_t end, uint32_t *blk, uint64_t counts[4]) {
+    uint32_t i, blockStart, blockEnd;
+
+    for(i=*blk; i<tb->idx->nBlockCount[tid] && pos < end; i++) {
+        blockStart = tb->idx->nBlockStart[tid][i];
+        if(blockStart >= end) break;
+        blockEnd = blockStart + tb->idx->nBlockSizes[tid][i];
+        if(blockStart > pos) countBases(packed, pos - first, blockStart - first, counts);
+        if(blockEnd > pos) pos = blockEnd;
+        if(blockEnd > end) break;
+    }
+    if(pos < end) countBases(packed, pos - first, end - first, counts);
+    *blk = i;
+}
+
+/*
+    Count the A/C/G/T bases in [start, end), which must already be bounds checked, adding them to counts (in TCAG order).
+
+    *bytes and *bytesSz are as in decodeSequence().
+
+    Returns 0 on success and -1 on error.
+*/
+int countRegion(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint64_t counts[4], uint8_t **bytes, size_t *bytesSz) {
+    uint32_t blk = firstNBlock(tb, tid, start);
+    const uint8_t *packed;
+
+    packed = twobitPackedBytes(tb, tb->idx->offset[tid] + start/4, end/4 + ((end % 4) ? 1 : 0) - start/4, bytes, bytesSz);
+    if(!packed) return -1;
+    countPacked(tb, tid, packed, start & ~3U, start, end, &blk, counts);
+
+    return 0;
+}
+
+/*
+    Compute the composition index checkpoints for tid into cp, which must hold 4 * (size/step + 1) values.
+
+    This walks the chromosome once, alternating between stretches of N (which are skipped) and countable
+    sequence, splitting both at checkpoint boundaries.
+
+    Returns 0 on success and -1 on error.
+*/
+static int compIdxFill(TwoBit *tb, uint32_t tid, uint32_t step, uint32_t *cp) {
+    uint32_t size = tb->idx->size[tid], pos = 0, k = 1, nextN = 0, segEnd, e, j;
+    uint32_t nBlocks = tb->idx->nBlockCount[tid], *nStart = tb->idx->nBlockStart[tid], *nSize = tb->idx->nBlockSizes[tid];
+    uint64_t cum[4] = {0, 0, 0, 0};
+    uint8_t *scratch = NULL;
+    const uint8_t *packed;
+    size_t scratchSz = 0;
+
+    memset(cp, 0, 4 * sizeof(uint32_t));
+    if(size == 0) return 0;
+    packed = twobitPackedBytes(tb, tb->idx->offset[tid], size/4 + ((size % 4) ? 1 : 0), &scratch, &scratchSz);
+    if(!packed) return -1;
+
+    while(pos < size) {
+        segEnd = ((uint64_t) k * step < size) ? k * step : size;
+        while(nextN < nBlocks && nStart[nextN] + nSize[nextN] <= pos) nextN++;
+        if(nextN < nBlocks && nStart[nextN] <= pos) {
+            //Inside an N block
+            e = nStart[nextN] + nSize[nextN];
+            pos = (e < segEnd) ? e : segEnd;
+        } else {
+            e = (nextN < nBlocks && nStart[nextN] < segEnd) ? nStart[nextN] : segEnd;
+            countBases(packed, pos, e, cum);
+            pos = e;
         }
-        foo >>= 2;
-        mask >>= 1;
-        //Offset 2
-        if(mask & 1) {
-            tmp[foo & 3]++;
+        if(pos == segEnd && (uint64_t) k * step <= size) {
+            for(j=0; j<4; j++) cp[4 * k + j] = (uint32_t) cum[j];
+            k++;
         }
-        foo >>= 2;
-        mask >>= 1;
-        //Offset 1
-        if(mask & 1) {
-            tmp[foo & 3]++;
+    }
+
+    if(scratch) free(scratch);
+    return 0;
+}
+
+/*
+    Return the composition index checkpoints for tid, computing them if needed. NULL is returned on error.
+*/
+static uint32_t *compIdxGet(TwoBit *tb, uint32_t tid) {
+    TwoBitCompIdx *comp = tb->comp;
+    uint32_t *cp = __atomic_load_n(&comp->counts[tid], __ATOMIC_ACQUIRE);
+    if(cp) return cp;
+
+    pthread_mutex_lock(&comp->lock);
+    cp = comp->counts[tid];
+    if(!cp) {
+        cp = malloc(4 * sizeof(uint32_t) * (tb->idx->size[tid] / comp->step + 1));
+        if(cp && compIdxFill(tb, tid, comp->step, cp) != 0) {
+            free(cp);
+            cp = NULL;
         }
-        foo >>= 2;
-        mask >>= 1;
-        //Offset 0
-        if(mask & 1) {
-            tmp[foo & 3]++; // offset 0
+        if(cp) __atomic_store_n(&comp->counts[tid], cp, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&comp->lock);
+
+    return cp;
+}
+
+/*
+    Count the A/C/G/T bases in [start, end) as countRegion() does, but use the composition index for everything between the first and last checkpoints in the interval.
+*/
+static int countRegionIndexed(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint64_t counts[4], uint8_t **bytes, size_t *bytesSz) {
+    uint32_t step = tb->comp->step, a, b, j, *cp;
+
+    a = start / step + ((start % step) ? 1 : 0);
+    b = end / step;
+    if(a >= b) return countRegion(tb, tid, start, end, counts, bytes, bytesSz);
+
+    cp = compIdxGet(tb, tid);
+    if(!cp) return -1;
+    for(j=0; j<4; j++) counts[j] += cp[4 * b + j] - cp[4 * a + j];
+    if(start < a * step && countRegion(tb, tid, start, a * step, counts, bytes, bytesSz) != 0) return -1;
+    if(b * step < end && countRegion(tb, tid, b * step, end, counts, bytes, bytesSz) != 0) return -1;
+
+    return 0;
+}
+
+static void twobitCompIdxDestroy(TwoBit *tb) {
+    uint32_t i;
+
+    if(tb->comp) {
+        if(tb->comp->counts) {
+            for(i=0; i<tb->hdr->nChroms; i++) {
+                if(tb->comp->counts[i]) free(tb->comp->counts[i]);
+            }
+            free(tb->comp->counts);
         }
-        i += 4;
-        mask = 15;
+        pthread_mutex_destroy(&tb->comp->lock);
+        free(tb->comp);
+        tb->comp = NULL;
     }
-    free(bytes);
+}
+
+int twobitSetCompositionIndex(TwoBit *tb, uint32_t step) {
+    TwoBitCompIdx *comp;
+
+    if(step % 4) return -1;
+    twobitCompIdxDestroy(tb);
+    if(step == 0) return 0;
+
+    comp = calloc(1, sizeof(TwoBitCompIdx));
+    if(!comp) return -1;
+    comp->counts = calloc(tb->hdr->nChroms, sizeof(uint32_t*));
+    if(!comp->counts) {
+        free(comp);
+        return -1;
+    }
+    comp->step = step;
+    pthread_mutex_init(&comp->lock, NULL);
+    tb->comp = comp;
+
+    return 0;
+}
+
+void *twobitBasesWorker(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, int fraction) {
+    void *out;
+    uint64_t tmp[4] = {0, 0, 0, 0};
+    uint32_t seqLen = end - start;
+    uint8_t *scratch = NULL;
+    size_t scratchSz = 0;
+
+    if(fraction) {
+        out = malloc(4 * sizeof(double));
+    } else {
+        out = malloc(4 * sizeof(uint32_t));
+    }
+    if(!out) return NULL;
+
+    if(twobitLoadIndex(tb, tid) != 0) goto error;
+    if(tb->comp) {
+        if(countRegionIndexed(tb, tid, start, end, tmp, &scratch, &scratchSz) != 0) goto error;
+    } else {
+        if(countRegion(tb, tid, start, end, tmp, &scratch, &scratchSz) != 0) goto error;
+    }
+    if(scratch) free(scratch);
 
     //out is in TCAG order, since that's how 2bit is stored.
     //However, for whatever reason I went with ACTG in the first release...
@@ -391,22 +1267,12 @@ void *twobitBasesWorker(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end,
 
 error:
     if(out) free(out);
-    if(bytes) free(bytes);
+    if(scratch) free(scratch);
     return NULL;
 }
 
-void *twobitBases(TwoBit *tb, char *chrom, uint32_t start, uint32_t end, int fraction) {
-    uint32_t tid = 0, i;
-
-    //Get the chromosome ID
-    for(i=0; i<tb->hdr->nChroms; i++) {
-        if(strcmp(tb->cl->chrom[i], chrom) == 0) {
-            tid = i;
-            break;
-        }
-    }
-
-    if(tid == 0 && strcmp(tb->cl->chrom[i], chrom) != 0) return NULL;
+void *twobitBasesTid(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, int fraction) {
+    if(tid >= tb->hdr->nChroms) return NULL;
 
     //Get the start/end if not specified
     if(start == end && end == 0) {
@@ -420,29 +1286,812 @@ void *twobitBases(TwoBit *tb, char *chrom, uint32_t start, uint32_t end, int fra
     return twobitBasesWorker(tb, tid, start, end, fraction);
 }
 
+void *twobitBases(TwoBit *tb, char *chrom, uint32_t start, uint32_t end, int fraction) {
+    uint32_t tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) return NULL;
+
+    return twobitBasesTid(tb, tid, start, end, fraction);
+}
+
+/*
+    The soft-masked blocks are walked in order, counting the A/C/G/T bases within each of them with a second cursor
+    into the N blocks. The unmasked counts are then the differences.
+*/
+int twobitBaseStats(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, TwoBitBaseStats *stats) {
+    uint64_t all[4] = {0, 0, 0, 0}, masked[4] = {0, 0, 0, 0};
+    uint32_t blk, softMasked = 0, s, e;
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    const uint8_t *packed = NULL;
+    TwoBitMaskIter it;
+
+    if(tid >= tb->hdr->nChroms) return -1;
+    if(start == end && end == 0) end = tb->idx->size[tid];
+    if(end > tb->idx->size[tid]) return -1;
+    if(start >= end) return -1;
+    if(twobitLoadIndex(tb, tid) != 0) return -1;
+
+    //With the composition index, the packed bases are only read for the soft-masked blocks, one block at a time
+    if(tb->comp) {
+        if(countRegionIndexed(tb, tid, start, end, all, &bytes, &bytesSz) != 0) goto error;
+    } else {
+        packed = twobitPackedBytes(tb, tb->idx->offset[tid] + start/4, end/4 + ((end % 4) ? 1 : 0) - start/4, &bytes, &bytesSz);
+        if(!packed) goto error;
+        blk = firstNBlock(tb, tid, start);
+        countPacked(tb, tid, packed, start & ~3U, start, end, &blk, all);
+    }
+
+    blk = firstNBlock(tb, tid, start);
+    twobitMaskIterInit(tb, tid, start, &it);
+    while(twobitMaskIterNext(&it) && it.start < end) {
+        s = (it.start > start) ? it.start : start;
+        e = (it.end < end) ? it.end : end;
+        softMasked += e - s;
+        if(tb->comp) {
+            packed = twobitPackedBytes(tb, tb->idx->offset[tid] + s/4, e/4 + ((e % 4) ? 1 : 0) - s/4, &bytes, &bytesSz);
+            if(!packed) goto error;
+            countPacked(tb, tid, packed, s & ~3U, s, e, &blk, masked);
+        } else {
+            countPacked(tb, tid, packed, start & ~3U, s, e, &blk, masked);
+        }
+    }
+    if(bytes) free(bytes);
+
+    stats->A = all[2];
+    stats->C = all[1];
+    stats->G = all[3];
+    stats->T = all[0];
+    stats->N = (end - start) - (all[0] + all[1] + all[2] + all[3]);
+    stats->softMasked = softMasked;
+    stats->unmasked = (all[0] + all[1] + all[2] + all[3]) - (masked[0] + masked[1] + masked[2] + masked[3]);
+    stats->unmaskedGC = (all[1] + all[3]) - (masked[1] + masked[3]);
+    return 0;
+
+error:
+    if(bytes) free(bytes);
+    return -1;
+}
+
+uint32_t twobitWindowNumber(uint32_t start, uint32_t end, uint32_t width, uint32_t step) {
+    if(step == 0 || end < start || end - start < width) return 0;
+    return (end - start - width) / step + 1;
+}
+
+int twobitWindowCounts(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint32_t width, uint32_t step, uint32_t *counts) {
+    uint32_t n, nBytes;
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    const uint8_t *packed;
+
+    if(tid >= tb->hdr->nChroms) return -1;
+    if(start == end && end == 0) end = tb->idx->size[tid];
+    if(end > tb->idx->size[tid]) return -1;
+    if(width == 0 || step == 0) return -1;
+    n = twobitWindowNumber(start, end, width, step);
+    if(n == 0) return 0;
+    if(twobitLoadIndex(tb, tid) != 0) return -1;
+
+    //Only the bases actually covered by a window are needed
+    end = start + (n - 1) * step + width;
+    nBytes = end/4 + ((end % 4) ? 1 : 0) - start/4;
+    packed = twobitPackedBytes(tb, tb->idx->offset[tid] + start/4, nBytes, &bytes, &bytesSz);
+    if(!packed) return -1;
+
+    countWindows(packed, nBytes, start & ~3U, tb->idx->nBlockStart[tid], tb->idx->nBlockSizes[tid], tb->idx->nBlockCount[tid], firstNBlock(tb, tid, start), start, n, width, step, counts);
+
+    if(bytes) free(bytes);
+    return 0;
+}
+
+/*
+    As twobitWindowCounts(), but with 16 dinucleotide counts per window
+*/
+int twobitWindowDinucleotides(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint32_t width, uint32_t step, uint32_t *counts) {
+    uint32_t n, nBytes;
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    const uint8_t *packed;
+
+    if(tid >= tb->hdr->nChroms) return -1;
+    if(start == end && end == 0) end = tb->idx->size[tid];
+    if(end > tb->idx->size[tid]) return -1;
+    if(width == 0 || step == 0) return -1;
+    n = twobitWindowNumber(start, end, width, step);
+    if(n == 0) return 0;
+    if(twobitLoadIndex(tb, tid) != 0) return -1;
+
+    end = start + (n - 1) * step + width;
+    nBytes = end/4 + ((end % 4) ? 1 : 0) - start/4;
+    packed = twobitPackedBytes(tb, tb->idx->offset[tid] + start/4, nBytes, &bytes, &bytesSz);
+    if(!packed) return -1;
+
+    countPairWindows(packed, nBytes, start & ~3U, tb->idx->nBlockStart[tid], tb->idx->nBlockSizes[tid], tb->idx->nBlockCount[tid], firstNBlock(tb, tid, start), start, n, width, step, counts);
+
+    if(bytes) free(bytes);
+    return 0;
+}
+
+/*
+    The dinucleotide counts of a single region are simply those of a single window
+*/
+int twobitDinucleotides(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint32_t counts[16]) {
+    if(tid >= tb->hdr->nChroms) return -1;
+    if(start == end && end == 0) end = tb->idx->size[tid];
+    if(end > tb->idx->size[tid]) return -1;
+    if(start >= end) return -1;
+
+    return twobitWindowDinucleotides(tb, tid, start, end, end - start, 1, counts);
+}
+
+/*
+    K-mer counting
+
+    A rolling code of the last k bases (in ACGT order, 2 bits each) is kept along with that of their reverse
+    complement, both straight off the packed bytes. The complement of an ACGT code is 3-code. Both are reset at
+    each N block, since no k-mer spanning one is counted.
+*/
+static inline __attribute__((always_inline)) void kmerStep(uint64_t *fwd, uint64_t *rev, uint32_t c, uint64_t mask, int shift, int canonical, int atomic, uint64_t *counts) {
+    uint64_t idx;
+
+    *fwd = ((*fwd << 2) | c) & mask;
+    idx = *fwd;
+    if(canonical) {
+        *rev = (*rev >> 2) | ((uint64_t) (3 - c) << shift);
+        if(*rev < idx) idx = *rev;
+    }
+    if(atomic) __atomic_fetch_add(counts + idx, 1, __ATOMIC_RELAXED);
+    else counts[idx]++;
+}
+
+/*
+    Count the k-mers entirely within [a, b), which holds no Ns. Positions are relative to the first base of packed.
+*/
+static inline __attribute__((always_inline)) void kmerSegmentWith(const uint8_t *packed, uint32_t a, uint32_t b, int k, int canonical, int atomic, uint64_t *counts) {
+    uint64_t fwd = 0, rev = 0, mask = (1ULL << (2 * k)) - 1;
+    int shift = 2 * (k - 1);
+    uint32_t p, c;
+    uint8_t byte;
+
+    if(b - a < (uint32_t) k) return;
+
+    //Fill in the first k-1 bases
+    for(p=a; p<a + k - 1; p++) {
+        c = (twobitAlphaByte[packed[p >> 2]] >> (6 - 2 * (p & 3))) & 3;
+        fwd = (fwd << 2) | c;
+        rev = (rev >> 2) | ((uint64_t) (3 - c) << shift);
+    }
+
+    //Then every base ends a k-mer
+    for(; p<b && (p & 3); p++) kmerStep(&fwd, &rev, (twobitAlphaByte[packed[p >> 2]] >> (6 - 2 * (p & 3))) & 3, mask, shift, canonical, atomic, counts);
+    for(; p + 4 <= b; p += 4) {
+        byte = twobitAlphaByte[packed[p >> 2]];
+        kmerStep(&fwd, &rev, byte >> 6, mask, shift, canonical, atomic, counts);
+        kmerStep(&fwd, &rev, (byte >> 4) & 3, mask, shift, canonical, atomic, counts);
+        kmerStep(&fwd, &rev, (byte >> 2) & 3, mask, shift, canonical, atomic, counts);
+        kmerStep(&fwd, &rev, byte & 3, mask, shift, canonical, atomic, counts);
+    }
+    for(; p<b; p++) kmerStep(&fwd, &rev, (twobitAlphaByte[packed[p >> 2]] >> (6 - 2 * (p & 3))) & 3, mask, shift, canonical, atomic, counts);
+}
+
+static void kmerSegment(const uint8_t *packed, uint32_t a, uint32_t b, int k, int canonical, int atomic, uint64_t *counts) {
+    if(atomic) {
+        if(canonical) kmerSegmentWith(packed, a, b, k, 1, 1, counts);
+        else kmerSegmentWith(packed, a, b, k, 0, 1, counts);
+    } else {
+        if(canonical) kmerSegmentWith(packed, a, b, k, 1, 0, counts);
+        else kmerSegmentWith(packed, a, b, k, 0, 0, counts);
+    }
+}
+
+/*
+    Count the k-mers in the (already bounds checked) region, skipping any overlapping an N block. If atomic is set, then counts may be shared with other threads.
+
+    *bytes and *bytesSz are as in decodeSequence().
+
+    Returns 0 on success and -1 on error.
+*/
+static int kmerRegion(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, int k, int canonical, int atomic, uint64_t *counts, uint8_t **bytes, size_t *bytesSz) {
+    uint32_t i, pos = start, first = start & ~3U, blockStart, blockEnd;
+    const uint8_t *packed;
+
+    if(twobitLoadIndex(tb, tid) != 0) return -1;
+    packed = twobitPackedBytes(tb, tb->idx->offset[tid] + start/4, end/4 + ((end % 4) ? 1 : 0) - start/4, bytes, bytesSz);
+    if(!packed) return -1;
+
+    for(i=firstNBlock(tb, tid, start); i<tb->idx->nBlockCount[tid] && pos < end; i++) {
+        blockStart = tb->idx->nBlockStart[tid][i];
+        if(blockStart >= end) break;
+        blockEnd = blockStart + tb->idx->nBlockSizes[tid][i];
+        if(blockStart > pos) kmerSegment(packed, pos - first, blockStart - first, k, canonical, atomic, counts);
+        if(blockEnd > pos) pos = blockEnd;
+    }
+    if(pos < end) kmerSegment(packed, pos - first, end - first, k, canonical, atomic, counts);
+
+    return 0;
+}
+
+int twobitKmerCounts(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, int k, int canonical, uint64_t *counts) {
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    int rv;
+
+    if(tid >= tb->hdr->nChroms) return -1;
+    if(start == end && end == 0) end = tb->idx->size[tid];
+    if(end > tb->idx->size[tid]) return -1;
+    if(start >= end) return -1;
+    if(k < 1 || k > TWOBIT_MAX_K) return -1;
+
+    rv = kmerRegion(tb, tid, start, end, k, canonical, 0, counts, &bytes, &bytesSz);
+    if(bytes) free(bytes);
+    return rv;
+}
+
+/*
+    The state shared by the threads of twobitKmerCountsGenome(). Each thread takes the next chromosome until none are left.
+*/
+typedef struct {
+    TwoBit *tb;
+    int k;
+    int canonical;
+    int private; /* Whether each thread counts into its own array, which is then added to counts */
+    int atomic; /* Otherwise, whether counts is shared by more than one thread */
+    uint32_t next;
+    int err;
+    uint64_t *counts;
+    pthread_mutex_t lock;
+} kmerJob;
+
+static void *kmerWorker(void *arg) {
+    kmerJob *job = arg;
+    uint64_t i, n = 1ULL << (2 * job->k), *counts = job->counts;
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    uint32_t tid;
+
+    if(job->private) {
+        counts = calloc(n, sizeof(uint64_t));
+        if(!counts) {
+            __atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+
+    while(!__atomic_load_n(&job->err, __ATOMIC_RELAXED)) {
+        tid = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(tid >= job->tb->hdr->nChroms) break;
+        if(job->tb->idx->size[tid] == 0) continue;
+        if(kmerRegion(job->tb, tid, 0, job->tb->idx->size[tid], job->k, job->canonical, job->atomic, counts, &bytes, &bytesSz) != 0) {
+            __atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if(bytes) free(bytes);
+
+    if(job->private) {
+        pthread_mutex_lock(&job->lock);
+        for(i=0; i<n; i++) job->counts[i] += counts[i];
+        pthread_mutex_unlock(&job->lock);
+        free(counts);
+    }
+    return NULL;
+}
+
+int twobitKmerCountsGenome(TwoBit *tb, int k, int canonical, int nThreads, uint64_t *counts) {
+    pthread_t *threads = NULL;
+    kmerJob job;
+    int i, nStarted = 0;
+    long nCPU;
+
+    if(k < 1 || k > TWOBIT_MAX_K) return -1;
+    if(nThreads <= 0) {
+        nCPU = sysconf(_SC_NPROCESSORS_ONLN);
+        nThreads = (nCPU > 0) ? (int) nCPU : 1;
+    }
+    if((uint32_t) nThreads > tb->hdr->nChroms) nThreads = (tb->hdr->nChroms) ? (int) tb->hdr->nChroms : 1;
+
+    job.tb = tb;
+    job.k = k;
+    job.canonical = canonical;
+    //Small tables are cheap to give each thread, large ones are updated atomically (and rarely contended)
+    job.private = (nThreads > 1 && k <= 10);
+    job.atomic = (nThreads > 1 && !job.private);
+    job.next = 0;
+    job.err = 0;
+    job.counts = counts;
+    pthread_mutex_init(&job.lock, NULL);
+
+    if(nThreads > 1) {
+        threads = malloc((nThreads - 1) * sizeof(pthread_t));
+        if(threads) {
+            for(i=0; i<nThreads - 1; i++) {
+                if(pthread_create(threads + i, NULL, kmerWorker, &job) != 0) break;
+                nStarted++;
+            }
+        }
+    }
+    //If no threads could be started, this still uses atomics, which is merely slower
+    kmerWorker(&job);
+    for(i=0; i<nStarted; i++) pthread_join(threads[i], NULL);
+
+    if(threads) free(threads);
+    pthread_mutex_destroy(&job.lock);
+    return (job.err) ? -1 : 0;
+}
+
+/*
+    Motif scanning
+
+    Patterns are matched with shift-and: bit i of the state is set if the last i+1 bases match the first i+1 bases of
+    the pattern. The states of the pattern and of its reverse complement are kept in the low and high halves of a
+    single word, since a bit shifted from one into the other is always set by the next step anyway.
+*/
+
+//The codes (as a bit mask in TCAG order) matched by an IUPAC symbol, or 0 if it isn't one
+static int motifSymbolMask(char c) {
+    switch(toupper(c)) {
+    case 'A': return 4;
+    case 'C': return 2;
+    case 'G': return 8;
+    case 'T': case 'U': return 1;
+    case 'R': return 4 | 8;
+    case 'Y': return 2 | 1;
+    case 'S': return 8 | 2;
+    case 'W': return 4 | 1;
+    case 'K': return 8 | 1;
+    case 'M': return 4 | 2;
+    case 'B': return 2 | 8 | 1;
+    case 'D': return 4 | 8 | 1;
+    case 'H': return 4 | 2 | 1;
+    case 'V': return 4 | 2 | 8;
+    case 'N': return 15;
+    }
+    return 0;
+}
+
+typedef struct {
+    uint64_t mask[4]; //For each code, the pattern positions matching it
+    uint64_t match; //The state bits denoting a complete match
+    uint32_t m; //The pattern length
+    uint32_t *hits;
+    uint64_t nHits;
+    uint64_t mHits;
+} motifScan;
+
+static int motifHit(motifScan *ms, uint32_t pos) {
+    uint32_t *tmp;
+
+    if(ms->nHits == ms->mHits) {
+        ms->mHits = (ms->mHits) ? 2 * ms->mHits : 1024;
+        tmp = realloc(ms->hits, ms->mHits * sizeof(uint32_t));
+        if(!tmp) return -1;
+        ms->hits = tmp;
+    }
+    ms->hits[ms->nHits++] = pos;
+    return 0;
+}
+
+static inline __attribute__((always_inline)) int motifStep(motifScan *ms, uint64_t *d, uint32_t c, uint32_t pos) {
+    *d = ((*d << 1) | 1 | (1ULL << 32)) & ms->mask[c];
+    if(*d & ms->match) return motifHit(ms, pos + 1 - ms->m);
+    return 0;
+}
+
+/*
+    Scan [a, b), which holds no Ns, where positions are relative to the first base of packed and offset is added to each hit
+*/
+static int motifSegment(motifScan *ms, const uint8_t *packed, uint32_t a, uint32_t b, uint32_t offset) {
+    uint64_t d = 0;
+    uint32_t p;
+    uint8_t byte;
+
+    if(b - a < ms->m) return 0;
+    for(p=a; p<b && (p & 3); p++) {
+        if(motifStep(ms, &d, (packed[p >> 2] >> (6 - 2 * (p & 3))) & 3, p + offset)) return -1;
+    }
+    for(; p + 4 <= b; p += 4) {
+        byte = packed[p >> 2];
+        if(motifStep(ms, &d, byte >> 6, p + offset)) return -1;
+        if(motifStep(ms, &d, (byte >> 4) & 3, p + 1 + offset)) return -1;
+        if(motifStep(ms, &d, (byte >> 2) & 3, p + 2 + offset)) return -1;
+        if(motifStep(ms, &d, byte & 3, p + 3 + offset)) return -1;
+    }
+    for(; p<b; p++) {
+        if(motifStep(ms, &d, (packed[p >> 2] >> (6 - 2 * (p & 3))) & 3, p + offset)) return -1;
+    }
+    return 0;
+}
+
+int twobitFindMotif(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, const char *pattern, int bothStrands, uint32_t **hits, uint64_t *nHits) {
+    motifScan ms;
+    uint32_t i, c, pos, first = start & ~3U, blockStart, blockEnd;
+    const uint8_t *packed;
+    uint8_t *bytes = NULL;
+    size_t bytesSz = 0;
+    int sym;
+
+    *hits = NULL;
+    *nHits = 0;
+    if(tid >= tb->hdr->nChroms) return -1;
+    if(start == end && end == 0) end = tb->idx->size[tid];
+    if(end > tb->idx->size[tid]) return -1;
+    if(start >= end) return -1;
+
+    memset(&ms, 0, sizeof(motifScan));
+    ms.m = strlen(pattern);
+    if(ms.m == 0 || ms.m > TWOBIT_MAX_MOTIF) return -1;
+    for(i=0; i<ms.m; i++) {
+        sym = motifSymbolMask(pattern[i]);
+        if(!sym) return -1;
+        for(c=0; c<4; c++) {
+            if(sym & (1 << c)) {
+                ms.mask[c] |= 1ULL << i;
+                //The reverse complement has the complement (c^2) at position m-1-i
+                if(bothStrands) ms.mask[c ^ 2] |= 1ULL << (32 + ms.m - 1 - i);
+            }
+        }
+    }
+    ms.match = 1ULL << (ms.m - 1);
+    if(bothStrands) ms.match |= 1ULL << (32 + ms.m - 1);
+
+    if(twobitLoadIndex(tb, tid) != 0) return -1;
+    packed = twobitPackedBytes(tb, tb->idx->offset[tid] + start/4, end/4 + ((end % 4) ? 1 : 0) - start/4, &bytes, &bytesSz);
+    if(!packed) goto error;
+
+    pos = start;
+    for(i=firstNBlock(tb, tid, start); i<tb->idx->nBlockCount[tid] && pos < end; i++) {
+        blockStart = tb->idx->nBlockStart[tid][i];
+        if(blockStart >= end) break;
+        blockEnd = blockStart + tb->idx->nBlockSizes[tid][i];
+        if(blockStart > pos && motifSegment(&ms, packed, pos - first, blockStart - first, first) != 0) goto error;
+        if(blockEnd > pos) pos = blockEnd;
+    }
+    if(pos < end && motifSegment(&ms, packed, pos - first, end - first, first) != 0) goto error;
+
+    if(bytes) free(bytes);
+    *hits = ms.hits;
+    *nHits = ms.nHits;
+    return 0;
+
+error:
+    if(bytes) free(bytes);
+    if(ms.hits) free(ms.hits);
+    return -1;
+}
+
 /*
     Given a chromosome, chrom, return it's length. 0 is used if the chromosome isn't present.
 */
 uint32_t twobitChromLen(TwoBit *tb, char *chrom) {
-    uint32_t i;
+    uint32_t tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) return 0;
+    return tb->idx->size[tid];
+}
+
+/*
+    FNV-1a, which is plenty good enough for chromosome names
+*/
+static uint32_t twobitHashName(const char *name) {
+    uint32_t h = 2166136261U;
+    while(*name) {
+        h ^= (uint8_t) *name++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/*
+    Return the tid of a chromosome, or (uint32_t) -1 if it's not present.
+*/
+uint32_t twobitChromTid(TwoBit *tb, char *chrom) {
+    uint32_t h = twobitHashName(chrom), slot, mask = tb->cl->hashSize - 1;
+    uint64_t entry;
+
+    slot = h & mask;
+    while((entry = tb->cl->hash[slot]) != 0) {
+        if((uint32_t) (entry >> 32) == h && strcmp(tb->cl->chrom[(uint32_t) entry - 1], chrom) == 0) return (uint32_t) entry - 1;
+        slot = (slot + 1) & mask;
+    }
+    return (uint32_t) -1;
+}
+
+/*
+    Build the name->tid hash table in tb->cl. The table is kept at most half full.
+
+    Returns 0 on success and -1 on error.
+*/
+int twobitChromHashBuild(TwoBit *tb) {
+    uint32_t i, h, slot, mask, *hashes;
+    uint64_t entry;
+    TwoBitCL *cl = tb->cl;
+
+    cl->hashSize = 16;
+    while(cl->hashSize < 2 * tb->hdr->nChroms) cl->hashSize <<= 1;
+    cl->hash = calloc(cl->hashSize, sizeof(uint64_t));
+    if(!cl->hash) return -1;
+    mask = cl->hashSize - 1;
+
+    //Hash everything first, so the slots can be prefetched ahead of use
+    hashes = malloc(tb->hdr->nChroms * sizeof(uint32_t));
+    if(!hashes) return -1;
+    for(i=0; i<tb->hdr->nChroms; i++) hashes[i] = twobitHashName(cl->chrom[i]);
+
     for(i=0; i<tb->hdr->nChroms; i++) {
-        if(strcmp(tb->cl->chrom[i], chrom) == 0) return tb->idx->size[i];
+        if(i + 16 < tb->hdr->nChroms) __builtin_prefetch(cl->hash + (hashes[i + 16] & mask), 1);
+        h = hashes[i];
+        slot = h & mask;
+        //Duplicate names resolve to the first occurrence, as with a linear scan
+        while((entry = cl->hash[slot]) != 0) {
+            if((uint32_t) (entry >> 32) == h && strcmp(cl->chrom[(uint32_t) entry - 1], cl->chrom[i]) == 0) break;
+            slot = (slot + 1) & mask;
+        }
+        if(entry == 0) cl->hash[slot] = ((uint64_t) h << 32) | (i + 1);
+    }
+    free(hashes);
+
+    return 0;
+}
+
+/*
+    Return sz bytes (8-byte aligned) from the arena, or NULL on error. Slabs start small and double in size up to TWOBIT_SLAB_SIZE, so small files don't pay for a large slab. Requests larger than a quarter of a slab get their own slab, so that little space is wasted at the end of the current one.
+*/
+#define TWOBIT_SLAB_SIZE (1<<20)
+static void *twobitArenaAlloc(TwoBitArena *a, uint64_t sz) {
+    uint8_t *slab, **slabs;
+    uint64_t slabSize = (a->bytes < 4096) ? 4096 : a->bytes;
+    void *p;
+
+    sz = (sz + 7) & ~((uint64_t) 7);
+    if(sz == 0) return NULL;
+    if(a->cur && a->curUsed + sz <= a->curSize) {
+        p = a->cur + a->curUsed;
+        a->curUsed += sz;
+        a->used += sz;
+        return p;
+    }
+
+    if(slabSize > TWOBIT_SLAB_SIZE) slabSize = TWOBIT_SLAB_SIZE;
+    if(sz > slabSize / 4) slabSize = sz;
+    if(a->nSlabs == a->mSlabs) {
+        slabs = realloc(a->slabs, (a->mSlabs + 16) * sizeof(uint8_t*));
+        if(!slabs) return NULL;
+        a->slabs = slabs;
+        a->mSlabs += 16;
+    }
+    slab = malloc(slabSize);
+    if(!slab) return NULL;
+    a->slabs[a->nSlabs++] = slab;
+    a->bytes += slabSize;
+    a->used += sz;
+    if(slabSize == sz) return slab;
+
+    a->cur = slab;
+    a->curSize = slabSize;
+    a->curUsed = sz;
+    return slab;
+}
+
+static void twobitArenaDestroy(TwoBitArena *a) {
+    uint32_t i;
+    for(i=0; i<a->nSlabs; i++) free(a->slabs[i]);
+    if(a->slabs) free(a->slabs);
+    memset(a, 0, sizeof(TwoBitArena));
+}
+
+static inline int varintLen(uint32_t v) {
+    int n = 1;
+    while(v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline uint8_t *varintPut(uint8_t *p, uint32_t v) {
+    while(v >= 0x80) {
+        *p++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline uint32_t varintGet(const uint8_t **p) {
+    const uint8_t *q = *p;
+    uint32_t v = *q & 0x7F;
+    int shift = 7;
+    while(*q++ & 0x80) {
+        v |= (uint32_t) (*q & 0x7F) << shift;
+        shift += 7;
+    }
+    *p = q;
+    return v;
+}
+
+/*
+    Encode n sorted, non-overlapping soft-masked blocks into the arena (see TwoBitMaskedIdx for the layout).
+
+    Returns NULL on error (including unsorted or overlapping blocks).
+*/
+static uint8_t *maskBlocksEncode(TwoBitArena *a, uint32_t *starts, uint32_t *sizes, uint32_t n) {
+    uint32_t i, prevEnd = 0, nSkip = (n + 63) / 64, *skip;
+    uint64_t len = 0;
+    uint8_t *rec, *stream, *p;
+
+    for(i=0; i<n; i++) {
+        if(starts[i] < prevEnd || starts[i] + (uint64_t) sizes[i] > 0xFFFFFFFFULL) {
+            fprintf(stderr, "[twobitIndexRead] The soft-masked blocks are unsorted or overlapping!\n");
+            return NULL;
+        }
+        len += varintLen(starts[i] - prevEnd) + varintLen(sizes[i]);
+        prevEnd = starts[i] + sizes[i];
+    }
+
+    rec = twobitArenaAlloc(a, 8 * (uint64_t) nSkip + len);
+    if(!rec) return NULL;
+    skip = (uint32_t*) rec;
+    stream = p = rec + 8 * (uint64_t) nSkip;
+    prevEnd = 0;
+    for(i=0; i<n; i++) {
+        if(i % 64 == 0) {
+            skip[2 * (i / 64)] = starts[i];
+            skip[2 * (i / 64) + 1] = p - stream;
+        }
+        p = varintPut(p, starts[i] - prevEnd);
+        p = varintPut(p, sizes[i]);
+        prevEnd = starts[i] + sizes[i];
+    }
+
+    return rec;
+}
+
+void twobitMaskIterInit(TwoBit *tb, uint32_t tid, uint32_t pos, TwoBitMaskIter *it) {
+    uint32_t n, nSkip, lo = 0, hi, mid, k, size;
+    uint32_t *skip;
+    uint8_t *rec;
+
+    it->remaining = 0;
+    it->pending = 0;
+    if(!tb->idx->maskBlocks) return;
+    if(twobitLoadIndex(tb, tid) != 0) return;
+    n = tb->idx->maskBlockCount[tid];
+    if(n == 0) return;
+    rec = tb->idx->maskBlocks[tid];
+    skip = (uint32_t*) rec;
+
+    //The last group starting at or before pos, since no earlier block can end after it
+    nSkip = (n + 63) / 64;
+    hi = nSkip;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(skip[2 * mid] <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    k = (lo) ? lo - 1 : 0;
+
+    it->p = rec + 8 * (uint64_t) nSkip + skip[2 * k + 1];
+    varintGet(&it->p);
+    size = varintGet(&it->p);
+    it->start = skip[2 * k];
+    it->end = it->start + size;
+    it->remaining = n - 64 * k - 1;
+    while(it->end <= pos && it->remaining) twobitMaskIterNext(it);
+    if(it->end > pos) it->pending = 1;
+}
+
+int twobitMaskIterNext(TwoBitMaskIter *it) {
+    if(it->pending) {
+        it->pending = 0;
+        return 1;
+    }
+    if(!it->remaining) return 0;
+    it->start = it->end + varintGet(&it->p);
+    it->end = it->start + varintGet(&it->p);
+    it->remaining--;
+    return 1;
+}
+
+uint64_t twobitIndexSize(TwoBit *tb) {
+    TwoBitMaskedIdx *idx = tb->idx;
+    uint64_t sz = sizeof(TwoBitMaskedIdx);
+
+    //size, nBlockCount, maskBlockCount, offset and loaded
+    sz += (uint64_t) tb->hdr->nChroms * (3 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint8_t));
+    sz += (uint64_t) tb->hdr->nChroms * 2 * sizeof(uint32_t*);
+    if(idx->maskBlocks) sz += (uint64_t) tb->hdr->nChroms * sizeof(uint8_t*);
+    //The arena grows as records are loaded, possibly by another thread
+    pthread_mutex_lock(&idx->lock);
+    sz += idx->arena.used + idx->arena.mSlabs * sizeof(uint8_t*);
+    pthread_mutex_unlock(&idx->lock);
+
+    return sz;
+}
+
+/*
+    Parse the N and soft-masked blocks of a single chromosome/contig into tb->idx. Everything is read with explicit offsets, so this doesn't move the file cursor. This must be called with tb->idx->lock held (see twobitLoadIndex()).
+
+    Returns 0 on success and -1 on error.
+*/
+static int twobitIndexReadTid(TwoBit *tb, uint32_t tid) {
+    TwoBitMaskedIdx *idx = tb->idx;
+    uint64_t offset = tb->cl->offset[tid] + 4;
+    uint32_t nN, nMask, *nBlocks = NULL, *buf = NULL;
+    uint8_t *maskBlocks = NULL;
+
+    //The size was already read by twobitIndexRead()
+    if(twobitReadAt(tb, &nN, sizeof(uint32_t), 1, offset) != 1) return -1;
+    if(tb->hdr->swapped) nN = __builtin_bswap32(nN);
+    offset += 4;
+    if(nN) {
+        nBlocks = twobitArenaAlloc(&idx->arena, 2 * (uint64_t) nN * sizeof(uint32_t));
+        if(!nBlocks) return -1;
+        if(twobitReadAt(tb, nBlocks, sizeof(uint32_t), 2 * (size_t) nN, offset) != 2 * (size_t) nN) return -1;
+        if(tb->hdr->swapped) swapWords(nBlocks, 2 * (size_t) nN);
+        offset += 8 * (uint64_t) nN;
+    }
+
+    if(twobitReadAt(tb, &nMask, sizeof(uint32_t), 1, offset) != 1) return -1;
+    if(tb->hdr->swapped) nMask = __builtin_bswap32(nMask);
+    offset += 4;
+    if(idx->maskBlocks && nMask) {
+        buf = malloc(2 * (uint64_t) nMask * sizeof(uint32_t));
+        if(!buf) return -1;
+        if(twobitReadAt(tb, buf, sizeof(uint32_t), 2 * (size_t) nMask, offset) != 2 * (size_t) nMask) goto error;
+        if(tb->hdr->swapped) swapWords(buf, 2 * (size_t) nMask);
+        maskBlocks = maskBlocksEncode(&idx->arena, buf, buf + nMask, nMask);
+        if(!maskBlocks) goto error;
+        free(buf);
+    }
+    //Skip the masked blocks and the reserved field
+    offset += 8 * (uint64_t) nMask + 4;
+
+    idx->nBlockCount[tid] = nN;
+    idx->nBlockStart[tid] = nBlocks;
+    idx->nBlockSizes[tid] = (nBlocks) ? nBlocks + nN : NULL;
+    idx->maskBlockCount[tid] = nMask;
+    if(idx->maskBlocks) idx->maskBlocks[tid] = maskBlocks;
+    idx->offset[tid] = offset;
+
+    return 0;
+
+error:
+    free(buf);
+    return -1;
+}
+
+/*
+    Parse the index record of a chromosome/contig, if that hasn't been done yet. Once a record is loaded it's never modified, so only the first access takes the lock.
+
+    Returns 0 on success and -1 on error.
+*/
+int twobitLoadIndex(TwoBit *tb, uint32_t tid) {
+    TwoBitMaskedIdx *idx = tb->idx;
+    int rv = 0;
+
+    if(__atomic_load_n(idx->loaded + tid, __ATOMIC_ACQUIRE)) return 0;
+
+    pthread_mutex_lock(&idx->lock);
+    if(!idx->loaded[tid]) {
+        rv = twobitIndexReadTid(tb, tid);
+        if(rv == 0) __atomic_store_n(idx->loaded + tid, 1, __ATOMIC_RELEASE);
     }
-    return 0;
+    pthread_mutex_unlock(&idx->lock);
+
+    return rv;
 }
 
 /*
     Fill in tb->idx.
 
-    Note that the masked stuff will only be stored if storeMasked == 1, since it uses gobs of memory otherwise.
+    Only the chromosome/contig sizes are read here, the N and soft-masked blocks are read on first access by twobitLoadIndex(). Note that the soft-masked blocks will only be stored if storeMasked == 1. They're stored compactly in the arena, along with the N blocks, so there's only a handful of allocations regardless of the number of chromosomes/contigs.
     On error, tb->idx is left as NULL.
 */
 void twobitIndexRead(TwoBit *tb, int storeMasked) {
-    uint32_t i, data[2];
+    uint32_t i;
     TwoBitMaskedIdx *idx = calloc(1, sizeof(TwoBitMaskedIdx));
 
     //Allocation and error checking
     if(!idx) return;
+    pthread_mutex_init(&idx->lock, NULL);
+    tb->idx = idx;
     idx->size = malloc(tb->hdr->nChroms * sizeof(uint32_t));
     idx->nBlockCount = calloc(tb->hdr->nChroms, sizeof(uint32_t));
     idx->nBlockStart = calloc(tb->hdr->nChroms, sizeof(uint32_t*));
@@ -454,141 +2103,57 @@ void twobitIndexRead(TwoBit *tb, int storeMasked) {
     idx->maskBlockCount = calloc(tb->hdr->nChroms, sizeof(uint32_t));
     if(!idx->maskBlockCount) goto error;
     if(storeMasked) {
-        idx->maskBlockStart = calloc(tb->hdr->nChroms, sizeof(uint32_t*));
-        idx->maskBlockSizes = calloc(tb->hdr->nChroms, sizeof(uint32_t*));
-        if(!idx->maskBlockStart) goto error;
-        if(!idx->maskBlockSizes) goto error;
+        idx->maskBlocks = calloc(tb->hdr->nChroms, sizeof(uint8_t*));
+        if(!idx->maskBlocks) goto error;
     }
-    idx->offset = malloc(tb->hdr->nChroms * sizeof(uint64_t));
+    idx->offset = calloc(tb->hdr->nChroms, sizeof(uint64_t));
     if(!idx->offset) goto error;
+    idx->loaded = calloc(tb->hdr->nChroms, sizeof(uint8_t));
+    if(!idx->loaded) goto error;
 
-    //Read in each chromosome/contig
+    //Read in the size of each chromosome/contig
     for(i=0; i<tb->hdr->nChroms; i++) {
-        if(twobitSeek(tb, tb->cl->offset[i]) != 0) goto error;
-        if(twobitRead(data, sizeof(uint32_t), 2, tb) != 2) goto error;
-        idx->size[i] = data[0];
-        idx->nBlockCount[i] = data[1];
-
-        //Allocate the nBlock starts/sizes and fill them in
-        idx->nBlockStart[i] = malloc(idx->nBlockCount[i] * sizeof(uint32_t));
-        idx->nBlockSizes[i] = malloc(idx->nBlockCount[i] * sizeof(uint32_t));
-        if(!idx->nBlockStart[i]) goto error;
-        if(!idx->nBlockSizes[i]) goto error;
-        if(twobitRead(idx->nBlockStart[i], sizeof(uint32_t), idx->nBlockCount[i], tb) != idx->nBlockCount[i]) goto error;
-        if(twobitRead(idx->nBlockSizes[i], sizeof(uint32_t), idx->nBlockCount[i], tb) != idx->nBlockCount[i]) goto error;
-
-        //Get the masked block information
-        if(twobitRead(idx->maskBlockCount + i, sizeof(uint32_t), 1, tb) != 1) goto error;
-
-        //Allocate the maskBlock starts/sizes and fill them in
-        if(storeMasked) {
-            idx->maskBlockStart[i] = malloc(idx->maskBlockCount[i] * sizeof(uint32_t));
-            idx->maskBlockSizes[i] = malloc(idx->maskBlockCount[i] * sizeof(uint32_t));
-            if(!idx->maskBlockStart[i]) goto error;
-            if(!idx->maskBlockSizes[i]) goto error;
-            if(twobitRead(idx->maskBlockStart[i], sizeof(uint32_t), idx->maskBlockCount[i], tb) != idx->maskBlockCount[i]) goto error;
-            if(twobitRead(idx->maskBlockSizes[i], sizeof(uint32_t), idx->maskBlockCount[i], tb) != idx->maskBlockCount[i]) goto error;
-        } else {
-            if(twobitSeek(tb, twobitTell(tb) + 8 * idx->maskBlockCount[i]) != 0) goto error;
-        }
-
-        //Reserved
-        if(twobitRead(data, sizeof(uint32_t), 1, tb) != 1) goto error;
-
-        idx->offset[i] = twobitTell(tb);
+        if(twobitReadAt(tb, idx->size + i, sizeof(uint32_t), 1, tb->cl->offset[i]) != 1) goto error;
     }
+    if(tb->hdr->swapped) swapWords(idx->size, tb->hdr->nChroms);
 
-    tb->idx = idx;
     return;
 
 error:
-    if(idx) {
-        if(idx->size) free(idx->size);
-
-        if(idx->nBlockCount) free(idx->nBlockCount);
-        if(idx->nBlockStart) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(idx->nBlockStart[i]) free(idx->nBlockStart[i]);
-            }
-            free(idx->nBlockStart[i]);
-        }
-        if(idx->nBlockSizes) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(idx->nBlockSizes[i]) free(idx->nBlockSizes[i]);
-            }
-            free(idx->nBlockSizes[i]);
-        }
-
-        if(idx->maskBlockCount) free(idx->maskBlockCount);
-        if(idx->maskBlockStart) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(idx->maskBlockStart[i]) free(idx->maskBlockStart[i]);
-            }
-            free(idx->maskBlockStart[i]);
-        }
-        if(idx->maskBlockSizes) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(idx->maskBlockSizes[i]) free(idx->maskBlockSizes[i]);
-            }
-            free(idx->maskBlockSizes[i]);
-        }
-
-        if(idx->offset) free(idx->offset);
-
-        free(idx);
-    }
+    twobitIndexDestroy(tb);
+    tb->idx = NULL;
 }
 
 void twobitIndexDestroy(TwoBit *tb) {
-    uint32_t i;
-
     if(tb->idx) {
         if(tb->idx->size) free(tb->idx->size);
-
         if(tb->idx->nBlockCount) free(tb->idx->nBlockCount);
-        if(tb->idx->nBlockStart) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(tb->idx->nBlockStart[i]) free(tb->idx->nBlockStart[i]);
-            }
-            free(tb->idx->nBlockStart);
-        }
-        if(tb->idx->nBlockSizes) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(tb->idx->nBlockSizes[i]) free(tb->idx->nBlockSizes[i]);
-            }
-            free(tb->idx->nBlockSizes);
-        }
-
+        if(tb->idx->nBlockStart) free(tb->idx->nBlockStart);
+        if(tb->idx->nBlockSizes) free(tb->idx->nBlockSizes);
         if(tb->idx->maskBlockCount) free(tb->idx->maskBlockCount);
-        if(tb->idx->maskBlockStart) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(tb->idx->maskBlockStart[i]) free(tb->idx->maskBlockStart[i]);
-            }
-            free(tb->idx->maskBlockStart);
-        }
-        if(tb->idx->maskBlockSizes) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(tb->idx->maskBlockSizes[i]) free(tb->idx->maskBlockSizes[i]);
-            }
-            free(tb->idx->maskBlockSizes);
-        }
-
+        if(tb->idx->maskBlocks) free(tb->idx->maskBlocks);
         if(tb->idx->offset) free(tb->idx->offset);
-
+        if(tb->idx->loaded) free(tb->idx->loaded);
+        twobitArenaDestroy(&tb->idx->arena);
+        pthread_mutex_destroy(&tb->idx->lock);
         free(tb->idx);
     }
 }
 
+/*
+    Read the chromosome/contig names and record offsets. The names are stored back to back in a single buffer, rather than with one allocation each.
+*/
 void twobitChromListRead(TwoBit *tb) {
-    uint32_t i;
+    uint32_t i, offset;
     uint8_t byte;
-    char *str = NULL;
+    uint64_t namesSz = 0, namesUsed = 0;
+    char *tmp;
     TwoBitCL *cl = calloc(1, sizeof(TwoBitCL));
 
     //Allocate cl and do error checking
     if(!cl) goto error;
     cl->chrom = calloc(tb->hdr->nChroms, sizeof(char*));
-    cl->offset = malloc(sizeof(uint32_t) * tb->hdr->nChroms);
+    cl->offset = malloc(sizeof(uint64_t) * tb->hdr->nChroms);
     if(!cl->chrom) goto error;
     if(!cl->offset) goto error;
 
@@ -596,45 +2161,51 @@ void twobitChromListRead(TwoBit *tb) {
         //Get the string size (not null terminated!)
         if(twobitRead(&byte, 1, 1, tb) != 1) goto error;
 
-        //Read in the string
-        str = calloc(1 + byte, sizeof(char));
-        if(!str) goto error;
-        if(twobitRead(str, 1, byte, tb) != byte) goto error;
-        cl->chrom[i] = str;
-        str = NULL;
-
-        //Read in the size
-        if(twobitRead(cl->offset + i, sizeof(uint32_t), 1, tb) != 1) goto error;
+        //Read in the string, growing the buffer as needed
+        if(namesUsed + byte + 1 > namesSz) {
+            namesSz = (namesSz) ? 2 * namesSz : 4096;
+            tmp = realloc(cl->names, namesSz);
+            if(!tmp) goto error;
+            cl->names = tmp;
+        }
+        if(twobitRead(cl->names + namesUsed, 1, byte, tb) != byte) goto error;
+        cl->names[namesUsed + byte] = '\0';
+        //This is an offset until the buffer stops moving
+        cl->chrom[i] = (char*) (uintptr_t) namesUsed;
+        namesUsed += byte + 1;
+
+        //Read in the offset, which is 64-bit in version 1 files
+        if(tb->hdr->version == 1) {
+            if(twobitRead(cl->offset + i, sizeof(uint64_t), 1, tb) != 1) goto error;
+            if(tb->hdr->swapped) cl->offset[i] = __builtin_bswap64(cl->offset[i]);
+        } else {
+            if(twobitRead(&offset, sizeof(uint32_t), 1, tb) != 1) goto error;
+            cl->offset[i] = (tb->hdr->swapped) ? __builtin_bswap32(offset) : offset;
+        }
     }
+    for(i=0; i<tb->hdr->nChroms; i++) cl->chrom[i] = cl->names + (uintptr_t) cl->chrom[i];
 
     tb->cl = cl;
+    if(twobitChromHashBuild(tb) != 0) goto error;
     return;
 
 error:
-    if(str) free(str);
+    tb->cl = NULL;
     if(cl) {
+        if(cl->hash) free(cl->hash);
         if(cl->offset) free(cl->offset);
-        if(cl->chrom) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(cl->chrom[i]) free(cl->chrom[i]);
-            }
-            free(cl->chrom);
-        }
+        if(cl->names) free(cl->names);
+        if(cl->chrom) free(cl->chrom);
         free(cl);
     }
 }
 
 void twobitChromListDestroy(TwoBit *tb) {
-    uint32_t i;
-
     if(tb->cl) {
+        if(tb->cl->hash) free(tb->cl->hash);
         if(tb->cl->offset) free(tb->cl->offset);
-        if(tb->cl->chrom) {
-            for(i=0; i<tb->hdr->nChroms; i++) {
-                if(tb->cl->chrom[i]) free(tb->cl->chrom[i]);
-            }
-            free(tb->cl->chrom);
-        }
+        if(tb->cl->names) free(tb->cl->names);
+        if(tb->cl->chrom) free(tb->cl->chrom);
         free(tb->cl);
     }
 }
@@ -648,8 +2219,13 @@ void twobitHdrRead(TwoBit *tb) {
 
     if(twobitRead(data, 4, 4, tb) != 4) goto error;
 
-    //Magic
+    //Magic, which is byte swapped if the file was written with the other endianness
     hdr->magic = data[0];
+    if(hdr->magic == 0x4327411A) {
+        hdr->swapped = 1;
+        swapWords(data, 4);
+        hdr->magic = data[0];
+    }
     if(hdr->magic != 0x1A412743) {
         fprintf(stderr, "[twobitHdrRead] Received an invalid file magic number (0x%"PRIx32")!\n", hdr->magic);
         goto error;
@@ -657,8 +2233,8 @@ void twobitHdrRead(TwoBit *tb) {
 
     //Version
     hdr->version = data[1];
-    if(hdr->version != 0) {
-        fprintf(stderr, "[twobitHdrRead] The file version is %"PRIu32" while only version 0 is defined!\n", hdr->version);
+    if(hdr->version > 1) {
+        fprintf(stderr, "[twobitHdrRead] The file version is %"PRIu32" while only versions 0 and 1 are defined!\n", hdr->version);
         goto error;
     }
 
@@ -683,7 +2259,8 @@ void twobitHdrDestroy(TwoBit *tb) {
 void twobitClose(TwoBit *tb) {
     if(tb) {
         if(tb->fp) fclose(tb->fp);
-        if(tb->data) munmap(tb->data, tb->sz);
+        if(tb->data && !tb->borrowed) munmap(tb->data, tb->sz);
+        twobitCompIdxDestroy(tb);
         twobitChromListDestroy(tb);
         twobitIndexDestroy(tb);
         //N.B., this needs to be called last
@@ -692,12 +2269,35 @@ void twobitClose(TwoBit *tb) {
     }
 }
 
+/*
+    Read the header, chromosome list and index, once tb->data or tb->fp is set up.
+
+    Returns 0 on success and -1 on error.
+*/
+static int twobitOpenCommon(TwoBit *tb, int storeMasked) {
+    //Attempt to read in the fixed header
+    twobitHdrRead(tb);
+    if(!tb->hdr) return -1;
+
+    //Read in the chromosome list
+    twobitChromListRead(tb);
+    if(!tb->cl) return -1;
+
+    //Read in the mask index
+    twobitIndexRead(tb, storeMasked);
+    if(!tb->idx) return -1;
+
+    return 0;
+}
+
 TwoBit* twobitOpen(char *fname, int storeMasked) {
     int fd;
     struct stat fs;
     TwoBit *tb = calloc(1, sizeof(TwoBit));
     if(!tb) return NULL;
 
+    twobitInitKernels();
+
     tb->fp = fopen(fname, "rb");
     if(!tb->fp) goto error;
 
@@ -707,6 +2307,7 @@ TwoBit* twobitOpen(char *fname, int storeMasked) {
     if(fstat(fd, &fs) == 0) {
         tb->sz = (uint64_t) fs.st_size;
         tb->data = mmap(NULL, fs.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(tb->data == MAP_FAILED) tb->data = NULL;
         if(tb->data) {
             if(madvise(tb->data, fs.st_size, MADV_RANDOM) != 0) {
                 munmap(tb->data, fs.st_size);
@@ -715,17 +2316,29 @@ TwoBit* twobitOpen(char *fname, int storeMasked) {
         }
     }
 
-    //Attempt to read in the fixed header
-    twobitHdrRead(tb);
-    if(!tb->hdr) goto error;
+    if(twobitOpenCommon(tb, storeMasked) != 0) goto error;
 
-    //Read in the chromosome list
-    twobitChromListRead(tb);
-    if(!tb->cl) goto error;
+    return tb;
 
-    //Read in the mask index
-    twobitIndexRead(tb, storeMasked);
-    if(!tb->idx) goto error;
+error:
+    twobitClose(tb);
+    return NULL;
+}
+
+TwoBit *twobitOpenBuffer(const void *data, uint64_t size, int storeMasked) {
+    TwoBit *tb;
+
+    if(!data) return NULL;
+    tb = calloc(1, sizeof(TwoBit));
+    if(!tb) return NULL;
+
+    twobitInitKernels();
+
+    //This is read exactly like a memory mapped file, it just isn't unmapped on close
+    tb->data = (void*) data;
+    tb->sz = size;
+    tb->borrowed = 1;
+    if(twobitOpenCommon(tb, storeMasked) != 0) goto error;
 
     return tb;
 
@@ -733,3 +2346,758 @@ error:
     twobitClose(tb);
     return NULL;
 }
+
+/*
+    Writing
+
+    Sequences are packed as they're added, 64 bases at a time, each step producing 16 packed bytes along with masks
+    of the positions holding Ns (anything other than ACGT) and lower case letters, from which the N and soft-masked
+    blocks are built. The index at the start of the file can't be written until every name is known, so records are
+    written to a temporary file (next to the output, and unlinked immediately) and copied after the index on close.
+
+    With more than one thread, each added sequence is copied and packed on a worker thread. At most nThreads
+    sequences are in flight at once and finished records are written in the order they were added.
+*/
+
+//Bits 0-1 hold the 2-bit code, bit 2 is set for Ns and bit 3 for lower case
+static uint8_t twobitEncodeLUT[256];
+static void (*encodeChunk)(const char *seq, uint8_t *packed, uint64_t *nMask, uint64_t *lowerMask);
+static pthread_once_t twobitEncodeOnce = PTHREAD_ONCE_INIT;
+
+/*
+    Pack 64 characters into 16 bytes and set the masks of Ns and lower case letters (bit i for character i)
+*/
+static void encodeChunkScalar(const char *seq, uint8_t *packed, uint64_t *nMask, uint64_t *lowerMask) {
+    uint64_t n = 0, lower = 0;
+    uint8_t v, byte;
+    int i, j;
+
+    for(i=0; i<16; i++) {
+        byte = 0;
+        for(j=0; j<4; j++) {
+            v = twobitEncodeLUT[(uint8_t) seq[4 * i + j]];
+            byte = (byte << 2) | (v & 3);
+            n |= ((uint64_t) ((v >> 2) & 1)) << (4 * i + j);
+            lower |= ((uint64_t) ((v >> 3) & 1)) << (4 * i + j);
+        }
+        packed[i] = byte;
+    }
+    *nMask = n;
+    *lowerMask = lower;
+}
+
+#ifdef TWOBIT_X86_SIMD
+/*
+    The code of each ACGT (in either case) follows from its low nibble with a byte shuffle. Groups of 4 codes are
+    then combined into bytes with two multiply-adds (c0*4 + c1, then p0*16 + p1) and gathered from each 32-bit lane.
+*/
+__attribute__((target("avx2")))
+static void encodeChunkAVX2(const char *seq, uint8_t *packed, uint64_t *nMask, uint64_t *lowerMask) {
+    const __m256i nibbles = _mm256_setr_epi8(0, 2, 0, 1, 0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 2, 0, 1, 0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i gather = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                            0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m256i c, up, acgt, codes, x;
+    uint32_t n[2], lower[2];
+    int h;
+
+    for(h=0; h<2; h++) {
+        c = _mm256_loadu_si256((const __m256i*) (seq + 32 * h));
+        up = _mm256_and_si256(c, _mm256_set1_epi8((char) 0xDF));
+        acgt = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(up, _mm256_set1_epi8('A')), _mm256_cmpeq_epi8(up, _mm256_set1_epi8('C'))),
+                               _mm256_or_si256(_mm256_cmpeq_epi8(up, _mm256_set1_epi8('G')), _mm256_cmpeq_epi8(up, _mm256_set1_epi8('T'))));
+        n[h] = ~(uint32_t) _mm256_movemask_epi8(acgt);
+        lower[h] = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c)));
+
+        codes = _mm256_and_si256(_mm256_shuffle_epi8(nibbles, _mm256_and_si256(c, _mm256_set1_epi8(0x0F))), acgt);
+        x = _mm256_maddubs_epi16(codes, _mm256_set1_epi16(0x0104));
+        x = _mm256_madd_epi16(x, _mm256_set1_epi32(0x00010010));
+        x = _mm256_shuffle_epi8(x, gather);
+        x = _mm256_permutevar8x32_epi32(x, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0));
+        _mm_storel_epi64((__m128i*) (packed + 8 * h), _mm256_castsi256_si128(x));
+    }
+    _mm256_zeroupper();
+    *nMask = n[0] | ((uint64_t) n[1] << 32);
+    *lowerMask = lower[0] | ((uint64_t) lower[1] << 32);
+}
+#endif
+
+static void twobitEncodeInitOnce(void) {
+    int i;
+
+    for(i=0; i<256; i++) {
+        switch(toupper(i)) {
+        case 'T': twobitEncodeLUT[i] = 0; break;
+        case 'C': twobitEncodeLUT[i] = 1; break;
+        case 'A': twobitEncodeLUT[i] = 2; break;
+        case 'G': twobitEncodeLUT[i] = 3; break;
+        default: twobitEncodeLUT[i] = 4;
+        }
+        if(i >= 'a' && i <= 'z') twobitEncodeLUT[i] |= 8;
+    }
+    encodeChunk = encodeChunkScalar;
+#ifdef TWOBIT_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) encodeChunk = encodeChunkAVX2;
+#endif
+}
+
+//A growing list of blocks, the last of which may still be open
+typedef struct {
+    uint32_t *starts;
+    uint32_t *sizes;
+    uint32_t n;
+    uint32_t m;
+    int open;
+} writerBlocks;
+
+static int writerBlocksAdd(writerBlocks *b, uint32_t start) {
+    uint32_t *tmp;
+
+    if(b->n == b->m) {
+        b->m = (b->m) ? 2 * b->m : 64;
+        tmp = realloc(b->starts, b->m * sizeof(uint32_t));
+        if(!tmp) return -1;
+        b->starts = tmp;
+        tmp = realloc(b->sizes, b->m * sizeof(uint32_t));
+        if(!tmp) return -1;
+        b->sizes = tmp;
+    }
+    b->starts[b->n++] = start;
+    b->open = 1;
+    return 0;
+}
+
+/*
+    Extend the blocks with the set bits of mask, the first nBits of which describe the characters starting at pos
+*/
+static int writerBlocksUpdate(writerBlocks *b, uint64_t mask, uint32_t pos, int nBits) {
+    uint64_t valid = (nBits < 64) ? (1ULL << nBits) - 1 : ~0ULL, x;
+    int i = 0;
+
+    mask &= valid;
+    while(i < nBits) {
+        if(b->open) {
+            //The first unset bit closes the current block
+            x = ~mask & valid & (~0ULL << i);
+            if(!x) return 0;
+            i = __builtin_ctzll(x);
+            b->sizes[b->n - 1] = pos + i - b->starts[b->n - 1];
+            b->open = 0;
+        } else {
+            x = mask & (~0ULL << i);
+            if(!x) return 0;
+            i = __builtin_ctzll(x);
+            if(writerBlocksAdd(b, pos + i) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+static void writerBlocksClose(writerBlocks *b, uint32_t end) {
+    if(b->open) b->sizes[b->n - 1] = end - b->starts[b->n - 1];
+    b->open = 0;
+}
+
+static void writerBlocksDestroy(writerBlocks *b) {
+    if(b->starts) free(b->starts);
+    if(b->sizes) free(b->sizes);
+}
+
+//A packed record, as it's stored in the file (minus the index entry)
+typedef struct {
+    uint32_t len;
+    writerBlocks nBlocks;
+    writerBlocks maskBlocks;
+    uint8_t *packed;
+} writerRecord;
+
+static void writerRecordDestroy(writerRecord *r) {
+    writerBlocksDestroy(&r->nBlocks);
+    writerBlocksDestroy(&r->maskBlocks);
+    if(r->packed) free(r->packed);
+    memset(r, 0, sizeof(writerRecord));
+}
+
+static int writerPack(const char *seq, uint32_t len, writerRecord *r) {
+    uint64_t nMask, lowerMask;
+    uint32_t pos = 0, nBytes = len / 4 + ((len % 4) ? 1 : 0);
+    uint8_t last[16];
+    char tail[64];
+
+    memset(r, 0, sizeof(writerRecord));
+    r->len = len;
+    r->packed = malloc((nBytes) ? nBytes : 1);
+    if(!r->packed) return -1;
+
+    for(pos=0; pos + 64 <= len; pos += 64) {
+        encodeChunk(seq + pos, r->packed + pos / 4, &nMask, &lowerMask);
+        //Most chunks have neither, so skip them unless a block is open
+        if((nMask || r->nBlocks.open) && writerBlocksUpdate(&r->nBlocks, nMask, pos, 64) != 0) goto error;
+        if((lowerMask || r->maskBlocks.open) && writerBlocksUpdate(&r->maskBlocks, lowerMask, pos, 64) != 0) goto error;
+    }
+    if(pos < len) {
+        //Pad the last partial chunk with Ts, which pack to 0 bits
+        memset(tail, 'T', 64);
+        memcpy(tail, seq + pos, len - pos);
+        encodeChunkScalar(tail, last, &nMask, &lowerMask);
+        memcpy(r->packed + pos / 4, last, nBytes - pos / 4);
+        if(writerBlocksUpdate(&r->nBlocks, nMask, pos, len - pos) != 0) goto error;
+        if(writerBlocksUpdate(&r->maskBlocks, lowerMask, pos, len - pos) != 0) goto error;
+    }
+    writerBlocksClose(&r->nBlocks, len);
+    writerBlocksClose(&r->maskBlocks, len);
+    return 0;
+
+error:
+    writerRecordDestroy(r);
+    return -1;
+}
+
+static uint64_t writerRecordSize(writerRecord *r) {
+    return 16 + 8 * ((uint64_t) r->nBlocks.n + r->maskBlocks.n) + r->len / 4 + ((r->len % 4) ? 1 : 0);
+}
+
+static int writerRecordWrite(writerRecord *r, FILE *fp) {
+    uint32_t zero = 0;
+    uint64_t nBytes = r->len / 4 + ((r->len % 4) ? 1 : 0);
+
+    if(fwrite(&r->len, sizeof(uint32_t), 1, fp) != 1) return -1;
+    if(fwrite(&r->nBlocks.n, sizeof(uint32_t), 1, fp) != 1) return -1;
+    if(r->nBlocks.n && fwrite(r->nBlocks.starts, sizeof(uint32_t), r->nBlocks.n, fp) != r->nBlocks.n) return -1;
+    if(r->nBlocks.n && fwrite(r->nBlocks.sizes, sizeof(uint32_t), r->nBlocks.n, fp) != r->nBlocks.n) return -1;
+    if(fwrite(&r->maskBlocks.n, sizeof(uint32_t), 1, fp) != 1) return -1;
+    if(r->maskBlocks.n && fwrite(r->maskBlocks.starts, sizeof(uint32_t), r->maskBlocks.n, fp) != r->maskBlocks.n) return -1;
+    if(r->maskBlocks.n && fwrite(r->maskBlocks.sizes, sizeof(uint32_t), r->maskBlocks.n, fp) != r->maskBlocks.n) return -1;
+    if(fwrite(&zero, sizeof(uint32_t), 1, fp) != 1) return -1;
+    if(nBytes && fwrite(r->packed, 1, nBytes, fp) != nBytes) return -1;
+    return 0;
+}
+
+//A sequence being packed by a worker thread
+typedef struct {
+    char *seq;
+    uint32_t len;
+    writerRecord rec;
+    int done;
+    int err;
+} writerJob;
+
+struct TwoBitWriter {
+    char *fname;
+    char *outName; //The temporary file that out is written to, which is renamed to fname once complete
+    FILE *out;
+    FILE *data; //The temporary file holding the records
+    uint64_t dataSize;
+    char **names;
+    uint64_t *offsets; //The offset of each record in data
+    uint32_t nChroms;
+    uint32_t mChroms;
+    int err;
+    //Only used with more than one thread
+    int nThreads;
+    pthread_t *threads;
+    int nStarted;
+    pthread_mutex_t lock;
+    pthread_cond_t jobReady;
+    pthread_cond_t jobDone;
+    writerJob *jobs; //A ring of nThreads jobs
+    uint64_t head; //The next job to be written
+    uint64_t next; //The next job to be packed
+    uint64_t tail; //The next free slot
+    int stop;
+};
+
+static void *writerWorker(void *arg) {
+    TwoBitWriter *w = arg;
+    writerJob *job;
+
+    pthread_mutex_lock(&w->lock);
+    while(1) {
+        while(!w->stop && w->next == w->tail) pthread_cond_wait(&w->jobReady, &w->lock);
+        if(w->next == w->tail) break;
+        job = w->jobs + (w->next++ % w->nThreads);
+        pthread_mutex_unlock(&w->lock);
+
+        job->err = writerPack(job->seq, job->len, &job->rec);
+        free(job->seq);
+        job->seq = NULL;
+
+        pthread_mutex_lock(&w->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&w->jobDone);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static int writerWriteRecord(TwoBitWriter *w, writerRecord *r) {
+    if(writerRecordWrite(r, w->data) != 0) return -1;
+    w->dataSize += writerRecordSize(r);
+    return 0;
+}
+
+/*
+    Write finished jobs in order, waiting until at most maxPending remain. This must be called with the lock held.
+*/
+static void writerFlush(TwoBitWriter *w, uint64_t maxPending) {
+    writerJob *job;
+
+    while(w->head < w->tail) {
+        job = w->jobs + (w->head % w->nThreads);
+        if(!job->done) {
+            if(w->tail - w->head <= maxPending) break;
+            pthread_cond_wait(&w->jobDone, &w->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&w->lock);
+        //Jobs are numbered in the order their sequences were added
+        w->offsets[w->head] = w->dataSize;
+        if(job->err || writerWriteRecord(w, &job->rec) != 0) w->err = 1;
+        writerRecordDestroy(&job->rec);
+        job->done = 0;
+        pthread_mutex_lock(&w->lock);
+        w->head++;
+    }
+}
+
+//umask() can only be read by setting it, so this is done once rather than per file
+static mode_t writerUmask;
+static pthread_once_t writerUmaskOnce = PTHREAD_ONCE_INIT;
+
+static void writerUmaskInitOnce(void) {
+    writerUmask = umask(0);
+    umask(writerUmask);
+}
+
+TwoBitWriter *twobitWriterOpen(const char *fname, int nThreads) {
+    TwoBitWriter *w = NULL;
+    char *tmpName = NULL;
+    struct stat st;
+    mode_t mode;
+    long nCPU;
+    int fd = -1, i;
+
+    pthread_once(&twobitEncodeOnce, twobitEncodeInitOnce);
+
+    w = calloc(1, sizeof(TwoBitWriter));
+    if(!w) return NULL;
+    w->fname = strdup(fname);
+    if(!w->fname) goto error;
+
+    /*
+        The file is written under a temporary name and renamed over fname once it's complete, so an existing file
+        (which might be open, or even the file being subset) is left intact on error and never truncated. It gets
+        the existing file's permissions, or those fopen() would give it.
+    */
+    if(stat(fname, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        pthread_once(&writerUmaskOnce, writerUmaskInitOnce);
+        mode = 0666 & ~writerUmask;
+    }
+    w->outName = malloc(strlen(fname) + 8);
+    if(!w->outName) goto error;
+    sprintf(w->outName, "%s.XXXXXX", fname);
+    fd = mkstemp(w->outName);
+    if(fd < 0) {
+        free(w->outName);
+        w->outName = NULL;
+        goto error;
+    }
+    //fd is closed under error
+    if(fchmod(fd, mode) != 0 || !(w->out = fdopen(fd, "wb"))) {
+        unlink(w->outName);
+        goto error;
+    }
+    fd = -1;
+
+    //The temporary file is unlinked right away, so it's removed even if the process dies
+    tmpName = malloc(strlen(fname) + 8);
+    if(!tmpName) goto error;
+    sprintf(tmpName, "%s.XXXXXX", fname);
+    fd = mkstemp(tmpName);
+    if(fd < 0) goto error;
+    unlink(tmpName);
+    w->data = fdopen(fd, "w+b");
+    if(!w->data) goto error;
+    fd = -1;
+    free(tmpName);
+    tmpName = NULL;
+
+    if(nThreads <= 0) {
+        nCPU = sysconf(_SC_NPROCESSORS_ONLN);
+        nThreads = (nCPU > 0) ? (int) nCPU : 1;
+    }
+    w->nThreads = nThreads;
+    if(nThreads > 1) {
+        w->jobs = calloc(nThreads, sizeof(writerJob));
+        w->threads = calloc(nThreads, sizeof(pthread_t));
+        if(!w->jobs || !w->threads) goto error;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->jobReady, NULL);
+        pthread_cond_init(&w->jobDone, NULL);
+        for(i=0; i<nThreads; i++) {
+            if(pthread_create(w->threads + i, NULL, writerWorker, w) != 0) break;
+            w->nStarted++;
+        }
+        if(!w->nStarted) {
+            //Fall back to packing on the calling thread
+            pthread_mutex_destroy(&w->lock);
+            pthread_cond_destroy(&w->jobReady);
+            pthread_cond_destroy(&w->jobDone);
+            free(w->jobs);
+            free(w->threads);
+            w->jobs = NULL;
+            w->threads = NULL;
+            w->nThreads = 1;
+        }
+    }
+
+    return w;
+
+error:
+    if(fd >= 0) close(fd);
+    if(tmpName) free(tmpName);
+    if(w->jobs) free(w->jobs);
+    if(w->threads) free(w->threads);
+    if(w->data) fclose(w->data);
+    if(w->out) {
+        fclose(w->out);
+        unlink(w->outName);
+    }
+    if(w->outName) free(w->outName);
+    if(w->fname) free(w->fname);
+    free(w);
+    return NULL;
+}
+
+/*
+    Store a copy of the name of the next record, without incrementing nChroms.
+
+    Returns 0 on success and -1 on error.
+*/
+static int writerAddName(TwoBitWriter *w, const char *name) {
+    size_t nameLen = strlen(name);
+    char **names;
+    uint64_t *offsets;
+
+    if(w->err) return -1;
+    if(nameLen == 0 || nameLen > 255) return -1;
+    if(w->nChroms == w->mChroms) {
+        w->mChroms = (w->mChroms) ? 2 * w->mChroms : 64;
+        names = realloc(w->names, w->mChroms * sizeof(char*));
+        if(!names) return -1;
+        w->names = names;
+        offsets = realloc(w->offsets, w->mChroms * sizeof(uint64_t));
+        if(!offsets) return -1;
+        w->offsets = offsets;
+    }
+    w->names[w->nChroms] = strdup(name);
+    if(!w->names[w->nChroms]) return -1;
+    return 0;
+}
+
+int twobitWriterAddSequence(TwoBitWriter *w, const char *name, const char *seq, uint32_t len) {
+    writerRecord rec;
+    writerJob *job;
+    char *copy;
+
+    if(writerAddName(w, name) != 0) return -1;
+
+    if(w->nThreads <= 1) {
+        w->offsets[w->nChroms++] = w->dataSize;
+        if(writerPack(seq, len, &rec) != 0) goto error;
+        if(writerWriteRecord(w, &rec) != 0) {
+            writerRecordDestroy(&rec);
+            goto error;
+        }
+        writerRecordDestroy(&rec);
+        return 0;
+    }
+
+    copy = malloc((len) ? len : 1);
+    if(!copy) {
+        free(w->names[w->nChroms]);
+        return -1;
+    }
+    memcpy(copy, seq, len);
+
+    pthread_mutex_lock(&w->lock);
+    //Records are written in order, so the offset is only known once the previous ones are written
+    writerFlush(w, w->nThreads - 1);
+    job = w->jobs + (w->tail % w->nThreads);
+    job->seq = copy;
+    job->len = len;
+    job->done = 0;
+    job->err = 0;
+    w->tail++;
+    w->nChroms++;
+    pthread_cond_signal(&w->jobReady);
+    pthread_mutex_unlock(&w->lock);
+    return (w->err) ? -1 : 0;
+
+error:
+    w->err = 1;
+    return -1;
+}
+
+/*
+    Append len bytes of the file fd, starting at offset, to out. On Linux, this is done with sendfile(), so the
+    data is copied within the kernel. This doesn't move the file position of fd.
+
+    Returns 0 on success and -1 on error.
+*/
+static int writerCopyFd(int fd, uint64_t offset, uint64_t len, FILE *out) {
+    uint8_t *buf;
+    off_t off = (off_t) offset;
+    ssize_t rv;
+
+    if(fflush(out) != 0) return -1;
+#ifdef __linux__
+    while(len) {
+        rv = sendfile(fileno(out), fd, &off, (len < (1 << 30)) ? (size_t) len : (1 << 30));
+        if(rv <= 0) break;
+        len -= (uint64_t) rv;
+    }
+#endif
+    //Either sendfile() isn't available or it's unsupported for these files
+    if(len) {
+        buf = malloc(1 << 20);
+        if(!buf) return -1;
+        while(len) {
+            rv = pread(fd, buf, (len < (1 << 20)) ? (size_t) len : (1 << 20), off);
+            if(rv <= 0) break;
+            if(write(fileno(out), buf, (size_t) rv) != rv) break;
+            off += rv;
+            len -= (uint64_t) rv;
+        }
+        free(buf);
+    }
+    //out's FILE position is stale after writing to its descriptor directly
+    if(fseeko(out, 0, SEEK_END) != 0) return -1;
+    return (len) ? -1 : 0;
+}
+
+/*
+    Write the header and index, given the offsets of the records relative to the start of the data
+*/
+static int writerHeader(TwoBitWriter *w) {
+    uint32_t header[4] = {0x1A412743, 0, w->nChroms, 0}, off32, i;
+    uint64_t indexSize = 16, off;
+    uint8_t nameLen;
+
+    for(i=0; i<w->nChroms; i++) indexSize += 1 + strlen(w->names[i]) + 4;
+    //Version 1 files have 64-bit offsets
+    if(w->nChroms && indexSize + w->offsets[w->nChroms - 1] > 0xFFFFFFFFULL) {
+        header[1] = 1;
+        indexSize += 4 * (uint64_t) w->nChroms;
+    }
+
+    if(fwrite(header, sizeof(uint32_t), 4, w->out) != 4) return -1;
+    for(i=0; i<w->nChroms; i++) {
+        nameLen = (uint8_t) strlen(w->names[i]);
+        if(fwrite(&nameLen, 1, 1, w->out) != 1) return -1;
+        if(fwrite(w->names[i], 1, nameLen, w->out) != nameLen) return -1;
+        off = indexSize + w->offsets[i];
+        if(header[1]) {
+            if(fwrite(&off, sizeof(uint64_t), 1, w->out) != 1) return -1;
+        } else {
+            off32 = (uint32_t) off;
+            if(fwrite(&off32, sizeof(uint32_t), 1, w->out) != 1) return -1;
+        }
+    }
+    return 0;
+}
+
+int twobitWriterClose(TwoBitWriter *w) {
+    uint32_t i;
+    int rv = -1;
+
+    if(w->nThreads > 1) {
+        pthread_mutex_lock(&w->lock);
+        writerFlush(w, 0);
+        w->stop = 1;
+        pthread_cond_broadcast(&w->jobReady);
+        pthread_mutex_unlock(&w->lock);
+        for(i=0; i<(uint32_t) w->nStarted; i++) pthread_join(w->threads[i], NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->jobReady);
+        pthread_cond_destroy(&w->jobDone);
+        free(w->threads);
+        free(w->jobs);
+    }
+    if(w->err) goto cleanup;
+
+    if(writerHeader(w) != 0) goto cleanup;
+    if(fflush(w->data) != 0) goto cleanup;
+    if(writerCopyFd(fileno(w->data), 0, w->dataSize, w->out) != 0) goto cleanup;
+    //The data must be on disk before the rename, or a crash could leave fname empty
+    if(fflush(w->out) != 0 || fsync(fileno(w->out)) != 0) goto cleanup;
+    rv = 0;
+
+cleanup:
+    fclose(w->data);
+    if(fclose(w->out) != 0) rv = -1;
+    if(rv == 0 && rename(w->outName, w->fname) != 0) rv = -1;
+    //Any existing file is untouched, so only the temporary file needs removing
+    if(rv != 0) unlink(w->outName);
+    free(w->outName);
+    free(w->fname);
+    for(i=0; i<w->nChroms; i++) free(w->names[i]);
+    if(w->names) free(w->names);
+    if(w->offsets) free(w->offsets);
+    free(w);
+    return rv;
+}
+
+void twobitWriterAbort(TwoBitWriter *w) {
+    w->err = 1;
+    twobitWriterClose(w);
+}
+
+/*
+    Subsetting
+
+    Whole chromosomes/contigs are copied byte for byte, index record and all, without decoding anything. Regions have
+    their N and soft-masked blocks clipped and rebased, while their packed sequence is copied as-is if the start is a
+    multiple of 4 and otherwise shifted into place, a byte at a time.
+
+    Copying with sendfile() means flushing the output, a system call and a seek, which costs more than copying small
+    records through the (buffered) output, straight from the mapping if the file is memory mapped.
+*/
+#define SUBSET_SENDFILE_MIN (1 << 20)
+
+//Read n words from the file, swapping them if needed
+static int subsetReadWords(TwoBit *tb, uint32_t *words, size_t n, uint64_t offset) {
+    if(n && twobitReadAt(tb, words, sizeof(uint32_t), n, offset) != n) return -1;
+    if(tb->hdr->swapped) swapWords(words, n);
+    return 0;
+}
+
+/*
+    Read a list of blocks (a count, then the starts and then the sizes) at *offset, adding the parts within [start, end)
+    to b relative to start. *offset is moved past the list.
+*/
+static int subsetBlocks(TwoBit *tb, uint64_t *offset, uint32_t start, uint32_t end, writerBlocks *b) {
+    uint32_t n, i, s, e, *blocks;
+
+    if(subsetReadWords(tb, &n, 1, *offset) != 0) return -1;
+    *offset += 4;
+    if(!n) return 0;
+    blocks = malloc(2 * (uint64_t) n * sizeof(uint32_t));
+    if(!blocks) return -1;
+    if(subsetReadWords(tb, blocks, 2 * (size_t) n, *offset) != 0) goto error;
+    *offset += 8 * (uint64_t) n;
+
+    for(i=twobitFirstBlock(blocks, blocks + n, n, start); i<n && blocks[i] < end; i++) {
+        s = (blocks[i] > start) ? blocks[i] : start;
+        e = (blocks[n + i] < end - blocks[i]) ? blocks[i] + blocks[n + i] : end;
+        if(writerBlocksAdd(b, s - start) != 0) goto error;
+        writerBlocksClose(b, e - start);
+    }
+    free(blocks);
+    return 0;
+
+error:
+    free(blocks);
+    return -1;
+}
+
+static int subsetRegion(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, writerRecord *r) {
+    uint64_t offset = tb->cl->offset[tid] + 4, first = start / 4, nIn = ((uint64_t) end + 3) / 4 - first;
+    uint32_t len = end - start, nBytes = len / 4 + ((len % 4) ? 1 : 0), shift = 2 * (start % 4), i;
+
+    memset(r, 0, sizeof(writerRecord));
+    r->len = len;
+    if(subsetBlocks(tb, &offset, start, end, &r->nBlocks) != 0) goto error;
+    if(subsetBlocks(tb, &offset, start, end, &r->maskBlocks) != 0) goto error;
+    //The reserved field
+    offset += 4;
+
+    r->packed = malloc(nIn + 1);
+    if(!r->packed) goto error;
+    if(nIn && twobitReadAt(tb, r->packed, 1, nIn, offset + first) != nIn) goto error;
+    if(shift) {
+        r->packed[nIn] = 0;
+        for(i=0; i<nBytes; i++) r->packed[i] = (uint8_t) ((r->packed[i] << shift) | (r->packed[i + 1] >> (8 - shift)));
+    }
+    //Clear anything past the end of the region in the last byte
+    if(len % 4) r->packed[nBytes - 1] &= (uint8_t) (0xFF << (8 - 2 * (len % 4)));
+    return 0;
+
+error:
+    writerRecordDestroy(r);
+    return -1;
+}
+
+static int subsetWhole(TwoBit *tb, uint32_t tid, TwoBitWriter *w, const char *name) {
+    uint64_t offset = tb->cl->offset[tid], size;
+    uint32_t len = tb->idx->size[tid], n;
+    uint8_t *buf;
+    int rv;
+
+    //The record holds the length, N blocks, soft-masked blocks, reserved field and packed sequence
+    if(subsetReadWords(tb, &n, 1, offset + 4) != 0) return -1;
+    size = 16 + 8 * (uint64_t) n;
+    if(subsetReadWords(tb, &n, 1, offset + size - 8) != 0) return -1;
+    size += 8 * (uint64_t) n + len / 4 + ((len % 4) ? 1 : 0);
+    if(offset + size > tb->sz) return -1;
+
+    if(writerAddName(w, name) != 0) return -1;
+    w->offsets[w->nChroms++] = w->dataSize;
+    if(tb->fp && size >= SUBSET_SENDFILE_MIN) {
+        rv = writerCopyFd(fileno(tb->fp), offset, size, w->data);
+    } else if(tb->data) {
+        rv = (fwrite((uint8_t*) tb->data + offset, 1, size, w->data) == size) ? 0 : -1;
+    } else {
+        rv = -1;
+        buf = malloc(size);
+        if(buf && twobitReadAt(tb, buf, 1, size, offset) == size && fwrite(buf, 1, size, w->data) == size) rv = 0;
+        if(buf) free(buf);
+    }
+    if(rv != 0) return -1;
+    w->dataSize += size;
+    return 0;
+}
+
+int twobitSubset(TwoBit *tb, const char *fname, uint32_t n, const uint32_t *tids, const uint32_t *starts, const uint32_t *ends, char **names) {
+    TwoBitWriter *w;
+    writerRecord rec;
+    uint32_t i, tid, start, end;
+    const char *name;
+    int rv;
+
+    w = twobitWriterOpen(fname, 1);
+    if(!w) return -1;
+    for(i=0; i<n; i++) {
+        tid = tids[i];
+        if(tid >= tb->hdr->nChroms) goto error;
+        start = starts[i];
+        end = (start || ends[i]) ? ends[i] : tb->idx->size[tid];
+        if(start > end || end > tb->idx->size[tid]) goto error;
+        name = (names && names[i]) ? names[i] : tb->cl->chrom[tid];
+
+        //Records in byte-swapped files need to be rewritten, since the output is native-endian
+        if(start == 0 && end == tb->idx->size[tid] && !tb->hdr->swapped) {
+            if(subsetWhole(tb, tid, w, name) != 0) goto error;
+            continue;
+        }
+
+        if(subsetRegion(tb, tid, start, end, &rec) != 0) goto error;
+        if(writerAddName(w, name) != 0) {
+            writerRecordDestroy(&rec);
+            goto error;
+        }
+        w->offsets[w->nChroms++] = w->dataSize;
+        rv = writerWriteRecord(w, &rec);
+        writerRecordDestroy(&rec);
+        if(rv != 0) goto error;
+    }
+
+    return twobitWriterClose(w);
+
+error:
+    twobitWriterAbort(w);
+    return -1;
+}
@@ -1,11 +1,12 @@
 #include <inttypes.h>
 #include <stdio.h>
+#include <pthread.h>
 
 /*! \mainpage libBigWig
  *
  * \section Introduction
  *
- * lib2bit is a C-based library for accessing [2bit files](https://genome.ucsc.edu/FAQ/FAQformat.html#format7). At the moment, only reading 2bit files is supported (there are no plans to change this, though if someone wants to submit a pull request...). Though it's unlikely to matter, 
+ * lib2bit is a C-based library for accessing [2bit files](https://genome.ucsc.edu/FAQ/FAQformat.html#format7). 2bit files can be read and, with `twobitWriterOpen()` and friends, written. Though it's unlikely to matter, 
  *
  * The motivation for this project is due to needing fast access to 2bit files in [deepTools](https://github.com/fidelram/deepTools). Originally, we were using bx-python for this, which had the benefit of being easy to install and pretty quick. However, that wasn't compatible with python3, so we switched to [twobitreader](https://github.com/benjschiller/twobitreader). While doing everything we needed and working under both python2 and python3, it turns out that it has terrible performance (up to 1000x slow down in `computeGCBias`). Since we'd like to have our cake and eat it too, I began wrote a C library for convenient 2bit access and then [a python wrapper](https://github.com/dpryan79/py2bit) around it to work in python2 and 3.
  *
@@ -32,26 +33,50 @@ extern "C" {
 #endif
 
 /*!
- * @brief This structure holds the fixed-sized file header (16 bytes, of which 4 are blank). The version should always be 0. In theory, the endianness of the magic number can change (indicating that everything in the file should be swapped). As I've never actually seen this occur in the wild I've not bothered implementing it, though it'd be simple enough to do so.
+ * @brief This structure holds the fixed-sized file header (16 bytes, of which 4 are blank). The version is 0, or 1 for files larger than 4GB (in which case the sequence offsets in the chromosome list are 64-bit). If the file was written on a machine with the other endianness, then the magic number is byte swapped. In that case, the header, chromosome list and index records are swapped as they're read. The packed sequence is a byte stream, so it never needs swapping.
  */
 typedef struct {
     uint32_t magic; /**<Holds the magic number, should be 0x1A412743 */
-    uint32_t version; /**<File version, should be 0 */
+    uint32_t version; /**<File version, either 0 or 1 */
     uint32_t nChroms; /**<Number of chromosomes/contigs */
+    uint32_t swapped; /**<1 if the file was written with the other endianness, otherwise 0 */
 } TwoBitHeader;
 
 /*!
  * @brief This structure holds the chromosome names and the offset to the on-disk beginning of their sequences
  */
 typedef struct {
-    char **chrom; /**<A list of null terminated chromosomes */
-    uint32_t *offset; /**<The file offset for the beginning of each chromosome */
+    char **chrom; /**<A list of null terminated chromosomes, pointing into `names` */
+    char *names; /**<The chromosome names, stored back to back */
+    uint64_t *offset; /**<The file offset for the beginning of each chromosome */
+    uint64_t *hash; /**<An open-addressed hash table of chromosome names. Each slot holds the hash of a name in the upper 32 bits and the tid + 1 of the chromosome in the lower 32 bits, or 0 if empty. Keeping the hash avoids comparing names on collisions. */
+    uint32_t hashSize; /**<The number of slots in `hash`, which is always a power of 2 */
 } TwoBitCL;
 
+/*!
+ * @brief A bump allocator holding the variable-sized parts of the index.
+ *
+ * Allocations are carved out of large slabs, which are never moved or individually freed, so pointers into the arena remain valid until the file is closed. This avoids both the per-allocation overhead of `malloc()` and the fragmentation that results from hundreds of thousands of small allocations.
+ */
+typedef struct {
+    uint8_t **slabs; /**<The slabs, each allocated with `malloc()` */
+    uint32_t nSlabs; /**<The number of slabs */
+    uint32_t mSlabs; /**<The capacity of `slabs` */
+    uint8_t *cur; /**<The slab currently being filled */
+    uint64_t curUsed; /**<The number of bytes used in `cur` */
+    uint64_t curSize; /**<The size of `cur` */
+    uint64_t bytes; /**<The total size of all slabs */
+    uint64_t used; /**<The total number of bytes handed out */
+} TwoBitArena;
+
 /*!
  * @brief This structure holds the number, location and size of the hard (N) and soft (lower case) masked blocks.
  *
- * Note that this isn't a great data structure for random access, particularly for the soft-masked blocks. In practice, soft-masking is typically ignored and file access is less random and more blocky. Nonetheless, if performance is not acceptable then this is the structure to change.
+ * Only the sizes are read when the file is opened. Everything else for a given chromosome/contig is read from the file the first time it's accessed (see `twobitLoadIndex()`), so opening files with very many contigs is fast. Until then, the counts are 0 and the pointers NULL.
+ *
+ * The start and size arrays of the N blocks are stored as-is (in `arena`), since they're binary searched on every sequence fetch.
+ *
+ * The soft-masked blocks are far more numerous (~5.5 million in hg38), so they're stored compactly. For each chromosome/contig, `maskBlocks` points to a skip table of `(maskBlockCount + 63) / 64` pairs of `uint32_t`s (the start of block 64*k and the offset of its encoding in the stream that follows), followed by a stream of LEB128 varints holding, for each block, the gap since the end of the previous block and the block size. Since both are typically under 16384, each block generally takes 2 to 4 bytes rather than 8. Use `twobitMaskIterInit()` and `twobitMaskIterNext()` to walk the blocks.
  */
 typedef struct {
     uint32_t *size; /**<The size of a given chromosome/contig */
@@ -59,41 +84,114 @@ typedef struct {
     uint32_t **nBlockStart; /**<For each chromosome/contig, the list (size nBlockCount) of start positions of the block of Ns */
     uint32_t **nBlockSizes; /**<The size of each block specified above */
     uint32_t *maskBlockCount; /**<The number of blocks of masked sequence in a given chromosome/contig */
-    uint32_t **maskBlockStart; /**<For each chromosome/contig, the list (size maskBlockCount) of start positions of the masked sequence blocks */
-    uint32_t **maskBlockSizes; /**<The size of each block specified above */
+    uint8_t **maskBlocks; /**<For each chromosome/contig, the encoded soft-masked blocks (see above) or NULL if there are none. This is NULL if soft-masking information isn't stored. */
     uint64_t *offset; /**<The offset to the packed 2-bit sequence */
+    TwoBitArena arena; /**<Holds the N block arrays and encoded soft-masked blocks */
+    uint8_t *loaded; /**<For each chromosome/contig, whether the above has been read from the file */
+    pthread_mutex_t lock; /**<Serializes reading the index of a chromosome/contig (and so use of `arena`) */
 } TwoBitMaskedIdx;
 
+/*!
+ * @brief An iterator over the soft-masked blocks of a chromosome/contig, see `twobitMaskIterInit()`.
+ */
+typedef struct {
+    const uint8_t *p; /**<The encoding of the next block */
+    uint32_t remaining; /**<The number of blocks left to decode */
+    uint32_t start; /**<The start of the current block (0-based) */
+    uint32_t end; /**<The end of the current block (exclusive) */
+    int pending; /**<Set if the current block has been decoded but not yet returned */
+} TwoBitMaskIter;
+
+/*!
+ * @brief Per-base statistics of a region, see `twobitBaseStats()`.
+ */
+typedef struct {
+    uint32_t A; /**<The number of As */
+    uint32_t C; /**<The number of Cs */
+    uint32_t G; /**<The number of Gs */
+    uint32_t T; /**<The number of Ts */
+    uint32_t N; /**<The number of hard-masked bases (Ns) */
+    uint32_t softMasked; /**<The number of soft-masked (lower case) bases, including any Ns within soft-masked blocks */
+    uint32_t unmasked; /**<The number of A/C/G/T bases that aren't soft-masked */
+    uint32_t unmaskedGC; /**<The number of C/G bases that aren't soft-masked */
+} TwoBitBaseStats;
+
+/*!
+ * @brief This structure holds the optional composition index, which allows the base content of any interval to be computed from two lookups plus short scans at the edges.
+ *
+ * For each chromosome/contig, the cumulative number of T, C, A and G bases (in that order, as in the 2bit encoding) is stored every `step` bases. Each checkpoint takes 16 bytes, so the memory required is 16/step bytes per base in the file (e.g., ~190MB for a human genome with a step of 256 or ~48MB with a step of 1024). The checkpoints for a given chromosome are only computed when it's first queried.
+ */
+typedef struct {
+    uint32_t step; /**<The number of bases between checkpoints */
+    uint32_t **counts; /**<For each chromosome/contig, either NULL (not yet computed) or 4 cumulative counts per checkpoint. Checkpoint k holds the counts in [0, k*step) */
+    pthread_mutex_t lock; /**<Serializes computing the checkpoints of a chromosome/contig */
+} TwoBitCompIdx;
+
 /*!
  * @brief This is the main structure for holding a 2bit file
  *
- * Note that currently the 2bit file is mmap()ed prior to reading and that this isn't optional.
+ * Note that the 2bit file is mmap()ed prior to reading if possible, otherwise it's read with `pread()`. Alternatively, a file that's already in memory can be opened with `twobitOpenBuffer()`.
+ *
+ * Once a file has been opened, none of the query functions (e.g., `twobitSequence()` and `twobitBases()`) modify this structure (other than lazily reading the index and filling in the composition index, which are done under locks) and they read from the file with explicit offsets (`pread()` if the file couldn't be memory mapped). They can therefore be called concurrently from multiple threads on the same TwoBit object. `twobitClose()` must, of course, not be called until all of them have returned.
+ *
+ * A TwoBit object inherited across `fork()` can be used by both the parent and the child, since reads never depend on or move a shared file position and the memory map is read-only. The file mustn't be forked while another thread is in a query function, however, since the child could then inherit a held lock.
  */
 typedef struct {
     FILE *fp;    /**<The file pointer for the opened file */
     uint64_t sz; /**<File size in bytes (needed for munmap) */
-    uint64_t offset; /**<If the file is memory mapped, then this is the current file offset (otherwise ignored) */
-    void *data;  /**<The memory mapped file, if it exists. */
+    uint64_t offset; /**<If the file is memory mapped, then this is the current file offset while the header and index are being read (otherwise ignored) */
+    void *data;  /**<The memory mapped file (or the buffer given to `twobitOpenBuffer()`), if it exists. */
     TwoBitHeader *hdr; /**<File header */
     TwoBitCL *cl; /**<Chromosome list with sizes */
     TwoBitMaskedIdx *idx; /**<Index of masked blocks */
+    TwoBitCompIdx *comp; /**<The optional composition index (see `twobitSetCompositionIndex()`), or NULL */
+    int borrowed; /**<Set if `data` belongs to the caller (see `twobitOpenBuffer()`), in which case there's no `fp` and `data` isn't unmapped on close */
 } TwoBit;
 
+/*!
+ * @brief A 2bit file being written (see `twobitWriterOpen()`). Its contents are private.
+ */
+typedef struct TwoBitWriter TwoBitWriter;
+
 /*!
  * @brief Opens a local 2bit file
  *
  * @param fname The name of the 2bit file.
- * @param storeMasked Whether soft-masking information should be stored. If this is 1 then soft-masking information will be stored and the `twobitSequence()` function will return lower case letters in soft-masked regions. Note that this has a considerable performance and memory impact.
+ * @param storeMasked Whether soft-masking information should be stored. If this is 1 then soft-masking information will be stored and the `twobitSequence()` function will return lower case letters in soft-masked regions. The soft-masked blocks are stored compactly (see `TwoBitMaskedIdx`), so the memory impact is modest, but fetching sequences is somewhat slower.
  * @return A pointer to a TwoBit object.
  * @note The file is memory mapped.
  */
 TwoBit* twobitOpen(char *fname, int storeMasked);
 
+/*!
+ * @brief Opens a 2bit file that's already in memory
+ *
+ * This is useful for files in shared memory (e.g., in `/dev/shm` or created with `shm_open()`), which many processes can then use without each reading the file. The buffer is read exactly as a memory mapped file would be, so nothing is copied. It's never modified or freed.
+ *
+ * @param data The contents of a 2bit file, which must remain valid and unchanged until `twobitClose()` is called.
+ * @param size The size of `data` in bytes.
+ * @param storeMasked As in `twobitOpen()`.
+ * @return A pointer to a TwoBit object, or NULL on error (e.g., if the buffer doesn't hold a valid 2bit file).
+ */
+TwoBit *twobitOpenBuffer(const void *data, uint64_t size, int storeMasked);
+
 /*!
  * @brief Closes a 2bit file and free memory.
  */
 void twobitClose(TwoBit *tb);
 
+/*!
+ * @brief Enables (or disables) the composition index used by `twobitBases()`.
+ *
+ * With the index enabled, `twobitBases()` and `twobitBasesTid()` only need to scan at most `step` bases at either end of an interval, regardless of its size. The checkpoints for each chromosome/contig are computed the first time it's queried. See `TwoBitCompIdx` for the memory requirements.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param step The number of bases between checkpoints, which must be a multiple of 4. Smaller values use more memory and give faster queries. A value of 0 disables (and frees) the index.
+ * @return 0 on success and -1 on error.
+ * @note This must not be called while other threads are using tb.
+ */
+int twobitSetCompositionIndex(TwoBit *tb, uint32_t step);
+
 /*!
  * @brief Returns the length of a given chromosome.
  * 
@@ -103,6 +201,69 @@ void twobitClose(TwoBit *tb);
  */
 uint32_t twobitChromLen(TwoBit *tb, char *chrom);
 
+/*!
+ * @brief Returns the numeric ID (tid) of a given chromosome.
+ *
+ * The chromosome names are hashed when the file is opened, so this is a constant time operation regardless of the number of chromosomes/contigs in the file. The tid can then be given to the `*Tid()` functions to avoid repeated lookups.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param chrom The chromosome name.
+ * @return The tid (i.e., the index into `tb->cl->chrom`) or `(uint32_t) -1` if the chromosome/contig isn't present in the file.
+ */
+uint32_t twobitChromTid(TwoBit *tb, char *chrom);
+
+/*!
+ * @brief Returns the index of the first block that ends after a given position.
+ *
+ * This is a binary search, so finding the blocks overlapping a region costs O(log(n)) rather than O(n).
+ *
+ * @param starts The sorted start positions of non-overlapping blocks (e.g., `tb->idx->nBlockStart[tid]`).
+ * @param sizes The corresponding block sizes (e.g., `tb->idx->nBlockSizes[tid]`).
+ * @param n The number of blocks.
+ * @param pos The position (0-based).
+ * @return The index of the first block with `starts[i] + sizes[i] > pos`, or n if there is none.
+ */
+uint32_t twobitFirstBlock(uint32_t *starts, uint32_t *sizes, uint32_t n, uint32_t pos);
+
+/*!
+ * @brief Reads the N and soft-masked blocks of a chromosome/contig, if that hasn't already been done.
+ *
+ * The query functions in this library call this as needed. It only needs to be called directly before accessing the fields of `tb->idx` other than `size`. This is safe to call from multiple threads.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID (see `twobitChromTid()`).
+ * @return 0 on success and -1 on error (e.g., a truncated file).
+ */
+int twobitLoadIndex(TwoBit *tb, uint32_t tid);
+
+/*!
+ * @brief Positions an iterator at the first soft-masked block that ends after a given position.
+ *
+ * This uses the skip table, so only at most 64 blocks need to be decoded to find the starting point. Blocks are then returned in order by `twobitMaskIterNext()`.
+ *
+ * @param tb A pointer to a TwoBit object, which must have been opened with storeMasked set.
+ * @param tid The chromosome ID (see `twobitChromTid()`).
+ * @param pos The position (0-based).
+ * @param it The iterator to initialize.
+ */
+void twobitMaskIterInit(TwoBit *tb, uint32_t tid, uint32_t pos, TwoBitMaskIter *it);
+
+/*!
+ * @brief Advances a soft-masked block iterator.
+ *
+ * @param it An iterator initialized by `twobitMaskIterInit()`.
+ * @return 1 if there was another block (which is then in `it->start` and `it->end`), otherwise 0.
+ */
+int twobitMaskIterNext(TwoBitMaskIter *it);
+
+/*!
+ * @brief Returns the memory used by the index of N and soft-masked blocks.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @return The size in bytes, including the per-chromosome/contig arrays. Only chromosomes/contigs that have been accessed (see `twobitLoadIndex()`) are included. Space reserved in the arena but not yet used isn't counted, since it's never touched.
+ */
+uint64_t twobitIndexSize(TwoBit *tb);
+
 /*!
  * @brief Returns the sequence of a chromosome/contig or range of it.
  *
@@ -115,6 +276,74 @@ uint32_t twobitChromLen(TwoBit *tb, char *chrom);
  */
 char *twobitSequence(TwoBit *tb, char *chrom, uint32_t start, uint32_t end);
 
+/*!
+ * @brief Identical to `twobitSequence()`, but takes a chromosome ID (see `twobitChromTid()`) rather than a name.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates.
+ * @return The sequence or NULL on error.
+ * @note The result MUST be `free()`d.
+ */
+char *twobitSequenceTid(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end);
+
+/*!
+ * @brief Identical to `twobitSequenceTid()`, but decodes into a buffer supplied by the caller rather than allocating one.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates. As with `twobitSequence()`, a start and end of 0 denotes the entire chromosome/contig.
+ * @param seq The output, which must hold at least `end - start` characters. No null terminator is written.
+ * @return 0 on success and -1 on error (e.g., an invalid region).
+ */
+int twobitSequenceInto(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, char *seq);
+
+/*!
+ * @brief As `twobitSequenceInto()`, but writes the reverse complement of the region (i.e., the sequence of the minus strand).
+ *
+ * The packed bytes are decoded from the end with a reverse complement lookup table, and N and soft-masked blocks are applied in reversed coordinates, so this takes a single pass and is as fast as `twobitSequenceInto()`. Ns remain Ns and soft-masked bases remain lower case.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates. A start and end of 0 denotes the entire chromosome/contig.
+ * @param seq The output, which must hold at least `end - start` characters. No null terminator is written.
+ * @return 0 on success and -1 on error (e.g., an invalid region).
+ */
+int twobitRevCompInto(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, char *seq);
+
+/*!
+ * @brief As `twobitSequenceInto()`, but writes integer codes rather than letters, as is convenient for machine learning.
+ *
+ * Bases are coded as A=0, C=1, G=2 and T=3 (i.e., in alphabetical order) and N as 4. Soft-masking is ignored. The codes are decoded directly from the packed bytes, so this is exactly as fast as `twobitSequenceInto()`.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates. A start and end of 0 denotes the entire chromosome/contig.
+ * @param codes The output, which must hold at least `end - start` bytes.
+ * @return 0 on success and -1 on error (e.g., an invalid region).
+ */
+int twobitCodesInto(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint8_t *codes);
+
+/*!
+ * @brief Returns the sequences of many regions in a single call.
+ *
+ * This is considerably faster than calling `twobitSequenceTid()` repeatedly for many small regions, since only a single output buffer is allocated and a single scratch buffer is reused for reading.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param n The number of regions.
+ * @param tids The chromosome IDs (see `twobitChromTid()`) of each region.
+ * @param starts The starting position of each region in 0-based coordinates.
+ * @param ends The end position of each region in 1-based coordinates. As with `twobitSequence()`, a start and end of 0 denotes the entire chromosome/contig.
+ * @param offsets An array of at least n+1 elements that will be filled with the offset of each sequence in the output. Sequence `i` spans `[offsets[i], offsets[i+1])`.
+ * @return A single null-terminated buffer holding the concatenated sequences, or NULL on error (e.g., if any region is invalid).
+ * @note The result MUST be `free()`d.
+ */
+char *twobitSequenceBatch(TwoBit *tb, uint32_t n, uint32_t *tids, uint32_t *starts, uint32_t *ends, uint64_t *offsets);
+
 /*!
  * @brief Return the number/fraction of A, C, T, and G in a chromosome/region
  * 
@@ -129,6 +358,205 @@ char *twobitSequence(TwoBit *tb, char *chrom, uint32_t start, uint32_t end);
 
 void *twobitBases(TwoBit *tb, char *chrom, uint32_t start, uint32_t end, int fraction);
 
+/*!
+ * @brief Identical to `twobitBases()`, but takes a chromosome ID (see `twobitChromTid()`) rather than a name.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates.
+ * @param fraction Whether to return the values as fractions (1) or integers (0).
+ * @note On error NULL is returned. The result MUST be `free()`d.
+ */
+void *twobitBasesTid(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, int fraction);
+
+/*!
+ * @brief Returns the A, C, G, T, N and soft-masked content of a region in a single pass.
+ *
+ * This gives everything `twobitBasesTid()` does, plus what would otherwise need the masked blocks to be fetched and summed separately. The N blocks and soft-masked blocks overlapping the region are walked in order alongside the packed sequence, so bases within N blocks are never looked at and each soft-masked base is counted once more at most. The composition index (see `twobitSetCompositionIndex()`) is used for the totals if it's enabled.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates. A start and end of 0 denotes the entire chromosome/contig.
+ * @param stats The output. If the file wasn't opened with storeMasked set, then no bases are considered soft-masked.
+ * @return 0 on success and -1 on error (e.g., an invalid region).
+ */
+int twobitBaseStats(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, TwoBitBaseStats *stats);
+
+/*!
+ * @brief Returns the number of complete windows of a given width and step within a region.
+ *
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates.
+ * @param width The window width.
+ * @param step The distance between the starts of successive windows.
+ * @return The number of windows, starting at `start`, `start + step`, ..., that end by `end`. This is 0 if step is 0.
+ */
+uint32_t twobitWindowNumber(uint32_t start, uint32_t end, uint32_t width, uint32_t step);
+
+/*!
+ * @brief Counts the A, C, G, T and N bases in each of a series of (possibly overlapping) windows.
+ *
+ * This is equivalent to calling `twobitBasesTid()` on every window, but the packed sequence is only read once and each base is counted once, however much the windows overlap. Incomplete windows at the end of the region are omitted.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates. A start and end of 0 denotes the entire chromosome/contig.
+ * @param width The window width, which must be positive.
+ * @param step The distance between the starts of successive windows, which must be positive.
+ * @param counts The output, which must hold 5 values per window (see `twobitWindowNumber()`). These are the A, C, G, T and N counts, respectively, of each window in turn.
+ * @return 0 on success and -1 on error (e.g., an invalid region).
+ */
+int twobitWindowCounts(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint32_t width, uint32_t step, uint32_t *counts);
+
+/*!
+ * @brief Counts the 16 dinucleotides in a region.
+ *
+ * The counts are computed from the packed sequence, 32 bases at a time, by comparing each base with the next. Pairs including an N are excluded and soft-masking is ignored.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates. A start and end of 0 denotes the entire chromosome/contig.
+ * @param counts The output, in the order AA, AC, AG, AT, CA, ..., TT (i.e., the index is 4 times the first base plus the second, with A=0, C=1, G=2 and T=3). Only pairs entirely within the region are counted.
+ * @return 0 on success and -1 on error (e.g., an invalid region).
+ */
+int twobitDinucleotides(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint32_t counts[16]);
+
+/*!
+ * @brief As `twobitDinucleotides()`, but for each of a series of (possibly overlapping) windows, as in `twobitWindowCounts()`.
+ *
+ * Each base is only read once, however much the windows overlap.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates. A start and end of 0 denotes the entire chromosome/contig.
+ * @param width The window width, which must be positive.
+ * @param step The distance between the starts of successive windows, which must be positive.
+ * @param counts The output, which must hold 16 values per window (see `twobitWindowNumber()`), in the same order as in `twobitDinucleotides()`.
+ * @return 0 on success and -1 on error (e.g., an invalid region).
+ */
+int twobitWindowDinucleotides(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, uint32_t width, uint32_t step, uint32_t *counts);
+
+/*!
+ * @brief The largest k supported by `twobitKmerCounts()` and `twobitKmerCountsGenome()`.
+ */
+#define TWOBIT_MAX_K 16
+
+/*!
+ * @brief Counts the k-mers in a region, adding them to a dense table.
+ *
+ * K-mers are indexed by their bases in ACGT order with 2 bits each, so the k-mer starting with base b0 has index b0 * 4^(k-1) + b1 * 4^(k-2) + ... + b(k-1), where A=0, C=1, G=2 and T=3. A rolling index is kept straight off the packed sequence and restarted after each N block, so no k-mer containing an N is counted. Soft-masking is ignored.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates. A start and end of 0 denotes the entire chromosome/contig.
+ * @param k The k-mer length, from 1 to `TWOBIT_MAX_K`.
+ * @param canonical If set, each k-mer is counted under the smaller of its own index and that of its reverse complement, so the entries of non-canonical k-mers remain 0.
+ * @param counts The table, which must hold 4^k values (8*4^k bytes, so 32GB for k=16). The counts are added to it, so it can be accumulated over many regions.
+ * @return 0 on success and -1 on error (e.g., an invalid region).
+ */
+int twobitKmerCounts(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, int k, int canonical, uint64_t *counts);
+
+/*!
+ * @brief As `twobitKmerCounts()`, but over every chromosome/contig, which are divided between threads.
+ *
+ * For k up to 10, each thread counts into its own table and these are then summed. Larger tables are shared, with atomic increments.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param k The k-mer length, from 1 to `TWOBIT_MAX_K`.
+ * @param canonical As in `twobitKmerCounts()`.
+ * @param nThreads The number of threads to use, including the calling one. If this is 0 or less, then one per online CPU is used.
+ * @param counts The table, which must hold 4^k values. The counts are added to it.
+ * @return 0 on success and -1 on error.
+ */
+int twobitKmerCountsGenome(TwoBit *tb, int k, int canonical, int nThreads, uint64_t *counts);
+
+/*!
+ * @brief The longest pattern supported by `twobitFindMotif()`.
+ */
+#define TWOBIT_MAX_MOTIF 32
+
+/*!
+ * @brief Finds the occurrences of an IUPAC pattern (e.g., a restriction site) in a region.
+ *
+ * The pattern is matched against the packed sequence with the shift-and algorithm, resetting at each N block, so nothing overlapping an N matches (even an N in the pattern). Soft-masking is ignored.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param tid The chromosome ID.
+ * @param start The starting position in 0-based coordinates.
+ * @param end The end position in 1-based coordinates. A start and end of 0 denotes the entire chromosome/contig.
+ * @param pattern A null terminated pattern of 1 to `TWOBIT_MAX_MOTIF` IUPAC symbols (A, C, G, T, U, R, Y, S, W, K, M, B, D, H, V and N, in either case).
+ * @param bothStrands If set, the reverse complement of the pattern is also matched, so palindromic sites aren't reported twice.
+ * @param hits Set to an array of the (0-based) start positions of the matches entirely within the region, in increasing order, which must be free()d. This is NULL if there are none.
+ * @param nHits Set to the number of matches.
+ * @return 0 on success and -1 on error (e.g., an invalid region or pattern).
+ */
+int twobitFindMotif(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, const char *pattern, int bothStrands, uint32_t **hits, uint64_t *nHits);
+
+/*!
+ * @brief Creates a 2bit file, to which sequences are then added with `twobitWriterAddSequence()`.
+ *
+ * The packed records are written to an unlinked temporary file in the same directory until `twobitWriterClose()` is called, since the index precedes them. Memory use is therefore bounded by the number of sequences being packed at once, rather than the size of the output.
+ *
+ * The file itself is written under a temporary name in the same directory and renamed to `fname` only once it's complete, so an existing file is left intact, and readable through any open handles, until then.
+ *
+ * @param fname The file name.
+ * @param nThreads The number of threads used to pack sequences. If this is 0 or less, then one per online CPU is used. With 1, sequences are packed by the calling thread.
+ * @return A pointer to a TwoBitWriter object, or NULL on error (e.g., if the file can't be created).
+ */
+TwoBitWriter *twobitWriterOpen(const char *fname, int nThreads);
+
+/*!
+ * @brief Adds a sequence to a 2bit file.
+ *
+ * A, C, G and T (in either case) are stored as such. Anything else is stored as an N. Lower case letters are stored as soft-masked.
+ *
+ * @param w A pointer to a TwoBitWriter object.
+ * @param name The null terminated name of the chromosome/contig, which must be 1 to 255 characters long.
+ * @param seq The sequence, which needn't be null terminated. With more than one thread it's copied, so it can be reused as soon as this returns.
+ * @param len The length of `seq`.
+ * @return 0 on success and -1 on error. Errors from worker threads may only be reported by a later call or by `twobitWriterClose()`.
+ */
+int twobitWriterAddSequence(TwoBitWriter *w, const char *name, const char *seq, uint32_t len);
+
+/*!
+ * @brief Writes the index and records of a 2bit file and frees the TwoBitWriter object.
+ *
+ * A version 1 file (with 64-bit offsets) is written if any record starts beyond 4GB, and a version 0 file otherwise.
+ *
+ * @param w A pointer to a TwoBitWriter object, which is always freed.
+ * @return 0 on success and -1 if an error occurred at any point, in which case the temporary file is removed and any existing file is left as it was.
+ */
+int twobitWriterClose(TwoBitWriter *w);
+
+/*!
+ * @brief Discards a 2bit file being written, removing its temporary file, and frees the TwoBitWriter object. Any existing file is left as it was.
+ *
+ * @param w A pointer to a TwoBitWriter object.
+ */
+void twobitWriterAbort(TwoBitWriter *w);
+
+/*!
+ * @brief Writes a new 2bit file holding a selection of chromosomes/contigs or regions of them.
+ *
+ * Whole chromosomes/contigs are copied byte for byte from the file (with `sendfile()` on Linux), so nothing is decoded or re-encoded. For regions, the N and soft-masked blocks are clipped and rebased and the packed sequence is copied, shifting it only if the start isn't a multiple of 4. Soft-masking is preserved whether or not it's stored in `tb`. The output is native-endian, so records from byte-swapped files are always rewritten.
+ *
+ * @param tb A pointer to a TwoBit object.
+ * @param fname The name of the file to create.
+ * @param n The number of chromosomes/contigs or regions to write.
+ * @param tids The chromosome IDs.
+ * @param starts The starting positions in 0-based coordinates.
+ * @param ends The end positions in 1-based coordinates. A start and end of 0 denotes the entire chromosome/contig.
+ * @param names The name of each record in the new file, or NULL (either for the array or an element of it) to use the name of the chromosome/contig.
+ * @return 0 on success and -1 on error (e.g., an invalid region or an overly long name), in which case any existing file is left as it was.
+ */
+int twobitSubset(TwoBit *tb, const char *fname, uint32_t n, const uint32_t *tids, const uint32_t *starts, const uint32_t *ends, char **names);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,36 +1,229 @@
 #include <Python.h>
 #include <inttypes.h>
+#include <unistd.h>
 #include "py2bit.h"
 
+/*
+    Release the GIL around calls into lib2bit, which are thread-safe. While the GIL is released,
+    another thread could try to close the file, so py2bitClose() refuses to do so while nActive > 0.
+
+    Releasing and reacquiring the GIL costs about as much as fetching a few hundred bases, so it's
+    only done if the amount of work (e.g., the number of bases) is at least PY2BIT_NOGIL_MIN.
+*/
+#define PY2BIT_NOGIL_MIN 4096
+#define PY2BIT_BEGIN_ALLOW_THREADS(self, work) { \
+    PyThreadState *_save = NULL; \
+    (self)->nActive++; \
+    if((work) >= PY2BIT_NOGIL_MIN) _save = PyEval_SaveThread();
+#define PY2BIT_END_ALLOW_THREADS(self) \
+    if(_save) PyEval_RestoreThread(_save); \
+    (self)->nActive--; \
+}
+
 static PyObject *py2bitOpen(PyObject *self, PyObject *args, PyObject *kwds) {
-    char *fname = NULL;
+    char *fname = NULL, *path = NULL;
     PyObject *storeMaskedO = Py_False;
     pyTwoBit_t *pytb;
     int storeMasked = 0;
+    unsigned long compositionIndex = 0;
     TwoBit *tb = NULL;
-    static char *kwd_list[] = {"fname", "storeMasked", NULL};
+    static char *kwd_list[] = {"fname", "storeMasked", "compositionIndex", NULL};
 
-    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|O", kwd_list, &fname, &storeMaskedO)) goto error;
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|Ok", kwd_list, &fname, &storeMaskedO, &compositionIndex)) goto error;
 
     if(storeMaskedO == Py_True) storeMasked = 1;
+    if(compositionIndex % 4 || compositionIndex > (uint32_t) -1) {
+        PyErr_SetString(PyExc_RuntimeError, "compositionIndex must be a multiple of 4!");
+        return NULL;
+    }
 
     //Open the file
     tb = twobitOpen(fname, storeMasked);
     if(!tb) goto error;
+    if(twobitSetCompositionIndex(tb, (uint32_t) compositionIndex) != 0) goto error;
+
+    //Pickled objects are reopened by this, so it mustn't depend on the working directory
+    path = realpath(fname, NULL);
+    if(!path) path = strdup(fname);
+    if(!path) goto error;
+
+    pytb = PyObject_New(pyTwoBit_t, &pyTwoBit);
+    if(!pytb) goto error;
+    pytb->storeMasked = storeMasked;
+    pytb->nActive = 0;
+    pytb->buf.obj = NULL;
+    pytb->fname = path;
+    pytb->tb = tb;
+
+    return (PyObject*) pytb;
+
+error:
+    if(tb) twobitClose(tb);
+    if(path) free(path);
+    PyErr_SetString(PyExc_RuntimeError, "Received an error during file opening!");
+    return NULL;
+}
+
+static PyObject *py2bitOpenBuffer(PyObject *self, PyObject *args, PyObject *kwds) {
+    PyObject *bufferO = NULL, *storeMaskedO = Py_False;
+    pyTwoBit_t *pytb = NULL;
+    Py_buffer view = {0};
+    int storeMasked = 0;
+    unsigned long compositionIndex = 0;
+    TwoBit *tb = NULL;
+    static char *kwd_list[] = {"buffer", "storeMasked", "compositionIndex", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|Ok", kwd_list, &bufferO, &storeMaskedO, &compositionIndex)) return NULL;
+
+    if(storeMaskedO == Py_True) storeMasked = 1;
+    if(compositionIndex % 4 || compositionIndex > (uint32_t) -1) {
+        PyErr_SetString(PyExc_RuntimeError, "compositionIndex must be a multiple of 4!");
+        return NULL;
+    }
+
+    //The view holds a reference to the object (and prevents e.g. a bytearray from being resized) until the file is closed
+    if(PyObject_GetBuffer(bufferO, &view, PyBUF_SIMPLE) != 0) return NULL;
+
+    tb = twobitOpenBuffer(view.buf, (uint64_t) view.len, storeMasked);
+    if(!tb) goto error;
+    if(twobitSetCompositionIndex(tb, (uint32_t) compositionIndex) != 0) goto error;
 
     pytb = PyObject_New(pyTwoBit_t, &pyTwoBit);
     if(!pytb) goto error;
     pytb->storeMasked = storeMasked;
+    pytb->nActive = 0;
+    pytb->buf = view;
+    pytb->fname = NULL;
     pytb->tb = tb;
 
     return (PyObject*) pytb;
 
 error:
     if(tb) twobitClose(tb);
+    PyBuffer_Release(&view);
     PyErr_SetString(PyExc_RuntimeError, "Received an error during file opening!");
     return NULL;
 }
 
+/*
+    Get a pointer to the contents of a str (as UTF-8) or bytes-like object, which is valid as long as the object
+    and view are. view->obj is NULL if the object is a str, otherwise view must be released.
+*/
+static int py2bitGetChars(PyObject *o, Py_buffer *view, const char **chars, Py_ssize_t *len) {
+    view->obj = NULL;
+    if(PyUnicode_Check(o)) {
+        *chars = PyUnicode_AsUTF8AndSize(o, len);
+        return (*chars) ? 0 : -1;
+    }
+    if(PyObject_GetBuffer(o, view, PyBUF_SIMPLE) != 0) return -1;
+    *chars = view->buf;
+    *len = view->len;
+    return 0;
+}
+
+static PyObject *py2bitWrite(PyObject *self, PyObject *args, PyObject *kwds) {
+    char *fname = NULL;
+    PyObject *seqs = NULL, *items = NULL, *iter = NULL, *item = NULL, *pair, *nameO = NULL, *seqO = NULL, *nameBytes = NULL;
+    Py_buffer view = {0};
+    TwoBitWriter *w = NULL;
+    PyThreadState *_save = NULL;
+    const char *seq;
+    Py_ssize_t len;
+    int nThreads = 0, rv;
+    static char *kwd_list[] = {"fname", "sequences", "threads", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "sO|i", kwd_list, &fname, &seqs, &nThreads)) return NULL;
+
+    //A dict (or other mapping) yields its items, anything else must yield (name, sequence) pairs
+    if(PyDict_Check(seqs)) {
+        items = PyDict_Items(seqs);
+        if(!items) return NULL;
+        iter = PyObject_GetIter(items);
+    } else {
+        iter = PyObject_GetIter(seqs);
+    }
+    if(!iter) goto error;
+
+    Py_BEGIN_ALLOW_THREADS
+    w = twobitWriterOpen(fname, nThreads);
+    Py_END_ALLOW_THREADS
+    if(!w) {
+        PyErr_Format(PyExc_RuntimeError, "Couldn't create %s!", fname);
+        goto error;
+    }
+
+    while((item = PyIter_Next(iter))) {
+        //Replace the item with a list or tuple, so its contents can be borrowed
+        pair = PySequence_Fast(item, "sequences must be a dict or yield (name, sequence) pairs!");
+        Py_DECREF(item);
+        item = pair;
+        if(!item) goto error;
+        if(PySequence_Fast_GET_SIZE(item) != 2) {
+            PyErr_SetString(PyExc_RuntimeError, "sequences must be a dict or yield (name, sequence) pairs!");
+            goto error;
+        }
+        nameO = PySequence_Fast_GET_ITEM(item, 0);
+        seqO = PySequence_Fast_GET_ITEM(item, 1);
+        if(PyUnicode_Check(nameO)) {
+            nameBytes = PyUnicode_AsUTF8String(nameO);
+        } else if(PyBytes_Check(nameO)) {
+            nameBytes = nameO;
+            Py_INCREF(nameBytes);
+        } else {
+            PyErr_SetString(PyExc_RuntimeError, "Sequence names must be str or bytes!");
+            goto error;
+        }
+        if(!nameBytes) goto error;
+        if(PyBytes_GET_SIZE(nameBytes) < 1 || PyBytes_GET_SIZE(nameBytes) > 255 || strlen(PyBytes_AS_STRING(nameBytes)) != (size_t) PyBytes_GET_SIZE(nameBytes)) {
+            PyErr_SetString(PyExc_RuntimeError, "Sequence names must be 1 to 255 bytes long, without null characters!");
+            goto error;
+        }
+        if(py2bitGetChars(seqO, &view, &seq, &len) != 0) goto error;
+        if(len > (uint32_t) -1) {
+            PyErr_SetString(PyExc_RuntimeError, "Sequences can't be longer than 2^32-1 bases!");
+            goto error;
+        }
+
+        if(len >= PY2BIT_NOGIL_MIN) _save = PyEval_SaveThread();
+        rv = twobitWriterAddSequence(w, PyBytes_AS_STRING(nameBytes), seq, (uint32_t) len);
+        if(_save) PyEval_RestoreThread(_save);
+        _save = NULL;
+        if(rv != 0) {
+            PyErr_Format(PyExc_RuntimeError, "Received an error while writing %s!", PyBytes_AS_STRING(nameBytes));
+            goto error;
+        }
+
+        if(view.obj) PyBuffer_Release(&view);
+        Py_DECREF(nameBytes);
+        nameBytes = NULL;
+        Py_DECREF(item);
+    }
+    item = NULL;
+    if(PyErr_Occurred()) goto error;
+
+    Py_BEGIN_ALLOW_THREADS
+    rv = twobitWriterClose(w);
+    Py_END_ALLOW_THREADS
+    w = NULL;
+    if(rv != 0) {
+        PyErr_Format(PyExc_RuntimeError, "Received an error while writing %s!", fname);
+        goto error;
+    }
+
+    Py_DECREF(iter);
+    Py_XDECREF(items);
+    Py_RETURN_NONE;
+
+error:
+    if(view.obj) PyBuffer_Release(&view);
+    Py_XDECREF(nameBytes);
+    Py_XDECREF(item);
+    Py_XDECREF(iter);
+    Py_XDECREF(items);
+    if(w) twobitWriterAbort(w);
+    return NULL;
+}
+
 PyObject *py2bitEnter(pyTwoBit_t *self, PyObject *args) {
     TwoBit *tb = self->tb;
 
@@ -44,23 +237,57 @@ PyObject *py2bitEnter(pyTwoBit_t *self, PyObject *args) {
     return (PyObject*) self;
 }
 
+/*
+    Pickle by reopening the file. This is also used by copy.copy().
+*/
+static PyObject *py2bitReduce(pyTwoBit_t *self, PyObject *args) {
+    PyObject *mod, *openO;
+    TwoBit *tb = self->tb;
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+    if(!self->fname) {
+        PyErr_SetString(PyExc_TypeError, "TwoBit objects opened with open_buffer() can't be pickled!");
+        return NULL;
+    }
+
+    mod = PyImport_ImportModule("py2bit");
+    if(!mod) return NULL;
+    openO = PyObject_GetAttrString(mod, "open");
+    Py_DECREF(mod);
+    if(!openO) return NULL;
+
+    return Py_BuildValue("(N(sOk))", openO, self->fname, (self->storeMasked) ? Py_True : Py_False, (unsigned long) ((tb->comp) ? tb->comp->step : 0));
+}
+
 static void py2bitDealloc(pyTwoBit_t *self) {
     if(self->tb) twobitClose(self->tb);
+    if(self->buf.obj) PyBuffer_Release(&self->buf);
+    if(self->fname) free(self->fname);
     PyObject_DEL(self);
 }
 
 static PyObject *py2bitClose(pyTwoBit_t *self, PyObject *args) {
+    if(self->nActive) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file can't be closed while it's being used by another thread!");
+        return NULL;
+    }
     if(self->tb) twobitClose(self->tb);
     self->tb = NULL;
+    if(self->buf.obj) PyBuffer_Release(&self->buf);
     Py_INCREF(Py_None);
     return Py_None;
 }
 
-//Returns the file size, number of chromosomes/contigs, total sequence length and total masked length
+//Returns the file size, number of chromosomes/contigs, total sequence length, total masked length and index size
 static PyObject *py2bitInfo(pyTwoBit_t *self, PyObject *args) {
     TwoBit *tb = self->tb;
     PyObject *ret = NULL, *val = NULL;
-    uint32_t i, j, foo;
+    uint32_t i, j;
+    uint64_t foo;
+    TwoBitMaskIter it;
 
     if(!tb) {
         PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
@@ -84,7 +311,7 @@ static PyObject *py2bitInfo(pyTwoBit_t *self, PyObject *args) {
     //sequence length
     foo = 0;
     for(i=0; i<tb->hdr->nChroms; i++) foo += tb->idx->size[i];
-    val = PyLong_FromUnsignedLong(foo);
+    val = PyLong_FromUnsignedLongLong(foo);
     if(!val) goto error;
     if(PyDict_SetItemString(ret, "sequence length", val) == -1) goto error;
     Py_DECREF(val);
@@ -92,30 +319,36 @@ static PyObject *py2bitInfo(pyTwoBit_t *self, PyObject *args) {
     //hard-masked length
     foo = 0;
     for(i=0; i<tb->hdr->nChroms; i++) {
+        if(twobitLoadIndex(tb, i) != 0) goto error;
         for(j=0; j<tb->idx->nBlockCount[i]; j++) {
             foo += tb->idx->nBlockSizes[i][j];
         }
     }
-    val = PyLong_FromUnsignedLong(foo);
+    val = PyLong_FromUnsignedLongLong(foo);
     if(!val) goto error;
     if(PyDict_SetItemString(ret, "hard-masked length", val) == -1) goto error;
     Py_DECREF(val);
 
     //soft-masked length
-    if(tb->idx->maskBlockStart) {
+    if(tb->idx->maskBlocks) {
         foo = 0;
         for(i=0; i<tb->hdr->nChroms; i++) {
-            for(j=0; j<tb->idx->maskBlockCount[i]; j++) {
-                foo += tb->idx->maskBlockSizes[i][j];
-            }
+            twobitMaskIterInit(tb, i, 0, &it);
+            while(twobitMaskIterNext(&it)) foo += it.end - it.start;
         }
 
-        val = PyLong_FromUnsignedLong(foo);
+        val = PyLong_FromUnsignedLongLong(foo);
         if(!val) goto error;
         if(PyDict_SetItemString(ret, "soft-masked length", val) == -1) goto error;
         Py_DECREF(val);
     }
 
+    //index size
+    val = PyLong_FromUnsignedLongLong(twobitIndexSize(tb));
+    if(!val) goto error;
+    if(PyDict_SetItemString(ret, "index size", val) == -1) goto error;
+    Py_DECREF(val);
+
     return ret;
 
 error:
@@ -129,7 +362,7 @@ static PyObject *py2bitChroms(pyTwoBit_t *self, PyObject *args) {
     PyObject *ret = NULL, *val = NULL;
     TwoBit *tb = self->tb;
     char *chrom = NULL;
-    uint32_t i;
+    uint32_t i, tid;
 
     if(!tb) {
         PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
@@ -146,12 +379,10 @@ static PyObject *py2bitChroms(pyTwoBit_t *self, PyObject *args) {
             Py_DECREF(val);
         }
     } else {
-        for(i=0; i<tb->hdr->nChroms; i++) {
-            if(strcmp(tb->cl->chrom[i], chrom) == 0) {
-                ret = PyLong_FromUnsignedLong(tb->idx->size[i]);
-                if(!ret) goto error;
-                break;
-            }
+        tid = twobitChromTid(tb, chrom);
+        if(tid != (uint32_t) -1) {
+            ret = PyLong_FromUnsignedLong(tb->idx->size[tid]);
+            if(!ret) goto error;
         }
     }
 
@@ -169,35 +400,41 @@ error :
     return NULL;
 }
 
-#if PY_MAJOR_VERSION >= 3
-PyObject *PyString_FromString(char *seq) {
-    return PyUnicode_FromString(seq);
-}
-#endif
-
 static PyObject *py2bitSequence(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
-    PyObject *ret = NULL;
+    PyObject *ret = NULL, *outO = Py_None;
     TwoBit *tb = self->tb;
-    char *seq, *chrom;
+    char *seq = NULL, *chrom, *format = "str", *strand = "+";
     unsigned long startl = 0, endl = 0;
-    uint32_t start, end, len;
-    static char *kwd_list[] = {"chrom", "start", "end", NULL};
+    uint32_t start, end, len, tid;
+    Py_buffer view;
+    int rv, reverse;
+    static char *kwd_list[] = {"chrom", "start", "end", "format", "out", "strand", NULL};
 
     if(!tb) {
         PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
         return NULL;
     }
 
-    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|kk", kwd_list, &chrom, &startl, &endl)) {
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|kksOs", kwd_list, &chrom, &startl, &endl, &format, &outO, &strand)) {
         PyErr_SetString(PyExc_RuntimeError, "You must supply at least a chromosome!");
         return NULL;
     }
 
-    len = twobitChromLen(tb, chrom);
-    if(len == 0) {
+    if(strcmp(strand, "+") == 0) {
+        reverse = 0;
+    } else if(strcmp(strand, "-") == 0) {
+        reverse = 1;
+    } else {
+        PyErr_SetString(PyExc_RuntimeError, "strand must be either '+' or '-'!");
+        return NULL;
+    }
+
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
         PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
         return NULL;
     }
+    len = tb->idx->size[tid];
     if(endl > len) endl = len;
     end = (uint32_t) endl;
     if(startl >= endl && startl > 0) {
@@ -205,31 +442,515 @@ static PyObject *py2bitSequence(pyTwoBit_t *self, PyObject *args, PyObject *kwds
         return NULL;
     }
     start = (uint32_t) startl;
-    seq = twobitSequence(tb, chrom, start, end);
+    if(end == 0) end = len;
+
+    //Decode straight into a caller-supplied buffer, returning the number of bases
+    if(outO != Py_None) {
+        if(PyObject_GetBuffer(outO, &view, PyBUF_WRITABLE) != 0) return NULL;
+        if(view.itemsize != 1 || view.len < end - start) {
+            PyBuffer_Release(&view);
+            PyErr_SetString(PyExc_RuntimeError, "out must be a writable buffer of single bytes (e.g., a bytearray or uint8 array) at least as long as the sequence!");
+            return NULL;
+        }
+        rv = 0;
+        if(end > start) {
+            PY2BIT_BEGIN_ALLOW_THREADS(self, end - start)
+            if(reverse) rv = twobitRevCompInto(tb, tid, start, end, view.buf);
+            else rv = twobitSequenceInto(tb, tid, start, end, view.buf);
+            PY2BIT_END_ALLOW_THREADS(self)
+        }
+        PyBuffer_Release(&view);
+        if(rv != 0) {
+            PyErr_SetString(PyExc_RuntimeError, "There was an error while fetching the sequence!");
+            return NULL;
+        }
+        return PyLong_FromUnsignedLong(end - start);
+    }
+
+    //Otherwise, decode straight into a new object, rather than copying
+    if(strcmp(format, "bytes") == 0) {
+        ret = PyBytes_FromStringAndSize(NULL, end - start);
+        if(ret) seq = PyBytes_AS_STRING(ret);
+    } else if(strcmp(format, "str") == 0) {
+#if PY_MAJOR_VERSION >= 3
+        ret = PyUnicode_New(end - start, 127);
+        if(ret) seq = PyUnicode_DATA(ret);
+#else
+        ret = PyString_FromStringAndSize(NULL, end - start);
+        if(ret) seq = PyString_AS_STRING(ret);
+#endif
+    } else {
+        PyErr_SetString(PyExc_RuntimeError, "format must be either 'str' or 'bytes'!");
+        return NULL;
+    }
+    if(!ret) {
+        PyErr_SetString(PyExc_RuntimeError, "Received an error while allocating the output!");
+        return NULL;
+    }
+    if(end == start) return ret;
+
+    PY2BIT_BEGIN_ALLOW_THREADS(self, end - start)
+    if(reverse) rv = twobitRevCompInto(tb, tid, start, end, seq);
+    else rv = twobitSequenceInto(tb, tid, start, end, seq);
+    PY2BIT_END_ALLOW_THREADS(self)
+    if(rv != 0) {
+        Py_DECREF(ret);
+        PyErr_SetString(PyExc_RuntimeError, "There was an error while fetching the sequence!");
+        return NULL;
+    }
+
+    return ret;
+}
+
+//Return the C string held in a python str (or bytes) object. The result must not be freed.
+static char *py2bitAsString(PyObject *o) {
+#if PY_MAJOR_VERSION >= 3
+    if(PyBytes_Check(o)) return PyBytes_AsString(o);
+    return (char*) PyUnicode_AsUTF8(o);
+#else
+    return PyString_AsString(o);
+#endif
+}
+
+/*
+    Convert the regions given to functions like sequences() into tid/start/end arrays. Either chromsO is an iterable
+    of (chrom, start, end, ...) items and startsO/endsO are None, or chromsO (a sequence or a single chromosome name),
+    startsO and endsO are equal-length sequences. As with sequence(), end values beyond the end of a chromosome are
+    truncated.
+
+    Returns the number of regions or -1 on error, in which case an exception is set. The arrays must be free()d.
+*/
+static Py_ssize_t py2bitParseRegions(TwoBit *tb, PyObject *chromsO, PyObject *startsO, PyObject *endsO, uint32_t **tids, uint32_t **starts, uint32_t **ends) {
+    PyObject *regions = NULL, *chroms = NULL, *startsF = NULL, *endsF = NULL, *item = NULL;
+    PyObject *chromO, *startO, *endO, *lastChromO = NULL;
+    Py_ssize_t i, n;
+    unsigned long startl, endl;
+    uint32_t tid = (uint32_t) -1;
+    char *chrom, *lastChrom = NULL;
+
+    *tids = NULL;
+    *starts = NULL;
+    *ends = NULL;
+
+    if(startsO == Py_None && endsO == Py_None) {
+        regions = PySequence_Fast(chromsO, "The regions must be an iterable of (chrom, start, end) items!");
+        if(!regions) return -1;
+        n = PySequence_Fast_GET_SIZE(regions);
+    } else if(startsO == Py_None || endsO == Py_None) {
+        PyErr_SetString(PyExc_RuntimeError, "Both starts and ends must be specified!");
+        return -1;
+    } else {
+        startsF = PySequence_Fast(startsO, "starts must be a sequence of integers!");
+        if(!startsF) goto error;
+        endsF = PySequence_Fast(endsO, "ends must be a sequence of integers!");
+        if(!endsF) goto error;
+        n = PySequence_Fast_GET_SIZE(startsF);
+#if PY_MAJOR_VERSION >= 3
+        if(!PyUnicode_Check(chromsO) && !PyBytes_Check(chromsO)) {
+#else
+        if(!PyString_Check(chromsO)) {
+#endif
+            chroms = PySequence_Fast(chromsO, "chroms must be a chromosome name or a sequence of them!");
+            if(!chroms) goto error;
+            if(PySequence_Fast_GET_SIZE(chroms) != n) {
+                PyErr_SetString(PyExc_RuntimeError, "chroms, starts and ends must all have the same length!");
+                goto error;
+            }
+        }
+        if(PySequence_Fast_GET_SIZE(endsF) != n) {
+            PyErr_SetString(PyExc_RuntimeError, "chroms, starts and ends must all have the same length!");
+            goto error;
+        }
+    }
+
+    *tids = malloc((n + 1) * sizeof(uint32_t));
+    *starts = malloc((n + 1) * sizeof(uint32_t));
+    *ends = malloc((n + 1) * sizeof(uint32_t));
+    if(!*tids || !*starts || !*ends) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for(i=0; i<n; i++) {
+        if(regions) {
+            item = PySequence_Fast(PySequence_Fast_GET_ITEM(regions, i), "Each region must be a (chrom, start, end) sequence!");
+            if(!item) goto error;
+            if(PySequence_Fast_GET_SIZE(item) < 3) {
+                PyErr_SetString(PyExc_RuntimeError, "Each region must have at least a chromosome, start and end!");
+                goto error;
+            }
+            chromO = PySequence_Fast_GET_ITEM(item, 0);
+            startO = PySequence_Fast_GET_ITEM(item, 1);
+            endO = PySequence_Fast_GET_ITEM(item, 2);
+        } else {
+            chromO = (chroms) ? PySequence_Fast_GET_ITEM(chroms, i) : chromsO;
+            startO = PySequence_Fast_GET_ITEM(startsF, i);
+            endO = PySequence_Fast_GET_ITEM(endsF, i);
+        }
+
+        //Consecutive regions are typically on the same chromosome. lastChrom points into lastChromO, which may belong to a previous item, so a reference to it is held.
+        chrom = py2bitAsString(chromO);
+        if(!chrom) goto error;
+        if(!lastChrom || strcmp(chrom, lastChrom) != 0) {
+            tid = twobitChromTid(tb, chrom);
+            Py_INCREF(chromO);
+            Py_XDECREF(lastChromO);
+            lastChromO = chromO;
+            lastChrom = chrom;
+        }
+        if(tid == (uint32_t) -1) {
+            PyErr_Format(PyExc_RuntimeError, "The chromosome '%s' doesn't exist in the 2bit file!", chrom);
+            goto error;
+        }
+
+        startl = PyLong_AsUnsignedLong(startO);
+        if(PyErr_Occurred()) goto error;
+        endl = PyLong_AsUnsignedLong(endO);
+        if(PyErr_Occurred()) goto error;
+        if(endl > tb->idx->size[tid]) endl = tb->idx->size[tid];
+        if(startl >= endl && startl > 0) {
+            PyErr_SetString(PyExc_RuntimeError, "The start value must be less then the end value (and the end of the chromosome");
+            goto error;
+        }
+
+        (*tids)[i] = tid;
+        (*starts)[i] = (uint32_t) startl;
+        (*ends)[i] = (uint32_t) endl;
+        Py_XDECREF(item);
+        item = NULL;
+    }
+
+    Py_XDECREF(lastChromO);
+    Py_XDECREF(regions);
+    Py_XDECREF(chroms);
+    Py_XDECREF(startsF);
+    Py_XDECREF(endsF);
+    return n;
+
+error:
+    Py_XDECREF(item);
+    Py_XDECREF(lastChromO);
+    Py_XDECREF(regions);
+    Py_XDECREF(chroms);
+    Py_XDECREF(startsF);
+    Py_XDECREF(endsF);
+    if(*tids) free(*tids);
+    if(*starts) free(*starts);
+    if(*ends) free(*ends);
+    *tids = NULL;
+    *starts = NULL;
+    *ends = NULL;
+    return -1;
+}
+
+static PyObject *py2bitSequences(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *ret = NULL, *val = NULL, *offs = NULL;
+    PyObject *chromsO = NULL, *startsO = Py_None, *endsO = Py_None, *concatenateO = Py_False;
+    TwoBit *tb = self->tb;
+    uint32_t *tids = NULL, *starts = NULL, *ends = NULL;
+    uint64_t *offsets = NULL;
+    char *seq = NULL;
+    Py_ssize_t i, n;
+    uint64_t work = 0;
+    static char *kwd_list[] = {"chroms", "starts", "ends", "concatenate", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOO", kwd_list, &chromsO, &startsO, &endsO, &concatenateO)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply at least a list of regions!");
+        return NULL;
+    }
+
+    n = py2bitParseRegions(tb, chromsO, startsO, endsO, &tids, &starts, &ends);
+    if(n < 0) return NULL;
+
+    offsets = malloc((n + 1) * sizeof(uint64_t));
+    if(!offsets) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+    for(i=0; i<n; i++) work += ((ends[i]) ? ends[i] : tb->idx->size[tids[i]]) - starts[i];
+    PY2BIT_BEGIN_ALLOW_THREADS(self, work)
+    seq = twobitSequenceBatch(tb, (uint32_t) n, tids, starts, ends, offsets);
+    PY2BIT_END_ALLOW_THREADS(self)
     if(!seq) {
+        PyErr_SetString(PyExc_RuntimeError, "There was an error while fetching the sequences!");
+        goto cleanup;
+    }
+
+    if(concatenateO == Py_True) {
+        offs = PyList_New(n + 1);
+        if(!offs) goto error;
+        for(i=0; i<=n; i++) {
+            val = PyLong_FromUnsignedLongLong(offsets[i]);
+            if(!val) goto error;
+            PyList_SET_ITEM(offs, i, val);
+        }
+        val = PyUnicode_FromStringAndSize(seq, (Py_ssize_t) offsets[n]);
+        if(!val) goto error;
+        ret = Py_BuildValue("(NN)", val, offs);
+        val = NULL;
+        offs = NULL;
+        if(!ret) goto error;
+    } else {
+        ret = PyList_New(n);
+        if(!ret) goto error;
+        for(i=0; i<n; i++) {
+            val = PyUnicode_FromStringAndSize(seq + offsets[i], (Py_ssize_t) (offsets[i + 1] - offsets[i]));
+            if(!val) goto error;
+            PyList_SET_ITEM(ret, i, val);
+        }
+    }
+
+cleanup:
+    if(seq) free(seq);
+    if(offsets) free(offsets);
+    free(tids);
+    free(starts);
+    free(ends);
+    return ret;
+
+error:
+    Py_XDECREF(ret);
+    Py_XDECREF(offs);
+    ret = NULL;
+    PyErr_SetString(PyExc_RuntimeError, "Received an error while converting the C-level char array to python strings!");
+    goto cleanup;
+}
+
+//Create an iterator over chunks of [start, end) on tid and then the whole of each chromosome/contig up to lastTid
+static PyObject *py2bitIterNew(pyTwoBit_t *self, uint32_t tid, uint32_t lastTid, uint32_t start, uint32_t end, unsigned long chunk, unsigned long overlap, char *format, int genome) {
+    pyTwoBitIter_t *it;
+    PyObject *bytes;
+    int fmt;
+
+    if(chunk == 0 || chunk > 0xFFFFFFFFUL || overlap >= chunk) {
+        PyErr_SetString(PyExc_RuntimeError, "chunk must be positive and overlap must be less than chunk!");
+        return NULL;
+    }
+    if(strcmp(format, "str") == 0) fmt = 0;
+    else if(strcmp(format, "bytes") == 0) fmt = 1;
+    else if(strcmp(format, "view") == 0) fmt = 2;
+    else {
+        PyErr_SetString(PyExc_RuntimeError, "format must be one of 'str', 'bytes' or 'view'!");
+        return NULL;
+    }
+
+    it = PyObject_New(pyTwoBitIter_t, &pyTwoBitIter);
+    if(!it) return NULL;
+    Py_INCREF(self);
+    it->pytb = self;
+    it->tid = tid;
+    it->lastTid = lastTid;
+    it->pos = start;
+    it->end = end;
+    it->chunk = (uint32_t) chunk;
+    it->overlap = (uint32_t) overlap;
+    it->genome = genome;
+    it->format = fmt;
+    it->buf = NULL;
+    if(fmt == 2) {
+        bytes = PyByteArray_FromStringAndSize(NULL, chunk);
+        if(!bytes) goto error;
+        it->buf = PyMemoryView_FromObject(bytes);
+        Py_DECREF(bytes);
+        if(!it->buf) goto error;
+    }
+
+    return (PyObject *) it;
+
+error:
+    Py_DECREF(it);
+    return NULL;
+}
+
+static void py2bitIterDealloc(pyTwoBitIter_t *self) {
+    Py_DECREF(self->pytb);
+    Py_XDECREF(self->buf);
+    PyObject_Del((PyObject *) self);
+}
+
+static PyObject *py2bitIterNext(pyTwoBitIter_t *self) {
+    TwoBit *tb = self->pytb->tb;
+    PyObject *seqO = NULL, *ret;
+    char *seq = NULL;
+    uint32_t start, end;
+    int rv;
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    //Skip to the next chromosome/contig with something left to yield
+    while(self->pos >= self->end) {
+        if(self->tid >= self->lastTid) return NULL;
+        self->tid++;
+        self->pos = 0;
+        self->end = tb->idx->size[self->tid];
+    }
+    start = self->pos;
+    end = (self->end - start > self->chunk) ? start + self->chunk : self->end;
+
+    if(self->format == 0) {
+#if PY_MAJOR_VERSION >= 3
+        seqO = PyUnicode_New(end - start, 127);
+        if(seqO) seq = PyUnicode_DATA(seqO);
+#else
+        seqO = PyString_FromStringAndSize(NULL, end - start);
+        if(seqO) seq = PyString_AS_STRING(seqO);
+#endif
+    } else if(self->format == 1) {
+        seqO = PyBytes_FromStringAndSize(NULL, end - start);
+        if(seqO) seq = PyBytes_AS_STRING(seqO);
+    } else {
+        seq = PyMemoryView_GET_BUFFER(self->buf)->buf;
+    }
+    if(self->format != 2 && !seqO) return NULL;
+
+    PY2BIT_BEGIN_ALLOW_THREADS(self->pytb, end - start)
+    rv = twobitSequenceInto(tb, self->tid, start, end, seq);
+    PY2BIT_END_ALLOW_THREADS(self->pytb)
+    if(rv != 0) {
+        Py_XDECREF(seqO);
         PyErr_SetString(PyExc_RuntimeError, "There was an error while fetching the sequence!");
         return NULL;
     }
+    if(self->format == 2) {
+        if(end - start == self->chunk) {
+            Py_INCREF(self->buf);
+            seqO = self->buf;
+        } else {
+            seqO = PySequence_GetSlice(self->buf, 0, end - start);
+            if(!seqO) return NULL;
+        }
+    }
 
-    ret = PyString_FromString(seq);
-    free(seq);
-    if(!ret) {
-        PyErr_SetString(PyExc_RuntimeError, "Received an error while converting the C-level char array to a python string!");
+    //The chunk after a final one starts at the end, which marks this chromosome/contig as finished
+    self->pos = (end == self->end) ? end : end - self->overlap;
+
+    if(self->genome) ret = Py_BuildValue("(skN)", tb->cl->chrom[self->tid], (unsigned long) start, seqO);
+    else ret = Py_BuildValue("(kN)", (unsigned long) start, seqO);
+    return ret;
+}
+
+static PyObject *py2bitIterSequence(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    TwoBit *tb = self->tb;
+    char *chrom, *format = "str";
+    unsigned long startl = 0, endl = 0, chunk = 1 << 20, overlap = 0;
+    uint32_t len, tid;
+    static char *kwd_list[] = {"chrom", "start", "end", "chunk", "overlap", "format", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|kkkks", kwd_list, &chrom, &startl, &endl, &chunk, &overlap, &format)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply at least a chromosome!");
+        return NULL;
+    }
+
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
+        PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
+        return NULL;
+    }
+    len = tb->idx->size[tid];
+    if(endl > len) endl = len;
+    if(startl >= endl && startl > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "The start value must be less then the end value (and the end of the chromosome");
+        return NULL;
+    }
+    if(endl == 0) endl = len;
+
+    return py2bitIterNew(self, tid, tid, (uint32_t) startl, (uint32_t) endl, chunk, overlap, format, 0);
+}
+
+static PyObject *py2bitIterGenome(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    TwoBit *tb = self->tb;
+    char *format = "str";
+    unsigned long chunk = 1 << 20, overlap = 0;
+    static char *kwd_list[] = {"chunk", "overlap", "format", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|kks", kwd_list, &chunk, &overlap, &format)) return NULL;
+    //An empty file yields nothing, since the first (empty) region is also the last
+    if(tb->hdr->nChroms == 0) return py2bitIterNew(self, 0, 0, 0, 0, chunk, overlap, format, 1);
+
+    return py2bitIterNew(self, 0, tb->hdr->nChroms - 1, 0, tb->idx->size[0], chunk, overlap, format, 1);
+}
+
+//Set ret[key] to either a count or count/denom (0 if denom is 0)
+static int py2bitSetStat(PyObject *ret, const char *key, uint32_t count, uint32_t denom, int fraction) {
+    PyObject *val;
+    int rv;
+
+    if(fraction) val = PyFloat_FromDouble((denom) ? ((double) count) / denom : 0.0);
+    else val = PyLong_FromUnsignedLong(count);
+    if(!val) return -1;
+    rv = PyDict_SetItemString(ret, key, val);
+    Py_DECREF(val);
+    return rv;
+}
+
+//The extended=True form of bases()
+static PyObject *py2bitBaseStats(pyTwoBit_t *self, uint32_t tid, uint32_t start, uint32_t end, int fraction) {
+    PyObject *ret = NULL;
+    TwoBitBaseStats stats;
+    uint32_t len;
+    int rv;
+
+    if(!end) end = self->tb->idx->size[tid];
+    len = end - start;
+
+    PY2BIT_BEGIN_ALLOW_THREADS(self, len)
+    rv = twobitBaseStats(self->tb, tid, start, end, &stats);
+    PY2BIT_END_ALLOW_THREADS(self)
+    if(rv) {
+        PyErr_SetString(PyExc_RuntimeError, "Received an error while determining the per-base metrics.");
         return NULL;
     }
 
+    ret = PyDict_New();
+    if(!ret) goto error;
+    if(py2bitSetStat(ret, "A", stats.A, len, fraction)) goto error;
+    if(py2bitSetStat(ret, "C", stats.C, len, fraction)) goto error;
+    if(py2bitSetStat(ret, "T", stats.T, len, fraction)) goto error;
+    if(py2bitSetStat(ret, "G", stats.G, len, fraction)) goto error;
+    if(py2bitSetStat(ret, "N", stats.N, len, fraction)) goto error;
+    if(self->storeMasked) {
+        if(py2bitSetStat(ret, "soft-masked", stats.softMasked, len, fraction)) goto error;
+        if(py2bitSetStat(ret, "unmasked", stats.unmasked, len, fraction)) goto error;
+        //GC content among the unmasked bases, rather than the whole region
+        if(py2bitSetStat(ret, "unmasked GC", stats.unmaskedGC, stats.unmasked, fraction)) goto error;
+    }
+
     return ret;
+
+error:
+    Py_XDECREF(ret);
+    PyErr_SetString(PyExc_RuntimeError, "Received an error while constructing the output dictionary!");
+    return NULL;
 }
 
 static PyObject *py2bitBases(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
     PyObject *ret = NULL, *val = NULL;
-    PyObject *fractionO = Py_True;
+    PyObject *fractionO = Py_True, *extendedO = Py_False;
     TwoBit *tb = self->tb;
     char *chrom;
     void *o = NULL;
     unsigned long startl = 0, endl = 0;
-    uint32_t start, end, len;
-    static char *kwd_list[] = {"chrom", "start", "end", "fraction", NULL};
+    uint32_t start, end, len, tid;
+    static char *kwd_list[] = {"chrom", "start", "end", "fraction", "extended", NULL};
     int fraction = 1;
 
     if(!tb) {
@@ -237,16 +958,17 @@ static PyObject *py2bitBases(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
         return NULL;
     }
 
-    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|kkO", kwd_list, &chrom, &startl, &endl, &fractionO)) {
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|kkOO", kwd_list, &chrom, &startl, &endl, &fractionO, &extendedO)) {
         PyErr_SetString(PyExc_RuntimeError, "You must supply at least a chromosome!");
         return NULL;
     }
 
-    len = twobitChromLen(tb, chrom);
-    if(len == 0) {
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
         PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
         return NULL;
     }
+    len = tb->idx->size[tid];
     if(endl > len) endl = len;
     end = (uint32_t) endl;
     if(startl >= endl && startl > 0) {
@@ -256,8 +978,11 @@ static PyObject *py2bitBases(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
     start = (uint32_t) startl;
 
     if(fractionO == Py_False) fraction = 0;
+    if(PyObject_IsTrue(extendedO) == 1) return py2bitBaseStats(self, tid, start, end, fraction);
 
-    o = twobitBases(tb, chrom, start, end, fraction);
+    PY2BIT_BEGIN_ALLOW_THREADS(self, ((end) ? end : len) - start)
+    o = twobitBasesTid(tb, tid, start, end, fraction);
+    PY2BIT_END_ALLOW_THREADS(self)
     if(!o) {
         PyErr_SetString(PyExc_RuntimeError, "Received an error while determining the per-base metrics.");
         return NULL;
@@ -306,12 +1031,315 @@ error:
     return NULL;
 }
 
-static PyObject *py2bitHardMaskedBlocks(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
-    PyObject *ret = NULL, *tup = NULL;
-    TwoBit *tb = self->tb;
+/*
+    Return a writable memoryview (backed by a new bytearray) of nBytes with the given struct format and shape. A 1D view
+    is cast without a shape, since memoryview.cast() rejects shapes holding a 0.
+*/
+static PyObject *py2bitShapedView(Py_ssize_t nBytes, const char *format, int ndim, Py_ssize_t *shape) {
+    PyObject *arr = NULL, *view = NULL, *shapeO = NULL, *ret = NULL;
+    int i;
+
+    arr = PyByteArray_FromStringAndSize(NULL, nBytes);
+    if(!arr) goto cleanup;
+    view = PyMemoryView_FromObject(arr);
+    if(!view) goto cleanup;
+    shapeO = PyTuple_New(ndim);
+    if(!shapeO) goto cleanup;
+    for(i=0; i<ndim; i++) PyTuple_SET_ITEM(shapeO, i, PyLong_FromSsize_t(shape[i]));
+    if(ndim == 1) ret = PyObject_CallMethod(view, "cast", "s", format);
+    else ret = PyObject_CallMethod(view, "cast", "sO", format, shapeO);
+
+cleanup:
+    Py_XDECREF(arr);
+    Py_XDECREF(view);
+    Py_XDECREF(shapeO);
+    return ret;
+}
+
+/*
+    The number of bytes per value in an output buffer for encoded(): 1 for (unsigned) bytes and booleans, 4 for float32, otherwise 0
+*/
+static int py2bitValueSize(Py_buffer *view) {
+    const char *fmt = (view->format) ? view->format : "B";
+
+    if(*fmt == '@' || *fmt == '=' || *fmt == '<') fmt++;
+    if(view->itemsize == 1 && (strcmp(fmt, "B") == 0 || strcmp(fmt, "b") == 0 || strcmp(fmt, "?") == 0)) return 1;
+    if(view->itemsize == 4 && strcmp(fmt, "f") == 0) return 4;
+    return 0;
+}
+
+/*
+    Fill out with the encoding of a region, either 1 code per base or (if onehot is set) 4 values per base, each valueSize bytes
+    (1 or 4, for a float). The codes are decoded into the last n bytes of out and then expanded in place. This is safe, since
+    each code is read before anything is written over it.
+
+    Returns 0 on success and -1 on error.
+*/
+static int py2bitEncode(TwoBit *tb, uint32_t tid, uint32_t start, uint32_t end, int onehot, int valueSize, uint8_t *out) {
+    static const uint8_t oneHotBytes[5][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}, {0, 0, 0, 0}};
+    static const float oneHotFloats[5][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}, {0, 0, 0, 0}};
+    uint32_t i, n = end - start;
+    uint8_t *codes;
+
+    if(!onehot) return twobitCodesInto(tb, tid, start, end, out);
+
+    codes = out + (size_t) (4 * valueSize - 1) * n;
+    if(twobitCodesInto(tb, tid, start, end, codes) != 0) return -1;
+    if(valueSize == 1) {
+        for(i=0; i<n; i++) memcpy(out + 4 * (size_t) i, oneHotBytes[codes[i]], 4);
+    } else {
+        for(i=0; i<n; i++) memcpy(out + 16 * (size_t) i, oneHotFloats[codes[i]], 16);
+    }
+    return 0;
+}
+
+/*
+    Handle the mode and out arguments of encoded() and encoded_batch(), for nRegions regions of len bases each. On success,
+    *buf points to where the output should be written and *ret is either a new memoryview (if out is None) or None.
+    Otherwise, -1 is returned and an exception is set. *view must be released with PyBuffer_Release() if out isn't None.
+*/
+static int py2bitEncodeOutput(char *mode, PyObject *outO, Py_ssize_t nRegions, uint32_t len, int batch, int *onehot, int *valueSize, Py_buffer *view, uint8_t **buf, PyObject **ret) {
+    Py_ssize_t shape[3], nValues;
+    int ndim = 0;
+
+    if(strcmp(mode, "int8") == 0) {
+        *onehot = 0;
+    } else if(strcmp(mode, "onehot") == 0) {
+        *onehot = 1;
+    } else {
+        PyErr_SetString(PyExc_RuntimeError, "mode must be either 'int8' or 'onehot'!");
+        return -1;
+    }
+    if(batch) shape[ndim++] = nRegions;
+    shape[ndim++] = len;
+    if(*onehot) shape[ndim++] = 4;
+    nValues = nRegions * (Py_ssize_t) len * ((*onehot) ? 4 : 1);
+
+    *ret = NULL;
+    if(outO == Py_None) {
+        *valueSize = 1;
+        *ret = py2bitShapedView(nValues, (*onehot) ? "B" : "b", ndim, shape);
+        if(!*ret) return -1;
+        *buf = PyMemoryView_GET_BUFFER(*ret)->buf;
+        return 0;
+    }
+
+    if(PyObject_GetBuffer(outO, view, PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) != 0) return -1;
+    *valueSize = py2bitValueSize(view);
+    if(*valueSize == 0 || (*valueSize == 4 && !*onehot)) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_RuntimeError, "out must hold bytes (or, for one-hot encoding, float32 values)!");
+        return -1;
+    }
+    if(view->len < nValues * *valueSize) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_RuntimeError, "out is too small to hold the encoded sequence!");
+        return -1;
+    }
+    *buf = view->buf;
+    return 0;
+}
+
+static PyObject *py2bitEncoded(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *ret = NULL, *outO = Py_None;
+    TwoBit *tb = self->tb;
+    char *chrom, *mode = "int8";
+    unsigned long startl = 0, endl = 0;
+    uint32_t start, end, len, tid;
+    Py_buffer view;
+    uint8_t *buf = NULL;
+    int rv = 0, onehot, valueSize;
+    static char *kwd_list[] = {"chrom", "start", "end", "mode", "out", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|kksO", kwd_list, &chrom, &startl, &endl, &mode, &outO)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply at least a chromosome!");
+        return NULL;
+    }
+
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
+        PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
+        return NULL;
+    }
+    len = tb->idx->size[tid];
+    if(endl > len) endl = len;
+    end = (uint32_t) endl;
+    if(startl >= endl && startl > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "The start value must be less then the end value (and the end of the chromosome");
+        return NULL;
+    }
+    start = (uint32_t) startl;
+    if(end == 0) end = len;
+
+    if(py2bitEncodeOutput(mode, outO, 1, end - start, 0, &onehot, &valueSize, &view, &buf, &ret) != 0) return NULL;
+    if(end > start) {
+        PY2BIT_BEGIN_ALLOW_THREADS(self, end - start)
+        rv = py2bitEncode(tb, tid, start, end, onehot, valueSize, buf);
+        PY2BIT_END_ALLOW_THREADS(self)
+    }
+    if(outO != Py_None) {
+        PyBuffer_Release(&view);
+        ret = PyLong_FromUnsignedLong(end - start);
+    }
+    if(rv != 0) {
+        Py_XDECREF(ret);
+        PyErr_SetString(PyExc_RuntimeError, "There was an error while fetching the sequence!");
+        return NULL;
+    }
+
+    return ret;
+}
+
+static PyObject *py2bitEncodedBatch(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *ret = NULL, *chromsO = NULL, *startsO = Py_None, *endsO = Py_None, *outO = Py_None;
+    TwoBit *tb = self->tb;
+    char *mode = "int8";
+    uint32_t *tids = NULL, *starts = NULL, *ends = NULL, len = 0;
+    Py_ssize_t i, n;
+    Py_buffer view;
+    uint8_t *buf = NULL;
+    size_t stride;
+    int rv = 0, onehot, valueSize;
+    static char *kwd_list[] = {"chroms", "starts", "ends", "mode", "out", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOsO", kwd_list, &chromsO, &startsO, &endsO, &mode, &outO)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply at least a list of regions!");
+        return NULL;
+    }
+
+    n = py2bitParseRegions(tb, chromsO, startsO, endsO, &tids, &starts, &ends);
+    if(n < 0) return NULL;
+
+    //Every region must have the same length
+    for(i=0; i<n; i++) {
+        if(ends[i] == 0) ends[i] = tb->idx->size[tids[i]];
+        if(i == 0) len = ends[i] - starts[i];
+        if(ends[i] - starts[i] != len) {
+            PyErr_SetString(PyExc_RuntimeError, "All of the regions must have the same length (note that regions are truncated at the end of a chromosome)!");
+            goto cleanup;
+        }
+    }
+
+    if(py2bitEncodeOutput(mode, outO, n, len, 1, &onehot, &valueSize, &view, &buf, &ret) != 0) goto cleanup;
+    stride = (size_t) len * ((onehot) ? 4 * valueSize : 1);
+    if(len > 0) {
+        PY2BIT_BEGIN_ALLOW_THREADS(self, (uint64_t) n * len)
+        for(i=0; i<n && rv == 0; i++) rv = py2bitEncode(tb, tids[i], starts[i], ends[i], onehot, valueSize, buf + i * stride);
+        PY2BIT_END_ALLOW_THREADS(self)
+    }
+    if(outO != Py_None) {
+        PyBuffer_Release(&view);
+        ret = PyLong_FromSsize_t(n);
+    }
+    if(rv != 0) {
+        Py_XDECREF(ret);
+        ret = NULL;
+        PyErr_SetString(PyExc_RuntimeError, "There was an error while fetching the sequences!");
+    }
+
+cleanup:
+    free(tids);
+    free(starts);
+    free(ends);
+    return ret;
+}
+
+static PyObject *py2bitWindowBases(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *ret = NULL, *fractionO = Py_True;
+    TwoBit *tb = self->tb;
+    char *chrom;
+    unsigned long startl = 0, endl = 0, widthl = 0, stepl = 0;
+    uint32_t start, end, len, tid, n;
+    Py_ssize_t shape[2], i;
+    uint32_t *counts;
+    double *fractions, *lut = NULL;
+    int rv, fraction = 1;
+    static char *kwd_list[] = {"chrom", "start", "end", "width", "step", "fraction", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "skkk|kO", kwd_list, &chrom, &startl, &endl, &widthl, &stepl, &fractionO)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply a chromosome, start, end and window width!");
+        return NULL;
+    }
+    if(stepl == 0) stepl = widthl;
+    if(widthl == 0 || widthl > 0xFFFFFFFFUL || stepl > 0xFFFFFFFFUL) {
+        PyErr_SetString(PyExc_RuntimeError, "The window width must be positive and, like the step, less than 2^32!");
+        return NULL;
+    }
+
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
+        PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
+        return NULL;
+    }
+    len = tb->idx->size[tid];
+    if(endl > len) endl = len;
+    end = (uint32_t) endl;
+    if(startl >= endl && startl > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "The start value must be less then the end value (and the end of the chromosome");
+        return NULL;
+    }
+    start = (uint32_t) startl;
+    if(end == 0) end = len;
+    if(fractionO == Py_False) fraction = 0;
+
+    //With fraction=True, the counts are computed in the first half of the output and then converted in place
+    n = twobitWindowNumber(start, end, (uint32_t) widthl, (uint32_t) stepl);
+    if(n == 0) {
+        PyErr_SetString(PyExc_RuntimeError, "The region is shorter than the window width!");
+        return NULL;
+    }
+    shape[0] = n;
+    shape[1] = 5;
+    ret = py2bitShapedView(5 * (Py_ssize_t) n * (fraction ? sizeof(double) : sizeof(uint32_t)), fraction ? "d" : "I", 2, shape);
+    if(!ret) return NULL;
+    counts = PyMemoryView_GET_BUFFER(ret)->buf;
+
+    PY2BIT_BEGIN_ALLOW_THREADS(self, end - start)
+    rv = twobitWindowCounts(tb, tid, start, end, (uint32_t) widthl, (uint32_t) stepl, counts);
+    if(rv == 0 && fraction) {
+        //Every count is in [0, width], so if there are more counts than that it's quicker to look up each fraction
+        if(widthl < 5 * (unsigned long) n) lut = malloc((widthl + 1) * sizeof(double));
+        if(lut) {
+            for(i=0; i<=(Py_ssize_t) widthl; i++) lut[i] = ((double) i) / ((double) widthl);
+        }
+        //Going backwards, each double only overwrites counts that have already been converted
+        fractions = (double*) counts;
+        for(i=5 * (Py_ssize_t) n - 1; i>=0; i--) fractions[i] = lut ? lut[counts[i]] : ((double) counts[i]) / ((double) widthl);
+        if(lut) free(lut);
+    }
+    PY2BIT_END_ALLOW_THREADS(self)
+    if(rv != 0) {
+        Py_DECREF(ret);
+        PyErr_SetString(PyExc_RuntimeError, "Received an error while determining the per-base metrics.");
+        return NULL;
+    }
+
+    return ret;
+}
+
+static PyObject *py2bitDinucleotides(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    static const char *pairs[16] = {"AA", "AC", "AG", "AT", "CA", "CC", "CG", "CT", "GA", "GC", "GG", "GT", "TA", "TC", "TG", "TT"};
+    PyObject *ret = NULL, *val = NULL;
+    TwoBit *tb = self->tb;
     char *chrom;
-    unsigned long startl = 0, endl = 0, totalBlocks = 0, tid;
-    uint32_t start, end, len, blockStart, blockEnd, i, j;
+    unsigned long startl = 0, endl = 0;
+    uint32_t start, end, len, tid, counts[16];
+    int i, rv;
     static char *kwd_list[] = {"chrom", "start", "end", NULL};
 
     if(!tb) {
@@ -324,19 +1352,475 @@ static PyObject *py2bitHardMaskedBlocks(pyTwoBit_t *self, PyObject *args, PyObje
         return NULL;
     }
 
-    //Get the chromosome ID
-    for(i=0; i<tb->hdr->nChroms; i++) {
-        if(strcmp(tb->cl->chrom[i], chrom) == 0) {
-            tid = i;
-            break;
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
+        PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
+        return NULL;
+    }
+    len = tb->idx->size[tid];
+    if(endl > len) endl = len;
+    end = (uint32_t) endl;
+    if(startl >= endl && startl > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "The start value must be less then the end value (and the end of the chromosome");
+        return NULL;
+    }
+    start = (uint32_t) startl;
+
+    PY2BIT_BEGIN_ALLOW_THREADS(self, ((end) ? end : len) - start)
+    rv = twobitDinucleotides(tb, tid, start, end, counts);
+    PY2BIT_END_ALLOW_THREADS(self)
+    if(rv != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Received an error while counting dinucleotides.");
+        return NULL;
+    }
+
+    ret = PyDict_New();
+    if(!ret) goto error;
+    for(i=0; i<16; i++) {
+        val = PyLong_FromUnsignedLong(counts[i]);
+        if(!val) goto error;
+        if(PyDict_SetItemString(ret, pairs[i], val) == -1) goto error;
+        Py_DECREF(val);
+        val = NULL;
+    }
+
+    return ret;
+
+error:
+    Py_XDECREF(ret);
+    Py_XDECREF(val);
+    PyErr_SetString(PyExc_RuntimeError, "Received an error while constructing the output dictionary!");
+    return NULL;
+}
+
+static PyObject *py2bitWindowDinucleotides(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *ret = NULL;
+    TwoBit *tb = self->tb;
+    char *chrom;
+    unsigned long startl = 0, endl = 0, widthl = 0, stepl = 0;
+    uint32_t start, end, len, tid, n;
+    Py_ssize_t shape[2];
+    int rv;
+    static char *kwd_list[] = {"chrom", "start", "end", "width", "step", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "skkk|k", kwd_list, &chrom, &startl, &endl, &widthl, &stepl)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply a chromosome, start, end and window width!");
+        return NULL;
+    }
+    if(stepl == 0) stepl = widthl;
+    if(widthl == 0 || widthl > 0xFFFFFFFFUL || stepl > 0xFFFFFFFFUL) {
+        PyErr_SetString(PyExc_RuntimeError, "The window width must be positive and, like the step, less than 2^32!");
+        return NULL;
+    }
+
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
+        PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
+        return NULL;
+    }
+    len = tb->idx->size[tid];
+    if(endl > len) endl = len;
+    end = (uint32_t) endl;
+    if(startl >= endl && startl > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "The start value must be less then the end value (and the end of the chromosome");
+        return NULL;
+    }
+    start = (uint32_t) startl;
+    if(end == 0) end = len;
+
+    n = twobitWindowNumber(start, end, (uint32_t) widthl, (uint32_t) stepl);
+    if(n == 0) {
+        PyErr_SetString(PyExc_RuntimeError, "The region is shorter than the window width!");
+        return NULL;
+    }
+    shape[0] = n;
+    shape[1] = 16;
+    ret = py2bitShapedView(16 * (Py_ssize_t) n * sizeof(uint32_t), "I", 2, shape);
+    if(!ret) return NULL;
+
+    PY2BIT_BEGIN_ALLOW_THREADS(self, end - start)
+    rv = twobitWindowDinucleotides(tb, tid, start, end, (uint32_t) widthl, (uint32_t) stepl, PyMemoryView_GET_BUFFER(ret)->buf);
+    PY2BIT_END_ALLOW_THREADS(self)
+    if(rv != 0) {
+        Py_DECREF(ret);
+        PyErr_SetString(PyExc_RuntimeError, "Received an error while counting dinucleotides.");
+        return NULL;
+    }
+
+    return ret;
+}
+
+/*
+    Handle the out argument of kmer_counts() and kmer_counts_genome(). On success, *counts points to the 4^k table to add to
+    and *ret is either a new, zeroed, memoryview (if out is None) or None. Otherwise, -1 is returned and an exception is set.
+    *view must be released with PyBuffer_Release() if out isn't None.
+*/
+static int py2bitKmerOutput(PyObject *outO, int k, Py_buffer *view, uint64_t **counts, PyObject **ret) {
+    Py_ssize_t n = (Py_ssize_t) 1 << (2 * k);
+    long pages = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGESIZE);
+    const char *fmt;
+
+    *ret = NULL;
+    if(outO == Py_None) {
+        //The table is zeroed right away, so one larger than memory would likely get the process killed rather than fail
+        if(pages > 0 && pageSize > 0 && (uint64_t) n * sizeof(uint64_t) > (uint64_t) pages * (uint64_t) pageSize) {
+            PyErr_Format(PyExc_MemoryError, "The table of 4^%d k-mer counts needs %" PRIu64 " bytes, which is more than this machine's memory!", k, (uint64_t) n * sizeof(uint64_t));
+            return -1;
         }
+        *ret = py2bitShapedView(n * sizeof(uint64_t), "Q", 1, &n);
+        if(!*ret) return -1;
+        *counts = PyMemoryView_GET_BUFFER(*ret)->buf;
+        memset(*counts, 0, n * sizeof(uint64_t));
+        return 0;
+    }
+
+    if(PyObject_GetBuffer(outO, view, PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) != 0) return -1;
+    fmt = (view->format) ? view->format : "B";
+    if(*fmt == '@' || *fmt == '=' || *fmt == '<') fmt++;
+    if(view->itemsize != 8 || !(strcmp(fmt, "Q") == 0 || strcmp(fmt, "q") == 0 || strcmp(fmt, "L") == 0 || strcmp(fmt, "l") == 0)) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_RuntimeError, "out must hold 64-bit integers (e.g., a numpy uint64 array)!");
+        return -1;
+    }
+    if(view->len < n * (Py_ssize_t) sizeof(uint64_t)) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_RuntimeError, "out must hold at least 4^k values!");
+        return -1;
+    }
+    *counts = view->buf;
+    Py_INCREF(Py_None);
+    *ret = Py_None;
+    return 0;
+}
+
+static PyObject *py2bitKmerCounts(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *ret = NULL, *canonicalO = Py_False, *outO = Py_None;
+    TwoBit *tb = self->tb;
+    char *chrom;
+    unsigned long startl = 0, endl = 0;
+    uint32_t start, end, len, tid;
+    uint64_t *counts;
+    Py_buffer view;
+    int k = 0, rv = 0;
+    static char *kwd_list[] = {"chrom", "start", "end", "k", "canonical", "out", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "skki|OO", kwd_list, &chrom, &startl, &endl, &k, &canonicalO, &outO)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply a chromosome, start, end and k!");
+        return NULL;
+    }
+    if(k < 1 || k > TWOBIT_MAX_K) {
+        PyErr_SetString(PyExc_RuntimeError, "k must be between 1 and 16!");
+        return NULL;
     }
 
-    len = twobitChromLen(tb, chrom);
-    if(len == 0) {
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
         PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
         return NULL;
     }
+    len = tb->idx->size[tid];
+    if(endl > len) endl = len;
+    end = (uint32_t) endl;
+    if(startl >= endl && startl > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "The start value must be less then the end value (and the end of the chromosome");
+        return NULL;
+    }
+    start = (uint32_t) startl;
+    if(end == 0) end = len;
+
+    if(py2bitKmerOutput(outO, k, &view, &counts, &ret) != 0) return NULL;
+    if(end > start) {
+        PY2BIT_BEGIN_ALLOW_THREADS(self, end - start)
+        rv = twobitKmerCounts(tb, tid, start, end, k, PyObject_IsTrue(canonicalO) == 1, counts);
+        PY2BIT_END_ALLOW_THREADS(self)
+    }
+    if(outO != Py_None) PyBuffer_Release(&view);
+    if(rv != 0) {
+        Py_DECREF(ret);
+        PyErr_SetString(PyExc_RuntimeError, "Received an error while counting k-mers!");
+        return NULL;
+    }
+
+    return ret;
+}
+
+static PyObject *py2bitKmerCountsGenome(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *ret = NULL, *canonicalO = Py_False, *outO = Py_None;
+    TwoBit *tb = self->tb;
+    uint64_t *counts;
+    Py_buffer view;
+    int k = 0, threads = 0, canonical, rv;
+    static char *kwd_list[] = {"k", "canonical", "threads", "out", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "i|OiO", kwd_list, &k, &canonicalO, &threads, &outO)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply k!");
+        return NULL;
+    }
+    if(k < 1 || k > TWOBIT_MAX_K) {
+        PyErr_SetString(PyExc_RuntimeError, "k must be between 1 and 16!");
+        return NULL;
+    }
+    canonical = (PyObject_IsTrue(canonicalO) == 1);
+
+    if(py2bitKmerOutput(outO, k, &view, &counts, &ret) != 0) return NULL;
+    PY2BIT_BEGIN_ALLOW_THREADS(self, PY2BIT_NOGIL_MIN)
+    rv = twobitKmerCountsGenome(tb, k, canonical, threads, counts);
+    PY2BIT_END_ALLOW_THREADS(self)
+    if(outO != Py_None) PyBuffer_Release(&view);
+    if(rv != 0) {
+        Py_DECREF(ret);
+        PyErr_SetString(PyExc_RuntimeError, "Received an error while counting k-mers!");
+        return NULL;
+    }
+
+    return ret;
+}
+
+static PyObject *py2bitFindMotif(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *ret = NULL, *chromsO = Py_None, *bothStrandsO = Py_True, *chroms = NULL, *val = NULL;
+    TwoBit *tb = self->tb;
+    char *pattern, *chrom;
+    uint32_t tid, *hits = NULL;
+    uint64_t nHits = 0;
+    Py_ssize_t i, n, nVals;
+    int rv, bothStrands;
+    static char *kwd_list[] = {"pattern", "chroms", "both_strands", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|OO", kwd_list, &pattern, &chromsO, &bothStrandsO)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply a pattern!");
+        return NULL;
+    }
+    n = strlen(pattern);
+    if(n == 0 || n > TWOBIT_MAX_MOTIF || strspn(pattern, "ACGTURYSWKMBDHVNacgturyswkmbdhvn") != (size_t) n) {
+        PyErr_SetString(PyExc_RuntimeError, "The pattern must consist of 1 to 32 IUPAC symbols!");
+        return NULL;
+    }
+    bothStrands = (PyObject_IsTrue(bothStrandsO) == 1);
+
+    //None means every chromosome and a single name is allowed
+    if(chromsO != Py_None && (PyUnicode_Check(chromsO) || PyBytes_Check(chromsO))) {
+        chroms = PyTuple_Pack(1, chromsO);
+    } else if(chromsO != Py_None) {
+        chroms = PySequence_Fast(chromsO, "chroms must be None, a chromosome name or a list of them!");
+    }
+    if(chromsO != Py_None && !chroms) return NULL;
+    n = (chroms) ? PySequence_Fast_GET_SIZE(chroms) : (Py_ssize_t) tb->hdr->nChroms;
+
+    ret = PyDict_New();
+    if(!ret) goto error;
+    for(i=0; i<n; i++) {
+        if(chroms) {
+            chrom = py2bitAsString(PySequence_Fast_GET_ITEM(chroms, i));
+            if(!chrom) goto error;
+            tid = twobitChromTid(tb, chrom);
+            if(tid == (uint32_t) -1) {
+                PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
+                goto error;
+            }
+        } else {
+            tid = (uint32_t) i;
+            chrom = tb->cl->chrom[tid];
+        }
+
+        rv = 0;
+        if(tb->idx->size[tid] > 0) {
+            PY2BIT_BEGIN_ALLOW_THREADS(self, tb->idx->size[tid])
+            rv = twobitFindMotif(tb, tid, 0, tb->idx->size[tid], pattern, bothStrands, &hits, &nHits);
+            PY2BIT_END_ALLOW_THREADS(self)
+        }
+        if(rv != 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Received an error while scanning for the motif!");
+            goto error;
+        }
+
+        nVals = (Py_ssize_t) nHits;
+        val = py2bitShapedView(nVals * sizeof(uint32_t), "I", 1, &nVals);
+        if(!val) goto error;
+        if(nHits) memcpy(PyMemoryView_GET_BUFFER(val)->buf, hits, nHits * sizeof(uint32_t));
+        free(hits);
+        hits = NULL;
+        nHits = 0;
+        if(PyDict_SetItemString(ret, chrom, val) == -1) goto error;
+        Py_DECREF(val);
+        val = NULL;
+    }
+
+    Py_XDECREF(chroms);
+    return ret;
+
+error:
+    if(hits) free(hits);
+    Py_XDECREF(val);
+    Py_XDECREF(ret);
+    Py_XDECREF(chroms);
+    return NULL;
+}
+
+static PyObject *py2bitSubset(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *chromsO = Py_None, *regionsO = Py_None, *chroms = NULL, *regions = NULL, *names = NULL, *item, *nameO;
+    TwoBit *tb = self->tb;
+    char *fname, *chrom, **cnames = NULL;
+    uint32_t *tids = NULL, *starts = NULL, *ends = NULL, *rtids = NULL, *rstarts = NULL, *rends = NULL;
+    Py_ssize_t i, nChroms, nRegions = 0;
+    int rv;
+    static char *kwd_list[] = {"fname", "chroms", "regions", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|OO", kwd_list, &fname, &chromsO, &regionsO)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply a file name!");
+        return NULL;
+    }
+
+    //With neither chroms nor regions, every chromosome is written. A single name is allowed.
+    if(chromsO != Py_None && (PyUnicode_Check(chromsO) || PyBytes_Check(chromsO))) {
+        chroms = PyTuple_Pack(1, chromsO);
+    } else if(chromsO != Py_None) {
+        chroms = PySequence_Fast(chromsO, "chroms must be None, a chromosome name or a list of them!");
+    }
+    if(chromsO != Py_None && !chroms) return NULL;
+    nChroms = (chroms) ? PySequence_Fast_GET_SIZE(chroms) : ((regionsO == Py_None) ? (Py_ssize_t) tb->hdr->nChroms : 0);
+
+    //Regions are written after any whole chromosomes, named either by their 4th item or chrom:start-end
+    if(regionsO != Py_None) {
+        nRegions = py2bitParseRegions(tb, regionsO, Py_None, Py_None, &rtids, &rstarts, &rends);
+        if(nRegions < 0) goto error;
+        regions = PySequence_Fast(regionsO, "The regions must be an iterable of (chrom, start, end) items!");
+        if(!regions) goto error;
+        names = PyList_New(nRegions);
+        if(!names) goto error;
+        for(i=0; i<nRegions; i++) {
+            item = PySequence_Fast(PySequence_Fast_GET_ITEM(regions, i), "Each region must be a (chrom, start, end) sequence!");
+            if(!item) goto error;
+            if(PySequence_Fast_GET_SIZE(item) > 3) {
+                nameO = PySequence_Fast_GET_ITEM(item, 3);
+                if(PyUnicode_Check(nameO)) {
+                    nameO = PyUnicode_AsUTF8String(nameO);
+                } else if(PyBytes_Check(nameO)) {
+                    Py_INCREF(nameO);
+                } else {
+                    PyErr_SetString(PyExc_RuntimeError, "Region names must be str or bytes!");
+                    nameO = NULL;
+                }
+            } else {
+                if(rstarts[i] == 0 && rends[i] == 0) rends[i] = tb->idx->size[rtids[i]];
+                nameO = PyBytes_FromFormat("%s:%lu-%lu", tb->cl->chrom[rtids[i]], (unsigned long) rstarts[i], (unsigned long) rends[i]);
+            }
+            Py_DECREF(item);
+            if(!nameO) goto error;
+            PyList_SET_ITEM(names, i, nameO);
+        }
+    }
+
+    tids = malloc((nChroms + nRegions + 1) * sizeof(uint32_t));
+    starts = calloc(nChroms + nRegions + 1, sizeof(uint32_t));
+    ends = calloc(nChroms + nRegions + 1, sizeof(uint32_t));
+    cnames = calloc(nChroms + nRegions + 1, sizeof(char*));
+    if(!tids || !starts || !ends || !cnames) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for(i=0; i<nChroms; i++) {
+        if(chroms) {
+            chrom = py2bitAsString(PySequence_Fast_GET_ITEM(chroms, i));
+            if(!chrom) goto error;
+            tids[i] = twobitChromTid(tb, chrom);
+            if(tids[i] == (uint32_t) -1) {
+                PyErr_Format(PyExc_RuntimeError, "The chromosome '%s' doesn't exist in the 2bit file!", chrom);
+                goto error;
+            }
+        } else {
+            tids[i] = (uint32_t) i;
+        }
+    }
+    for(i=0; i<nRegions; i++) {
+        tids[nChroms + i] = rtids[i];
+        starts[nChroms + i] = rstarts[i];
+        ends[nChroms + i] = rends[i];
+        cnames[nChroms + i] = PyBytes_AS_STRING(PyList_GET_ITEM(names, i));
+    }
+
+    PY2BIT_BEGIN_ALLOW_THREADS(self, PY2BIT_NOGIL_MIN)
+    rv = twobitSubset(tb, fname, (uint32_t) (nChroms + nRegions), tids, starts, ends, cnames);
+    PY2BIT_END_ALLOW_THREADS(self)
+    if(rv != 0) {
+        PyErr_Format(PyExc_RuntimeError, "Received an error while writing %s!", fname);
+        goto error;
+    }
+
+    free(tids);
+    free(starts);
+    free(ends);
+    free(cnames);
+    free(rtids);
+    free(rstarts);
+    free(rends);
+    Py_XDECREF(chroms);
+    Py_XDECREF(regions);
+    Py_XDECREF(names);
+    Py_RETURN_NONE;
+
+error:
+    if(tids) free(tids);
+    if(starts) free(starts);
+    if(ends) free(ends);
+    if(cnames) free(cnames);
+    if(rtids) free(rtids);
+    if(rstarts) free(rstarts);
+    if(rends) free(rends);
+    Py_XDECREF(chroms);
+    Py_XDECREF(regions);
+    Py_XDECREF(names);
+    return NULL;
+}
+
+static PyObject *py2bitHardMaskedBlocks(pyTwoBit_t *self, PyObject *args, PyObject *kwds) {
+    PyObject *ret = NULL, *tup = NULL;
+    TwoBit *tb = self->tb;
+    char *chrom;
+    unsigned long startl = 0, endl = 0, totalBlocks = 0;
+    uint32_t start, end, len, tid, blockStart, blockEnd, first, i, j;
+    static char *kwd_list[] = {"chrom", "start", "end", NULL};
+
+    if(!tb) {
+        PyErr_SetString(PyExc_RuntimeError, "The 2bit file handle is not open!");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|kk", kwd_list, &chrom, &startl, &endl)) {
+        PyErr_SetString(PyExc_RuntimeError, "You must supply at least a chromosome!");
+        return NULL;
+    }
+
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
+        PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
+        return NULL;
+    }
+    len = tb->idx->size[tid];
     if(endl == 0) endl = len;
     if(endl > len) endl = len;
     end = (uint32_t) endl;
@@ -346,25 +1830,29 @@ static PyObject *py2bitHardMaskedBlocks(pyTwoBit_t *self, PyObject *args, PyObje
     }
     start = (uint32_t) startl;
 
+    if(twobitLoadIndex(tb, tid) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Received an error while reading the index!");
+        return NULL;
+    }
+
     // Count the total number of overlapping N-masked blocks
-    for(i=0; i<tb->idx->nBlockCount[tid]; i++) {
+    first = twobitFirstBlock(tb->idx->nBlockStart[tid], tb->idx->nBlockSizes[tid], tb->idx->nBlockCount[tid], start);
+    for(i=first; i<tb->idx->nBlockCount[tid]; i++) {
         blockStart = tb->idx->nBlockStart[tid][i];
-        blockEnd = blockStart + tb->idx->nBlockSizes[tid][i];
-        if(blockStart < end && blockEnd > start) totalBlocks++;
+        if(blockStart >= end) break;
+        totalBlocks++;
     }
 
     // Form the output
     ret = PyList_New(totalBlocks);
     if(!ret) goto error;
     if(totalBlocks == 0) return ret;
-    for(i=0, j=0; i<tb->idx->nBlockCount[tid]; i++) {
+    for(i=first, j=0; j<totalBlocks; i++) {
         blockStart = tb->idx->nBlockStart[tid][i];
         blockEnd = blockStart + tb->idx->nBlockSizes[tid][i];
-        if(blockStart < end && blockEnd > start) {
-            tup = Py_BuildValue("(kk)", (unsigned long) blockStart, (unsigned long) blockEnd);
-            if(!tup) goto error;
-            if(PyList_SetItem(ret, j++, tup)) goto error;
-        }
+        tup = Py_BuildValue("(kk)", (unsigned long) blockStart, (unsigned long) blockEnd);
+        if(!tup) goto error;
+        if(PyList_SetItem(ret, j++, tup)) goto error;
     }
 
     return ret;
@@ -380,8 +1868,9 @@ static PyObject *py2bitSoftMaskedBlocks(pyTwoBit_t *self, PyObject *args, PyObje
     PyObject *ret = NULL, *tup = NULL;
     TwoBit *tb = self->tb;
     char *chrom;
-    unsigned long startl = 0, endl = 0, totalBlocks = 0, tid;
-    uint32_t start, end, len, blockStart, blockEnd, i, j;
+    unsigned long startl = 0, endl = 0, totalBlocks = 0;
+    uint32_t start, end, len, tid, j;
+    TwoBitMaskIter it;
     static char *kwd_list[] = {"chrom", "start", "end", NULL};
 
     if(!tb) {
@@ -394,19 +1883,12 @@ static PyObject *py2bitSoftMaskedBlocks(pyTwoBit_t *self, PyObject *args, PyObje
         return NULL;
     }
 
-    //Get the chromosome ID
-    for(i=0; i<tb->hdr->nChroms; i++) {
-        if(strcmp(tb->cl->chrom[i], chrom) == 0) {
-            tid = i;
-            break;
-        }
-    }
-
-    len = twobitChromLen(tb, chrom);
-    if(len == 0) {
+    tid = twobitChromTid(tb, chrom);
+    if(tid == (uint32_t) -1) {
         PyErr_SetString(PyExc_RuntimeError, "The specified chromosome doesn't exist in the 2bit file!");
         return NULL;
     }
+    len = tb->idx->size[tid];
     if(endl == 0) endl = len;
     if(endl > len) endl = len;
     end = (uint32_t) endl;
@@ -416,30 +1898,28 @@ static PyObject *py2bitSoftMaskedBlocks(pyTwoBit_t *self, PyObject *args, PyObje
     }
     start = (uint32_t) startl;
 
-    if(!tb->idx->maskBlockStart) {
+    if(!tb->idx->maskBlocks) {
         PyErr_SetString(PyExc_RuntimeError, "The file was not opened with storeMasked=True! Consequently, there are no stored soft-masked regions.");
         return NULL;
     }
     
     // Count the total number of overlapping soft-masked blocks
-    for(i=0; i<tb->idx->maskBlockCount[tid]; i++) {
-        blockStart = tb->idx->maskBlockStart[tid][i];
-        blockEnd = blockStart + tb->idx->maskBlockSizes[tid][i];
-        if(blockStart < end && blockEnd > start) totalBlocks++;
+    twobitMaskIterInit(tb, tid, start, &it);
+    while(twobitMaskIterNext(&it)) {
+        if(it.start >= end) break;
+        totalBlocks++;
     }
 
     // Form the output
     ret = PyList_New(totalBlocks);
     if(!ret) goto error;
     if(totalBlocks == 0) return ret;
-    for(i=0, j=0; i<tb->idx->maskBlockCount[tid]; i++) {
-        blockStart = tb->idx->maskBlockStart[tid][i];
-        blockEnd = blockStart + tb->idx->maskBlockSizes[tid][i];
-        if(blockStart < end && blockEnd > start) {
-            tup = Py_BuildValue("(kk)", (unsigned long) blockStart, (unsigned long) blockEnd);
-            if(!tup) goto error;
-            if(PyList_SetItem(ret, j++, tup)) goto error;
-        }
+    twobitMaskIterInit(tb, tid, start, &it);
+    for(j=0; j<totalBlocks; j++) {
+        twobitMaskIterNext(&it);
+        tup = Py_BuildValue("(kk)", (unsigned long) it.start, (unsigned long) it.end);
+        if(!tup) goto error;
+        if(PyList_SetItem(ret, j, tup)) goto error;
     }
 
     return ret;
@@ -455,6 +1935,7 @@ PyMODINIT_FUNC PyInit_py2bit(void) {
     PyObject *res;
 
     if(PyType_Ready(&pyTwoBit) < 0) return NULL;
+    if(PyType_Ready(&pyTwoBitIter) < 0) return NULL;
     res = PyModule_Create(&py2bitmodule);
     if(!res) return NULL;
 
@@ -469,6 +1950,7 @@ PyMODINIT_FUNC PyInit_py2bit(void) {
 PyMODINIT_FUNC initpy2bit(void) {
     PyObject *res;
     if(PyType_Ready(&pyTwoBit) < 0) return;
+    if(PyType_Ready(&pyTwoBitIter) < 0) return;
     res = Py_InitModule3("py2bit", tbMethods, "A module for handling 2bit files");
     Py_INCREF(&pyTwoBit);
     PyModule_AddObject(res, "py2bit", (PyObject *) &pyTwoBit);
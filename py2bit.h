@@ -7,18 +7,52 @@ typedef struct {
     PyObject_HEAD
     TwoBit *tb;
     int storeMasked; //Whether storeMasked was set. 0 = False, 1 = True
+    unsigned int nActive; //The number of calls currently running without the GIL, the file can't be closed until this is 0
+    Py_buffer buf; //For files opened with open_buffer(), a view of the object holding the file (buf.obj is NULL otherwise)
+    char *fname; //The absolute path of the file, used when pickling, or NULL for open_buffer()
 } pyTwoBit_t;
 
+typedef struct {
+    PyObject_HEAD
+    pyTwoBit_t *pytb; //The file being iterated over, a reference is held
+    uint32_t tid; //The current chromosome/contig
+    uint32_t lastTid; //The last chromosome/contig to iterate over
+    uint32_t pos; //The start of the next chunk
+    uint32_t end; //The end of the region on the current chromosome/contig
+    uint32_t chunk; //The chunk size
+    uint32_t overlap; //The overlap between successive chunks
+    int genome; //If set, yield (chrom, start, chunk) tuples, otherwise (start, chunk)
+    int format; //0: str, 1: bytes, 2: a memoryview of buf
+    PyObject *buf; //For format 2, a memoryview of a chunk-sized bytearray that's reused for every chunk
+} pyTwoBitIter_t;
+
 static PyObject* py2bitOpen(PyObject *self, PyObject *args, PyObject *kwds);
+static PyObject *py2bitOpenBuffer(PyObject *self, PyObject *args, PyObject *kwds);
+static PyObject *py2bitWrite(PyObject *self, PyObject *args, PyObject *kwds);
 static PyObject *py2bitEnter(pyTwoBit_t *pybw, PyObject *args);
+static PyObject *py2bitReduce(pyTwoBit_t *pybw, PyObject *args);
 static PyObject *py2bitInfo(pyTwoBit_t *pybw, PyObject *args);
 static PyObject* py2bitClose(pyTwoBit_t *pybw, PyObject *args);
 static PyObject* py2bitChroms(pyTwoBit_t *pybw, PyObject *args);
 static PyObject *py2bitSequence(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitSequences(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitIterSequence(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitIterGenome(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitEncoded(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitEncodedBatch(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
 static PyObject *py2bitBases(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitWindowBases(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitDinucleotides(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitWindowDinucleotides(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitKmerCounts(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitKmerCountsGenome(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitFindMotif(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
+static PyObject *py2bitSubset(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
 static PyObject *py2bitHardMaskedBlocks(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
 static PyObject *py2bitSoftMaskedBlocks(pyTwoBit_t *pybw, PyObject *args, PyObject *kwds);
 static void py2bitDealloc(pyTwoBit_t *pybw);
+static void py2bitIterDealloc(pyTwoBitIter_t *self);
+static PyObject *py2bitIterNext(pyTwoBitIter_t *self);
 
 static PyMethodDef tbMethods[] = {
     {"open", (PyCFunction)py2bitOpen, METH_VARARGS|METH_KEYWORDS,
@@ -32,16 +66,77 @@ Arguments:\n\
 \n\
 Optional arguments:\n\
     storeMasked: Whether to store information about soft-masking (default False).\n\
+    compositionIndex: If not 0 (the default), store cumulative base counts\n\
+                      every compositionIndex bases (which must be a multiple\n\
+                      of 4), so bases() only needs to scan the edges of an\n\
+                      interval. This takes 16/compositionIndex bytes of memory\n\
+                      per base and is computed per chromosome on first use.\n\
 \n\
-Note that storing soft-masking information can be memory intensive and doing so\n\
-will result in soft-masked bases being lower case if the sequence is fetched\n\
-(see the sequence() function)\n\
+Soft-masking information is stored compactly (typically 2-4 bytes per masked\n\
+block, so ~20MB for a human genome). Storing it will result in soft-masked bases\n\
+being lower case if the sequence is fetched (see the sequence() function)\n\
 \n\
 >>> import py2bit\n\
 >>> tb = py2bit.open(\"some_file.2bit\")\n\
 \n\
 To store soft-masking information:\n\
->>> tb = py2bit.open(\"some_file.2bit\", True)"},
+>>> tb = py2bit.open(\"some_file.2bit\", True)\n\
+\n\
+To speed up bases() on large intervals, using ~64MB per Gb of sequence:\n\
+>>> tb = py2bit.open(\"some_file.2bit\", compositionIndex=256)"},
+    {"open_buffer", (PyCFunction)py2bitOpenBuffer, METH_VARARGS|METH_KEYWORDS,
+"Open a 2bit file that's already in memory.\n\
+\n\
+Returns:\n\
+   A TwoBit object on success, otherwise None.\n\
+\n\
+Arguments:\n\
+    buffer: Any object supporting the buffer protocol (e.g., bytes, an mmap\n\
+            or a multiprocessing.shared_memory.SharedMemory's buf) holding\n\
+            the contents of a 2bit file.\n\
+\n\
+Optional arguments:\n\
+    storeMasked:      As in open().\n\
+    compositionIndex: As in open().\n\
+\n\
+Nothing is copied: sequences are read straight from the buffer, exactly as from\n\
+a memory mapped file. A reference to the buffer is held until the file is\n\
+closed, and it mustn't be modified in the meantime. This allows a genome to be\n\
+placed in shared memory once and used by many worker processes.\n\
+\n\
+>>> import py2bit\n\
+>>> from multiprocessing import shared_memory\n\
+>>> data = open(\"some_file.2bit\", \"rb\").read()\n\
+>>> shm = shared_memory.SharedMemory(create=True, size=len(data))\n\
+>>> shm.buf[:len(data)] = data\n\
+>>> tb = py2bit.open_buffer(shm.buf)"},
+    {"write", (PyCFunction)py2bitWrite, METH_VARARGS|METH_KEYWORDS,
+"Write sequences to a new 2bit file.\n\
+\n\
+Returns:\n\
+   None. An exception is raised (and no file is left behind) on error.\n\
+\n\
+Arguments:\n\
+    file:      The name of the 2bit file to create.\n\
+    sequences: A dict of sequences, keyed by name, or any iterable of\n\
+               (name, sequence) pairs, such as a generator reading a FASTA\n\
+               file. Sequences may be str or bytes-like objects.\n\
+\n\
+Optional arguments:\n\
+    threads:   The number of threads used to pack sequences (default 0, one per\n\
+               CPU). With more than one thread, several sequences are packed at\n\
+               once while the next is read.\n\
+\n\
+A, C, G and T are stored as such and anything else as N. Lower case letters are\n\
+stored as soft-masked. Records are spooled to a temporary file beside the output\n\
+until the index can be written, so only a few sequences are ever held in memory.\n\
+Files over 4GB are written with 64-bit offsets (version 1).\n\
+\n\
+>>> import py2bit\n\
+>>> py2bit.write(\"test.2bit\", {\"chr1\": \"NNACGTacgt\", \"chr2\": \"GATTACA\"})\n\
+>>> tb = py2bit.open(\"test.2bit\", True)\n\
+>>> tb.sequence(\"chr1\")\n\
+'NNACGTacgt'"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -54,13 +149,14 @@ static PyMethodDef tbObjMethods[] = {
   * The total sequence length ('sequence length').\n\
   * The total hard-masked length ('hard-masked length').\n\
   * The total soft-masked length, if available ('soft-masked length').\n\
+  * The memory used by the index of masked blocks, in bytes ('index size').\n\
 \n\
 A base is hard-masked if it is an N and soft-masked if it's lower case. Note that soft-masking is ignored by default (you must specify 'storeMasked=True' when you open the file.\n\
 \n\
 >>> import py2bit\n\
 >>> tb = py2bit.open(\"some_file.2bit\")\n\
 >>> tb.info()\n\
-{'file size': 160L, 'nChroms': 2L, 'sequence length': 250L, 'hard-masked length': 150L, 'soft-masked length': 8L}\n\
+{'file size': 160L, 'nChroms': 2L, 'sequence length': 250L, 'hard-masked length': 150L, 'index size': 4400L}\n\
 >>> tb.close()\n"},
     {"close", (PyCFunction)py2bitClose, METH_VARARGS,
 "Close a 2bit file.\n\
@@ -97,14 +193,21 @@ If you specify a non-existant chromosome then no output is produced:\n\
 exception is thrown.\n\
 \n\
 Positional arguments:\n\
-    chr:   Chromosome name\n\
+    chr:    Chromosome name\n\
 \n\
 Keyword arguments:\n\
-    start: Starting position (0-based)\n\
-    end:   Ending position (1-based)\n\
+    start:  Starting position (0-based)\n\
+    end:    Ending position (1-based)\n\
+    format: Either 'str' (the default) or 'bytes'\n\
+    out:    A writable buffer of single bytes (e.g., a bytearray or a numpy\n\
+            uint8 array) to write the sequence into.\n\
+    strand: Either '+' (the default) or '-', in which case the reverse\n\
+            complement is returned. This is decoded directly, so it's no\n\
+            slower than fetching the '+' strand.\n\
 \n\
 Returns:\n\
-    A string containing the sequence.\n\
+    A string (or bytes) containing the sequence. If out is given, the sequence\n\
+    is written to its beginning and the number of bases written is returned.\n\
 \n\
 If start and end aren't specified, the entire chromosome is returned. If the\n\
 end value is beyond the end of the chromosome then it is adjusted accordingly.\n\
@@ -115,6 +218,149 @@ end value is beyond the end of the chromosome then it is adjusted accordingly.\n
 NNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNACGTACGTACGTagctagctGATCGATCGTAGCTAGCTAGCTAGCTGATCNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNN\n\
 >>> tb.sequence(\"chr1\", 24, 74)\n\
 NNNNNNNNNNNNNNNNNNNNNNNNNNACGTACGTACGTagctagctGATC\n\
+>>> tb.sequence(\"chr1\", 24, 74, strand=\"-\")\n\
+GATCagctagctACGTACGTACGTNNNNNNNNNNNNNNNNNNNNNNNNNN\n\
+>>> buf = bytearray(50)\n\
+>>> tb.sequence(\"chr1\", 24, 74, out=buf)\n\
+50\n\
+>>> tb.close()"},
+    {"sequences", (PyCFunction)py2bitSequences, METH_VARARGS|METH_KEYWORDS,
+"Retrieve the sequences of many regions in a single call. This is much faster\n\
+than calling sequence() in a loop. On error, a runtime exception is thrown.\n\
+\n\
+Positional arguments:\n\
+    chroms: Either an iterable of (chrom, start, end) items (e.g., the lines\n\
+            of a BED file split into fields, any additional fields are\n\
+            ignored) or, if starts and ends are given, a list of chromosome\n\
+            names or a single chromosome name used for every region.\n\
+\n\
+Optional keyword arguments:\n\
+    starts: Starting positions (0-based)\n\
+    ends:   Ending positions (1-based)\n\
+    concatenate: If True, return a single string holding all of the sequences\n\
+                 and a list of offsets rather than a list of strings (default\n\
+                 False).\n\
+\n\
+Returns:\n\
+    A list of strings or, if concatenate=True, a tuple of a string and a list\n\
+    of offsets such that sequence i is seq[offsets[i]:offsets[i+1]].\n\
+\n\
+As with sequence(), start and end values of 0 denote an entire chromosome and\n\
+end values beyond the end of a chromosome are adjusted accordingly.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> tb.sequences([(\"chr1\", 24, 74), (\"chr2\", 10, 20)])\n\
+['NNNNNNNNNNNNNNNNNNNNNNNNNNACGTACGTACGTAGCTAGCTGATC', 'GTAGCTAGCT']\n\
+>>> tb.sequences(\"chr1\", [48, 60], [52, 64])\n\
+['NNAC', 'GTAG']\n\
+>>> tb.sequences(\"chr1\", [48, 60], [52, 64], concatenate=True)\n\
+('NNACGTAG', [0, 4, 8])\n\
+>>> tb.close()"},
+    {"iter_sequence", (PyCFunction)py2bitIterSequence, METH_VARARGS|METH_KEYWORDS,
+"Iterate over the sequence of a chromosome, or subset of it, in fixed-size\n\
+chunks. Only one chunk is held in memory at a time, so entire chromosomes can\n\
+be scanned in constant memory. On error, a runtime exception is thrown.\n\
+\n\
+Positional arguments:\n\
+    chr:     Chromosome name\n\
+\n\
+Keyword arguments:\n\
+    start:   Starting position (0-based)\n\
+    end:     Ending position (1-based)\n\
+    chunk:   The chunk size (default 1048576)\n\
+    overlap: The number of bases shared by successive chunks (default 0),\n\
+             which must be less than chunk. This is useful for finding\n\
+             motifs that span chunk boundaries.\n\
+    format:  Either 'str' (the default), 'bytes' or 'view'. With 'view', each\n\
+             chunk is a memoryview of a single buffer that is overwritten by\n\
+             the next chunk, so nothing at all is allocated per chunk.\n\
+\n\
+Yields:\n\
+    (start, sequence) tuples. The last chunk may be shorter than chunk.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> [x for x in tb.iter_sequence(\"chr1\", 48, 64, chunk=8, overlap=2)]\n\
+[(48, 'NNACGTAC'), (54, 'ACGTACGT'), (60, 'GTAG')]\n\
+>>> tb.close()"},
+    {"iter_genome", (PyCFunction)py2bitIterGenome, METH_VARARGS|METH_KEYWORDS,
+"As iter_sequence(), but for every chromosome/contig in the file in turn. On\n\
+error, a runtime exception is thrown.\n\
+\n\
+Keyword arguments:\n\
+    chunk:   The chunk size (default 1048576)\n\
+    overlap: The number of bases shared by successive chunks on the same\n\
+             chromosome/contig (default 0)\n\
+    format:  Either 'str' (the default), 'bytes' or 'view', as in\n\
+             iter_sequence()\n\
+\n\
+Yields:\n\
+    (chrom, start, sequence) tuples. Chunks never span chromosomes/contigs.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> for chrom, start, seq in tb.iter_genome(chunk=100):\n\
+...     print(chrom, start, len(seq))\n\
+chr1 0 100\n\
+chr1 100 50\n\
+chr2 0 100\n\
+>>> tb.close()"},
+    {"encoded", (PyCFunction)py2bitEncoded, METH_VARARGS|METH_KEYWORDS,
+"Retrieve the sequence of a chromosome, or subset of it, as integer codes or a\n\
+one-hot encoding, as used by neural networks. On error, a runtime exception is\n\
+thrown.\n\
+\n\
+Positional arguments:\n\
+    chr:   Chromosome name\n\
+\n\
+Keyword arguments:\n\
+    start: Starting position (0-based)\n\
+    end:   Ending position (1-based)\n\
+    mode:  Either 'int8' (the default), in which case A, C, G, T and N are\n\
+           coded as 0, 1, 2, 3 and 4, or 'onehot', in which case each base is\n\
+           4 values (one per A, C, G and T) and N is all zeros.\n\
+    out:   A writable, contiguous buffer (e.g., a numpy array) to write the\n\
+           output into. This may hold (u)int8 or bool values or, for one-hot\n\
+           encoding, float32 values.\n\
+\n\
+Returns:\n\
+    A memoryview of int8 values with shape (L,) or, for one-hot encoding,\n\
+    uint8 values with shape (L, 4). Use numpy.asarray() to convert this to\n\
+    an array without copying. If out is given, the number of bases is\n\
+    returned instead.\n\
+\n\
+Soft-masking is ignored.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> tb.encoded(\"chr1\", 48, 54).tolist()\n\
+[4, 4, 0, 1, 2, 3]\n\
+>>> tb.encoded(\"chr1\", 48, 52, mode=\"onehot\").tolist()\n\
+[[0, 0, 0, 0], [0, 0, 0, 0], [1, 0, 0, 0], [0, 1, 0, 0]]\n\
+>>> tb.close()"},
+    {"encoded_batch", (PyCFunction)py2bitEncodedBatch, METH_VARARGS|METH_KEYWORDS,
+"As encoded(), but for many regions of the same length in a single call. On\n\
+error, a runtime exception is thrown.\n\
+\n\
+Positional arguments:\n\
+    chroms: The regions, as in sequences().\n\
+\n\
+Optional keyword arguments:\n\
+    starts: Starting positions (0-based)\n\
+    ends:   Ending positions (1-based)\n\
+    mode:   Either 'int8' (the default) or 'onehot', as in encoded().\n\
+    out:    A writable, contiguous buffer (e.g., a preallocated (B, L, 4)\n\
+            numpy array) to write the output into.\n\
+\n\
+Returns:\n\
+    A memoryview with shape (B, L) or, for one-hot encoding, (B, L, 4). If\n\
+    out is given, the number of regions is returned instead.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> tb.encoded_batch(\"chr1\", [48, 60], [52, 64]).tolist()\n\
+[[4, 4, 0, 1], [2, 3, 0, 2]]\n\
 >>> tb.close()"},
     {"bases", (PyCFunction)py2bitBases, METH_VARARGS|METH_KEYWORDS,
 "Retrieve the percentage or number of A, C, T, and Gs in a chromosome or subset\n\
@@ -128,10 +374,16 @@ Optional keyword arguments:\n\
     end:   Ending position (1-based)\n\
     fraction: Whether to return fractional or integer values (default 'True',\n\
               so fractional values are returned)\n\
+    extended: Whether to also return the number of Ns and, if the file was\n\
+              opened with storeMasked=True, of soft-masked bases (default\n\
+              'False'). These are all computed in a single pass.\n\
 \n\
 Returns:\n\
     A dictionary with nucleotide as the key and fraction (or count) as the\n\
-    value.\n\
+    value. With extended=True, there's also an 'N' key and, if soft-masking\n\
+    is stored, 'soft-masked' (the lower case bases), 'unmasked' (the upper\n\
+    case A, C, G and Ts) and 'unmasked GC'. As a fraction, the latter is the GC\n\
+    content of the unmasked bases rather than of the whole region.\n\
 \n\
 If start and end aren't specified, the entire chromosome is returned. If the\n\
 end value is beyond the end of the chromosome then it is adjusted accordingly.\n\
@@ -147,6 +399,195 @@ bases. Counts may sum to less than the length of the region for the same reason.
 {'A': 0.12, 'C': 0.12, 'T': 0.12, 'G': 0.12}\n\
 >>> tb.bases(tb, \"chr1\", 24, 74, True)\n\
 {'A': 6, 'C': 6, 'T': 6, 'G': 6}\n\
+>>> tb.bases(tb, \"chr1\", 24, 74, False, True)\n\
+{'A': 6, 'C': 6, 'T': 6, 'G': 6, 'N': 26}\n\
+>>> tb.close()"},
+    {"window_bases", (PyCFunction)py2bitWindowBases, METH_VARARGS|METH_KEYWORDS,
+"Retrieve the fraction or number of A, C, G, T and N bases in each of a series\n\
+of windows, as calling bases() on each would, but in a single call and with\n\
+each base only counted once, however much the windows overlap. On error, a\n\
+runtime exception is thrown.\n\
+\n\
+Positional arguments:\n\
+    chr:   Chromosome name\n\
+    start: Starting position (0-based)\n\
+    end:   Ending position (1-based), 0 denotes the end of the chromosome\n\
+    width: The window width\n\
+\n\
+Optional keyword arguments:\n\
+    step:  The distance between the starts of successive windows (default:\n\
+           the width, so the windows are adjacent)\n\
+    fraction: Whether to return fractional or integer values (default 'True',\n\
+              so fractional values are returned)\n\
+\n\
+Returns:\n\
+    A memoryview of shape (nWindows, 5), holding float64 (or uint32) values in\n\
+    A, C, G, T, N order, which can be passed to numpy.asarray() without\n\
+    copying. Windows start at start, start + step, and so on. Only complete\n\
+    windows are included.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> tb.window_bases(\"chr1\", 48, 64, 8, 4, fraction=False).tolist()\n\
+[[2, 2, 1, 1, 2], [2, 2, 2, 2, 0], [2, 1, 3, 2, 0]]\n\
+>>> tb.close()"},
+    {"dinucleotides", (PyCFunction)py2bitDinucleotides, METH_VARARGS|METH_KEYWORDS,
+"Retrieve the number of each of the 16 dinucleotides in a chromosome or subset\n\
+thereof. Pairs including an N are excluded. On error, a runtime exception is\n\
+thrown.\n\
+\n\
+Positional arguments:\n\
+    chr:   Chromosome name\n\
+\n\
+Optional keyword arguments:\n\
+    start: Starting position (0-based)\n\
+    end:   Ending position (1-based)\n\
+\n\
+Returns:\n\
+    A dictionary with the dinucleotide (e.g., 'CG') as the key and its count\n\
+    as the value. Only pairs with both bases in the region are counted.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> tb.dinucleotides(\"chr1\", 48, 64)[\"CG\"]\n\
+3\n\
+>>> tb.close()"},
+    {"window_dinucleotides", (PyCFunction)py2bitWindowDinucleotides, METH_VARARGS|METH_KEYWORDS,
+"Retrieve the number of each of the 16 dinucleotides in each of a series of\n\
+windows, as calling dinucleotides() on each would, but in a single call and\n\
+with each base only read once. On error, a runtime exception is thrown.\n\
+\n\
+Positional arguments:\n\
+    chr:   Chromosome name\n\
+    start: Starting position (0-based)\n\
+    end:   Ending position (1-based), 0 denotes the end of the chromosome\n\
+    width: The window width\n\
+\n\
+Optional keyword arguments:\n\
+    step:  The distance between the starts of successive windows (default:\n\
+           the width, so the windows are adjacent)\n\
+\n\
+Returns:\n\
+    A memoryview of shape (nWindows, 16), holding uint32 counts in AA, AC, AG,\n\
+    AT, CA, ..., TT order (so CG is column 6), which can be passed to\n\
+    numpy.asarray() without copying. Windows are as in window_bases().\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> [w[6] for w in tb.window_dinucleotides(\"chr1\", 48, 64, 8, 4).tolist()]\n\
+[1, 1, 1]\n\
+>>> tb.close()"},
+    {"kmer_counts", (PyCFunction)py2bitKmerCounts, METH_VARARGS|METH_KEYWORDS,
+"Count the k-mers in a chromosome or subset thereof, straight from the packed\n\
+sequence. K-mers overlapping an N are skipped and soft-masking is ignored. On\n\
+error, a runtime exception is thrown.\n\
+\n\
+Positional arguments:\n\
+    chr:   Chromosome name\n\
+    start: Starting position (0-based)\n\
+    end:   Ending position (1-based), 0 denotes the end of the chromosome\n\
+    k:     The k-mer length, from 1 to 16\n\
+\n\
+Optional keyword arguments:\n\
+    canonical: If True, count each k-mer together with its reverse complement,\n\
+               under whichever of the two has the lower index (default\n\
+               'False'). The entries of the other k-mers are then 0.\n\
+    out:   A writable buffer of 4^k 64-bit integers (e.g., a numpy uint64\n\
+           array), which the counts are added to. This allows counts to be\n\
+           accumulated over many regions.\n\
+\n\
+The table takes 8*4^k bytes: 128MB for k=12, 2GB for k=14 and 32GB for k=16.\n\
+If out isn't given and the table is larger than the machine's memory, a\n\
+MemoryError is raised before anything is allocated.\n\
+\n\
+Returns:\n\
+    A memoryview of 4^k uint64 counts, which can be passed to numpy.asarray()\n\
+    without copying, or None if out is given. The k-mer with bases\n\
+    b1 b2 ... bk (A=0, C=1, G=2, T=3) is at index b1*4^(k-1) + ... + bk, so\n\
+    k-mers are in lexicographic order.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> tb.kmer_counts(\"chr1\", 48, 64, 2).tolist()\n\
+[0, 3, 1, 0, 0, 0, 3, 0, 0, 0, 0, 3, 3, 0, 0, 0]\n\
+>>> tb.close()"},
+    {"kmer_counts_genome", (PyCFunction)py2bitKmerCountsGenome, METH_VARARGS|METH_KEYWORDS,
+"Count the k-mers in every chromosome, as kmer_counts() does, using multiple\n\
+threads. On error, a runtime exception is thrown.\n\
+\n\
+Positional arguments:\n\
+    k:     The k-mer length, from 1 to 16\n\
+\n\
+Optional keyword arguments:\n\
+    canonical: As in kmer_counts() (default 'False')\n\
+    threads: The number of threads, between which the chromosomes are divided\n\
+             (default 0, meaning one per CPU)\n\
+    out:   As in kmer_counts()\n\
+\n\
+The table takes 8*4^k bytes, as in kmer_counts(). For k up to 10, each\n\
+thread also counts into its own table, which is then added to it.\n\
+\n\
+Returns:\n\
+    A memoryview of 4^k uint64 counts, or None if out is given.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> tb.kmer_counts_genome(1).tolist()\n\
+[24, 24, 26, 26]\n\
+>>> tb.close()"},
+    {"find_motif", (PyCFunction)py2bitFindMotif, METH_VARARGS|METH_KEYWORDS,
+"Find the occurrences of a short IUPAC pattern, such as a restriction site, in\n\
+one or more chromosomes. The pattern is matched directly against the packed\n\
+sequence, so chromosomes are never decoded. Matches overlapping an N are\n\
+excluded and soft-masking is ignored. On error, a runtime exception is thrown.\n\
+\n\
+Positional arguments:\n\
+    pattern: 1 to 32 IUPAC symbols (e.g., 'GATC' or 'GANTC'), in either case\n\
+\n\
+Optional keyword arguments:\n\
+    chroms:  A chromosome name or list of them (default: every chromosome)\n\
+    both_strands: Whether to also match the reverse complement of the pattern\n\
+                  (default 'True'). A position matching on both strands (e.g.,\n\
+                  for a palindromic site) is only reported once.\n\
+\n\
+Returns:\n\
+    A dictionary with chromosome names as keys and, as values, memoryviews of\n\
+    the uint32 (0-based) start positions of the matches, in increasing order.\n\
+    These can be passed to numpy.asarray() without copying.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> tb.find_motif(\"GATC\", \"chr1\")[\"chr1\"].tolist()\n\
+[70, 74, 96]\n\
+>>> tb.close()"},
+    {"subset", (PyCFunction)py2bitSubset, METH_VARARGS|METH_KEYWORDS,
+"Write a new 2bit file holding some of the chromosomes/contigs, or regions of\n\
+them.\n\
+\n\
+Returns:\n\
+    None. An exception is raised on error, in which case no file is left\n\
+    behind and any existing file is left untouched.\n\
+\n\
+Positional arguments:\n\
+    fname:   The name of the 2bit file to create.\n\
+\n\
+Optional arguments:\n\
+    chroms:  A chromosome name or a list of them, which are written whole.\n\
+    regions: An iterable of (chrom, start, end) or (chrom, start, end, name)\n\
+             items, which are written after any whole chromosomes. Regions\n\
+             are named chrom:start-end unless a name is given.\n\
+\n\
+If neither chroms nor regions is given, every chromosome is written. Whole\n\
+chromosomes are copied byte for byte and regions are cut from the packed\n\
+sequence, so nothing is decoded and re-encoded. Soft-masking is always kept,\n\
+even if the file wasn't opened with storeMasked=True. fname may be the file\n\
+being read from, which is only replaced once the subset is complete.\n\
+\n\
+>>> import py2bit\n\
+>>> tb = py2bit.open(\"test/test.2bit\")\n\
+>>> tb.subset(\"chr1.2bit\", \"chr1\", regions=[(\"chr2\", 10, 20)])\n\
+>>> py2bit.open(\"chr1.2bit\").chroms()\n\
+{'chr1': 150, 'chr2:10-20': 10}\n\
 >>> tb.close()"},
     {"hardMaskedBlocks", (PyCFunction)py2bitHardMaskedBlocks, METH_VARARGS|METH_KEYWORDS,
 "Retrieve a list of hard-masked blocks on a single-chromosome (or range on it).\n\
@@ -192,6 +633,13 @@ Returns:\n\
 >>> tb.close()"},
     {"__enter__", (PyCFunction) py2bitEnter, METH_NOARGS, NULL},
     {"__exit__", (PyCFunction) py2bitClose, METH_VARARGS, NULL},
+    {"__reduce__", (PyCFunction) py2bitReduce, METH_NOARGS,
+"Allows TwoBit objects to be pickled (e.g., to pass them to multiprocessing\n\
+workers). They're unpickled by reopening the file by its absolute path, with\n\
+the same storeMasked and compositionIndex settings. Only the names and sizes\n\
+of the chromosomes/contigs are read on opening, so this is cheap.\n\
+\n\
+Files opened with open_buffer() can't be pickled."},
     {NULL, NULL, 0, NULL}
 };
 
@@ -262,3 +710,42 @@ static PyTypeObject pyTwoBit = {
     0,                         /*tp_new*/
     0,0,0,0,0,0
 };
+
+static PyTypeObject pyTwoBitIter = {
+#if PY_MAJOR_VERSION >= 3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,              /*ob_size*/
+#endif
+    "py2bit.pyTwoBitIter",     /*tp_name*/
+    sizeof(pyTwoBitIter_t),    /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)py2bitIterDealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash*/
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    PyObject_GenericGetAttr,   /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+#if PY_MAJOR_VERSION >= 3
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+#else
+    Py_TPFLAGS_HAVE_CLASS | Py_TPFLAGS_HAVE_ITER, /*tp_flags*/
+#endif
+    "Iterator over chunks of sequence", /*tp_doc*/
+    0,                         /*tp_traverse*/
+    0,                         /*tp_clear*/
+    0,                         /*tp_richcompare*/
+    0,                         /*tp_weaklistoffset*/
+    PyObject_SelfIter,         /*tp_iter*/
+    (iternextfunc)py2bitIterNext, /*tp_iternext*/
+};
@@ -0,0 +1,206 @@
+"""
+Benchmarks comparing alternative code paths in py2bit on synthetic data.
+
+Usage: python -m py2bitTest.benchmark [name ...]
+
+With no names, every benchmark is run. The synthetic 2bit files are written
+to a temporary directory and removed afterwards.
+"""
+import os
+import random
+import re
+import shutil
+import struct
+import sys
+import tempfile
+import time
+import py2bit
+
+
+def runs(seq, pred):
+    """Return (start, size) tuples for each run of characters matching pred"""
+    out = []
+    i = 0
+    while i < len(seq):
+        if pred(seq[i]):
+            j = i
+            while j < len(seq) and pred(seq[j]):
+                j += 1
+            out.append((i, j - i))
+            i = j
+        else:
+            i += 1
+    return out
+
+
+def pack(seq):
+    """The 2bit encoding of a sequence, with anything other than ACG as T"""
+    code = {'T': 0, 'C': 1, 'A': 2, 'G': 3}
+    codes = [code.get(c, 0) for c in seq.upper()] + [0, 0, 0]
+    return bytes((a << 6) | (b << 4) | (c << 2) | d for a, b, c, d in zip(codes[0::4], codes[1::4], codes[2::4], codes[3::4]))
+
+
+def write2bit(fname, seqs, version=0, byteorder='<'):
+    """A minimal (and slow) 2bit writer, seqs is a list of (name, sequence) tuples. Version 1 files have 64-bit offsets"""
+    records = []
+    for name, seq in seqs:
+        nBlocks = [(m.start(), m.end() - m.start()) for m in re.finditer('[^ACGTacgt]+', seq)]
+        mBlocks = [(m.start(), m.end() - m.start()) for m in re.finditer('[a-z]+', seq)]
+        rec = [struct.pack(byteorder + 'II', len(seq), len(nBlocks))]
+        rec += [struct.pack(byteorder + 'I', b[0]) for b in nBlocks] + [struct.pack(byteorder + 'I', b[1]) for b in nBlocks]
+        rec.append(struct.pack(byteorder + 'I', len(mBlocks)))
+        rec += [struct.pack(byteorder + 'I', b[0]) for b in mBlocks] + [struct.pack(byteorder + 'I', b[1]) for b in mBlocks]
+        rec.append(struct.pack(byteorder + 'I', 0))
+        records.append(b''.join(rec) + pack(seq))
+    offsetFmt = byteorder + ('Q' if version == 1 else 'I')
+    offset = 16 + sum(1 + len(name) + struct.calcsize(offsetFmt) for name, _ in seqs)
+    with open(fname, 'wb') as f:
+        f.write(struct.pack(byteorder + 'IIII', 0x1A412743, version, len(seqs), 0))
+        for (name, _), rec in zip(seqs, records):
+            f.write(struct.pack('B', len(name)) + name.encode() + struct.pack(offsetFmt, offset))
+            offset += len(rec)
+        for rec in records:
+            f.write(rec)
+
+
+def randomSequence(length, rng, nFraction=0.01, maskFraction=0.5, meanRun=300):
+    """Random sequence with runs of N and of soft-masked (lower case) bases"""
+    out = []
+    total = 0
+    while total < length:
+        size = rng.randint(1, 2 * meanRun)
+        r = rng.random()
+        if r < nFraction:
+            out.append('N' * size)
+        else:
+            chunk = ''.join(rng.choice('ACGT') for _ in range(size))
+            out.append(chunk.lower() if r < nFraction + maskFraction else chunk)
+        total += size
+    return ''.join(out)[:length]
+
+
+def best(f, n, repeats=3):
+    """The best time per call, in microseconds"""
+    t = []
+    for _ in range(repeats):
+        start = time.perf_counter()
+        for _ in range(n):
+            f()
+        t.append((time.perf_counter() - start) / n)
+    return 1e6 * min(t)
+
+
+def benchComposition(tmpdir):
+    """bases() with and without the composition index"""
+    rng = random.Random(0)
+    fname = os.path.join(tmpdir, "composition.2bit")
+    write2bit(fname, [("chr1", randomSequence(4000000, rng))])
+    print("bases() on chr1 (4Mb), microseconds per call")
+    print("%10s %10s %10s %10s" % ("width", "no index", "step 256", "step 1024"))
+    handles = [py2bit.open(fname), py2bit.open(fname, compositionIndex=256), py2bit.open(fname, compositionIndex=1024)]
+    for tb in handles[1:]:
+        tb.bases("chr1", 0, 8192)  # Compute the checkpoints up front
+    for width in [1000, 10000, 100000, 1000000]:
+        starts = [rng.randrange(4000000 - width) for _ in range(100)]
+        times = []
+        for tb in handles:
+            def f():
+                for s in starts:
+                    tb.bases("chr1", s, s + width)
+            times.append(best(f, 5) / len(starts))
+        print("%10d %10.2f %10.2f %10.2f" % tuple([width] + times))
+    for tb in handles:
+        tb.close()
+
+
+def benchMasks(tmpdir):
+    """Masked-block lookups near the start and end of a repeat-dense chromosome"""
+    rng = random.Random(0)
+    fname = os.path.join(tmpdir, "masks.2bit")
+    size = 8000000
+    write2bit(fname, [("chr1", randomSequence(size, rng, nFraction=0.2, meanRun=20))])
+    tb = py2bit.open(fname, storeMasked=True)
+    print("chr1 (%dMb) with %d N blocks and %d soft-masked blocks, microseconds per call" % (size // 1000000, len(tb.hardMaskedBlocks("chr1")), len(tb.softMaskedBlocks("chr1"))))
+    print("%20s %10s %10s" % ("", "start", "end"))
+    tests = [("sequence()", tb.sequence), ("bases()", tb.bases), ("hardMaskedBlocks()", tb.hardMaskedBlocks), ("softMaskedBlocks()", tb.softMaskedBlocks)]
+    for name, f in tests:
+        times = [best(lambda: f("chr1", s, s + 100), 1000) for s in [1000, size - 1000]]
+        print("%20s %10.2f %10.2f" % tuple([name] + times))
+    tb.close()
+
+
+def benchOpen(tmpdir):
+    """Opening a file with many small contigs and then fetching from one of them"""
+    rng = random.Random(0)
+    fname = os.path.join(tmpdir, "open.2bit")
+    nContigs = 1000000
+    templates = [randomSequence(200, rng, nFraction=0.1, meanRun=20) for _ in range(100)]
+    write2bit(fname, [("contig%d" % i, templates[i % len(templates)]) for i in range(nContigs)])
+    print("%d contigs, seconds" % nContigs)
+    for storeMasked in [False, True]:
+        def f():
+            tb = py2bit.open(fname, storeMasked)
+            tb.sequence("contig12345", 10, 20)
+            tb.close()
+        print("%20s %10.3f" % ("storeMasked=%s" % storeMasked, best(f, 1) / 1e6))
+    tb = py2bit.open(fname, True)
+    start = time.perf_counter()
+    tb.info()
+    print("%20s %10.3f" % ("info()", time.perf_counter() - start))
+    tb.close()
+
+
+def benchWindows(tmpdir):
+    """window_bases() against calling bases() on each window"""
+    rng = random.Random(0)
+    fname = os.path.join(tmpdir, "windows.2bit")
+    size = 4000000
+    write2bit(fname, [("chr1", randomSequence(size, rng))])
+    tb = py2bit.open(fname)
+    print("chr1 (%dMb), nanoseconds per window" % (size // 1000000))
+    print("%10s %10s %10s %15s %10s" % ("width", "step", "bases()", "window_bases()", "speedup"))
+    for width, step in [(50, 50), (1000, 1000), (300, 10), (1000, 100)]:
+        starts = range(0, min(20000 * step, size - width + 1), step)
+        def f():
+            for s in starts:
+                tb.bases("chr1", s, s + width)
+        loop = best(f, 1) / len(starts)
+        windows = best(lambda: tb.window_bases("chr1", 0, 0, width, step), 3) / ((size - width) // step + 1)
+        print("%10d %10d %10.1f %15.1f %10.1f" % (width, step, 1000 * loop, 1000 * windows, loop / windows))
+    tb.close()
+
+
+def benchKmers(tmpdir):
+    """kmer_counts() against decoding the sequence and counting in python"""
+    rng = random.Random(0)
+    fname = os.path.join(tmpdir, "kmers.2bit")
+    size = 4000000
+    write2bit(fname, [("chr1", randomSequence(size, rng))])
+    tb = py2bit.open(fname)
+    print("chr1 (%dMb), nanoseconds per base" % (size // 1000000))
+    print("%10s %10s %15s %10s" % ("k", "python", "kmer_counts()", "speedup"))
+    for k in [4, 8, 12]:
+        def f():
+            seq = tb.sequence("chr1", 0, 1000000).upper()
+            counts = {}
+            for i in range(len(seq) - k + 1):
+                kmer = seq[i:i + k]
+                counts[kmer] = counts.get(kmer, 0) + 1
+        loop = best(f, 1, 1) / 1000000
+        native = best(lambda: tb.kmer_counts("chr1", 0, 0, k), 3) / size
+        print("%10d %10.1f %15.1f %10.1f" % (k, 1000 * loop, 1000 * native, loop / native))
+    tb.close()
+
+
+benchmarks = {"composition": benchComposition, "kmers": benchKmers, "masks": benchMasks, "open": benchOpen, "windows": benchWindows}
+
+
+if __name__ == "__main__":
+    names = sys.argv[1:] or sorted(benchmarks)
+    tmpdir = tempfile.mkdtemp()
+    try:
+        for name in names:
+            benchmarks[name](tmpdir)
+            print("")
+    finally:
+        shutil.rmtree(tmpdir)
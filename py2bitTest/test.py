@@ -1,14 +1,69 @@
+import array
+import multiprocessing
 import os
+import pickle
+import random
+import re
+import shutil
+import tempfile
+import threading
 import py2bit
+from py2bitTest.benchmark import write2bit, randomSequence, runs
+
+
+def fetch(args):
+    tb, chrom, start, end = args
+    return tb.sequence(chrom, start, end)
+
+
+def region(chrom, start, end):
+    # A region that isn't a list or tuple, with a newly created chromosome name
+    yield "".join(chrom)
+    yield start
+    yield end
+
 
 class Test():
     fname = os.path.dirname(py2bit.__file__) + "/py2bitTest/foo.2bit"
 
+    def setup_method(self, method):
+        # For any files a test writes
+        self.tmpdir = tempfile.mkdtemp()
+
+    def teardown_method(self, method):
+        shutil.rmtree(self.tmpdir)
+
     def testOpenClose(self):
         tb = py2bit.open(self.fname, True)
         assert(tb is not None)
         tb.close()
 
+    def testOpenBuffer(self):
+        with open(self.fname, "rb") as f:
+            data = bytearray(f.read())
+        expected = py2bit.open(self.fname, True)
+        tb = py2bit.open_buffer(data, True, compositionIndex=8)
+        assert(tb.chroms() == expected.chroms())
+        assert(tb.info() == expected.info())
+        for chrom in ["chr1", "chr2"]:
+            assert(tb.sequence(chrom) == expected.sequence(chrom))
+            assert(tb.bases(chrom, 10, 80) == expected.bases(chrom, 10, 80))
+        # The buffer is exported until the file is closed
+        try:
+            data.append(0)
+            assert(False)
+        except BufferError:
+            pass
+        tb.close()
+        data.append(0)
+        expected.close()
+        for buf in [b"", b"\0" * 64, memoryview(data)[:100]]:
+            try:
+                py2bit.open_buffer(buf)
+                assert(False)
+            except RuntimeError:
+                pass
+
     def testChroms(self):
         tb = py2bit.open(self.fname, True)
         chroms = tb.chroms()
@@ -23,6 +78,7 @@ class Test():
         tb = py2bit.open(self.fname, True)
         correct = {'file size': 161, 'nChroms': 2, 'sequence length': 250, 'hard-masked length': 150, 'soft-masked length': 8}
         check = tb.info()
+        assert(check.pop('index size') > 0)
         assert(len(correct) == len(check))
         for k, v in check.items():
             assert(correct[k] == v)
@@ -37,6 +93,202 @@ class Test():
         assert(tb.sequence("chr1", 24, 74) == "NNNNNNNNNNNNNNNNNNNNNNNNNNACGTACGTACGTagctagctGATC")
         tb.close()
 
+    def testSequenceFormats(self):
+        tb = py2bit.open(self.fname, True)
+        assert(tb.sequence("chr1", 24, 74, format="bytes") == tb.sequence("chr1", 24, 74).encode())
+        assert(tb.sequence("chr2", format="bytes") == tb.sequence("chr2").encode())
+        buf = bytearray(60)
+        assert(tb.sequence("chr1", 24, 74, out=buf) == 50)
+        assert(buf[:50] == tb.sequence("chr1", 24, 74).encode())
+        assert(buf[50:] == bytearray(10))
+        assert(tb.sequence("chr1", 100, 110, out=memoryview(buf)[50:]) == 10)
+        assert(buf[50:] == b"NNNNNNNNNN")
+        for out in [bytearray(10), b"x" * 50, array.array('i', [0] * 50)]:
+            try:
+                tb.sequence("chr1", 24, 74, out=out)
+                assert(False)
+            except (RuntimeError, BufferError, TypeError):
+                pass
+        tb.close()
+
+    def testReverseComplement(self):
+        tb = py2bit.open(self.fname, True)
+        assert(tb.sequence("chr1", 24, 74, strand="-") == "GATCagctagctACGTACGTACGTNNNNNNNNNNNNNNNNNNNNNNNNNN")
+        assert(tb.sequence("chr1", 24, 74, format="bytes", strand="-") == b"GATCagctagctACGTACGTACGTNNNNNNNNNNNNNNNNNNNNNNNNNN")
+        buf = bytearray(50)
+        assert(tb.sequence("chr1", 24, 74, out=buf, strand="-") == 50)
+        assert(buf == b"GATCagctagctACGTACGTACGTNNNNNNNNNNNNNNNNNNNNNNNNNN")
+        try:
+            tb.sequence("chr1", strand=".")
+            assert(False)
+        except RuntimeError:
+            pass
+        tb.close()
+        # Compare against reverse complementing in python, for regions long enough to use the SIMD kernels
+        rng = random.Random(0)
+        fname = os.path.join(self.tmpdir, "rc.2bit")
+        seq = randomSequence(5000, rng, nFraction=0.1, meanRun=40)
+        write2bit(fname, [("chr1", seq)])
+        table = str.maketrans("ACGTacgtNn", "TGCAtgcaNn")
+        for storeMasked in [True, False]:
+            tb = py2bit.open(fname, storeMasked)
+            s = seq if storeMasked else seq.upper()
+            for i in range(300):
+                start = rng.randrange(len(seq))
+                end = rng.randint(start + 1, min(len(seq), start + rng.choice([10, 100, 1000, 5000])))
+                assert(tb.sequence("chr1", start, end, strand="-") == s[start:end].translate(table)[::-1])
+            tb.close()
+
+    def testEncoded(self):
+        tb = py2bit.open(self.fname)
+        codes = {'A': 0, 'C': 1, 'G': 2, 'T': 3, 'N': 4}
+        onehot = {'A': [1, 0, 0, 0], 'C': [0, 1, 0, 0], 'G': [0, 0, 1, 0], 'T': [0, 0, 0, 1], 'N': [0, 0, 0, 0]}
+        for chrom in ["chr1", "chr2"]:
+            for start in range(0, tb.chroms(chrom), 7):
+                for end in range(start + 1, tb.chroms(chrom) + 1, 11):
+                    seq = tb.sequence(chrom, start, end)
+                    assert(tb.encoded(chrom, start, end).tolist() == [codes[c] for c in seq])
+                    assert(tb.encoded(chrom, start, end, mode="onehot").tolist() == [onehot[c] for c in seq])
+        # Caller-supplied output, including float32 for one-hot encoding
+        buf = array.array('f', [9] * 40)
+        assert(tb.encoded("chr1", 45, 55, mode="onehot", out=buf) == 10)
+        assert(buf.tolist() == sum([onehot[c] for c in tb.sequence("chr1", 45, 55)], []))
+        buf = bytearray(12)
+        assert(tb.encoded_batch([("chr1", 48, 52), ("chr2", 10, 14), ("chr2", 96, 100)], out=buf) == 3)
+        assert(list(buf) == [codes[c] for c in tb.sequence("chr1", 48, 52) + tb.sequence("chr2", 10, 14) + tb.sequence("chr2", 96, 100)])
+        assert(tb.encoded_batch("chr1", [48, 60], [52, 64], mode="onehot").tolist() == [[onehot[c] for c in tb.sequence("chr1", s, s + 4)] for s in [48, 60]])
+        for args, kwargs in [((("chr1", 0, 10), ("chr1", 0, 11)), {}), ((("chr1", 0, 10),), {"mode": "foo"}), ((("chr1", 0, 10),), {"out": bytearray(9)})]:
+            try:
+                tb.encoded_batch(list(args), **kwargs)
+                assert(False)
+            except RuntimeError:
+                pass
+        tb.close()
+
+    def testSequences(self):
+        tb = py2bit.open(self.fname, True)
+        assert(tb.sequences([("chr1", 24, 74), ("chr2", 10, 20)]) == ["NNNNNNNNNNNNNNNNNNNNNNNNNNACGTACGTACGTagctagctGATC", "GTAGCTAGCT"])
+        assert(tb.sequences("chr1", [48, 60], [52, 64]) == ["NNAC", "GTag"])
+        assert(tb.sequences(["chr1", "chr2"], [48, 0], [52, 1000], concatenate=True) == ("NNAC" + tb.sequence("chr2"), [0, 4, 104]))
+        assert(tb.sequences([("chr1", 0, 0)]) == [tb.sequence("chr1")])
+        assert(tb.sequences([]) == [])
+        # Regions that aren't lists or tuples, whose chromosome names are only referenced by the region itself
+        assert(tb.sequences([region("chr1", 48, 52), region("chr2", 10, 20), region("chr2", 10, 14), region("chr1", 60, 64)]) == ["NNAC", "GTAGCTAGCT", "GTAG", "GTag"])
+        tb.close()
+
+    def testIterSequence(self):
+        tb = py2bit.open(self.fname, True)
+        for chunk, overlap in [(1, 0), (7, 0), (7, 3), (50, 49), (1000, 10)]:
+            for start, end in [(0, 0), (48, 64), (149, 150)]:
+                expected = tb.sequence("chr1", start, end)
+                chunks = list(tb.iter_sequence("chr1", start, end, chunk=chunk, overlap=overlap))
+                assert(all(seq == tb.sequence("chr1", s, s + len(seq)) for s, seq in chunks))
+                assert(all(len(seq) == chunk for _, seq in chunks[:-1]))
+                assert(chunks[0][0] == start and "".join(seq[overlap if i else 0:] for i, (_, seq) in enumerate(chunks)) == expected)
+        assert([(s, bytes(v)) for s, v in tb.iter_sequence("chr2", 40, 60, chunk=8, format="view")] == [(40, b"CTAGCTGA"), (48, b"TCNNNNNN"), (56, b"NNNN")])
+        assert(list(tb.iter_sequence("chr1", 0, 4, format="bytes")) == [(0, b"NNNN")])
+        assert([(c, s, len(seq)) for c, s, seq in tb.iter_genome(chunk=100)] == [("chr1", 0, 100), ("chr1", 100, 50), ("chr2", 0, 100)])
+        assert("".join(seq for _, _, seq in tb.iter_genome(chunk=3)) == tb.sequence("chr1") + tb.sequence("chr2"))
+        for kwargs in [{"chunk": 0}, {"chunk": 10, "overlap": 10}, {"format": "foo"}]:
+            try:
+                tb.iter_sequence("chr1", **kwargs)
+                assert(False)
+            except RuntimeError:
+                pass
+        it = tb.iter_genome()
+        tb.close()
+        try:
+            next(it)
+            assert(False)
+        except RuntimeError:
+            pass
+
+    def testThreads(self):
+        tb = py2bit.open(self.fname, True)
+        expected = [tb.sequence("chr1", i, i + 50) for i in range(100)]
+        results = [None] * len(expected)
+
+        def worker(offset):
+            for i in range(offset, len(expected), 4):
+                results[i] = tb.sequence("chr1", i, i + 50)
+                assert(tb.bases("chr1", i, i + 50, False) is not None)
+
+        threads = [threading.Thread(target=worker, args=(i,)) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert(results == expected)
+        tb.close()
+
+    def testPickle(self):
+        tb = py2bit.open(self.fname, True, compositionIndex=8)
+        copy = pickle.loads(pickle.dumps(tb))
+        assert(copy.sequence("chr1", 48, 72) == tb.sequence("chr1", 48, 72))
+        assert(copy.bases("chr1", 10, 90) == tb.bases("chr1", 10, 90))
+        copy.close()
+        # Handles are passed to workers by pickling them, or inherited if the workers are forked
+        regions = [(tb, "chr1", i, i + 50) for i in range(0, 100, 10)]
+        with multiprocessing.get_context().Pool(2) as pool:
+            assert(pool.map(fetch, regions) == [fetch(region) for region in regions])
+        tb.close()
+        try:
+            pickle.dumps(tb)
+            assert(False)
+        except RuntimeError:
+            pass
+        with open(self.fname, "rb") as f:
+            tb = py2bit.open_buffer(f.read())
+        try:
+            pickle.dumps(tb)
+            assert(False)
+        except TypeError:
+            pass
+        tb.close()
+
+    def testManyContigs(self):
+        # Each contig's index is read on first access, possibly from several threads at once
+        rng = random.Random(0)
+        seqs = [("contig%d" % i, randomSequence(rng.randint(1, 300), rng, nFraction=0.2, meanRun=10)) for i in range(2000)]
+        fname = os.path.join(self.tmpdir, "contigs.2bit")
+        write2bit(fname, seqs)
+        tb = py2bit.open(fname, True)
+        assert(tb.chroms() == {name: len(seq) for name, seq in seqs})
+        results = [None] * len(seqs)
+
+        def worker(offset):
+            for i in range(offset, len(seqs), 4):
+                results[i] = tb.sequence(seqs[i][0])
+
+        threads = [threading.Thread(target=worker, args=(i,)) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert(results == [seq for name, seq in seqs])
+        tb.close()
+        tb = py2bit.open(fname, True)
+        info = tb.info()
+        assert(info['hard-masked length'] == sum(len(seq) - len(re.sub('[^ACGTacgt]', '', seq)) for name, seq in seqs))
+        assert(info['soft-masked length'] == sum(len(re.sub('[^a-z]', '', seq)) for name, seq in seqs))
+        tb.close()
+
+    def testVersionAndByteOrder(self):
+        # Version 1 files differ only in having 64-bit offsets. Either version may be byte swapped.
+        rng = random.Random(0)
+        seqs = [("chr%d" % i, randomSequence(rng.randint(1, 2000), rng, nFraction=0.2, meanRun=50)) for i in range(10)]
+        for version in [0, 1]:
+            for byteorder in ['<', '>']:
+                fname = os.path.join(self.tmpdir, "v%d.2bit" % version)
+                write2bit(fname, seqs, version=version, byteorder=byteorder)
+                tb = py2bit.open(fname, True)
+                assert(tb.chroms() == {name: len(seq) for name, seq in seqs})
+                for name, seq in seqs:
+                    assert(tb.sequence(name) == seq)
+                    assert(tb.softMaskedBlocks(name) == [(s, s + n) for s, n in runs(seq, lambda c: c.islower())])
+                    assert(tb.hardMaskedBlocks(name) == [(s, s + n) for s, n in runs(seq, lambda c: c == 'N')])
+                tb.close()
+
     def testBases(self):
         tb = py2bit.open(self.fname, True)
         assert(tb.bases("chr1") == {'A': 0.08, 'C': 0.08, 'T': 0.08666666666666667, 'G': 0.08666666666666667})
@@ -44,6 +296,298 @@ class Test():
         assert(tb.bases("chr1", 24, 74, False) == {'A': 6, 'C': 6, 'T': 6, 'G': 6})
         assert(tb.bases("chr2", 10, 20) == {'A': 0.2, 'C': 0.2, 'T': 0.3, 'G': 0.3})
         assert(tb.bases("chr2", 10, 20, False) == {'A': 2, 'C': 2, 'T': 3, 'G': 3})
+        # Compare against counting the bases of random regions
+        rng = random.Random(0)
+        for i in range(1000):
+            chrom = rng.choice(["chr1", "chr2"])
+            start = rng.randrange(tb.chroms(chrom))
+            end = rng.randint(start + 1, tb.chroms(chrom))
+            seq = tb.sequence(chrom, start, end).upper()
+            assert(tb.bases(chrom, start, end, False) == {b: seq.count(b) for b in "ACTG"})
+        tb.close()
+
+    def testBaseStats(self):
+        tb = py2bit.open(self.fname, True)
+        assert(tb.bases("chr1", extended=True) == {'A': 0.08, 'C': 0.08, 'T': 0.08666666666666667, 'G': 0.08666666666666667, 'N': 0.6666666666666666, 'soft-masked': 0.05333333333333334, 'unmasked': 0.28, 'unmasked GC': 0.5})
+        assert(tb.bases("chr1", 24, 74, False, True) == {'A': 6, 'C': 6, 'T': 6, 'G': 6, 'N': 26, 'soft-masked': 8, 'unmasked': 16, 'unmasked GC': 8})
+        tb.close()
+        tb = py2bit.open(self.fname)
+        assert(tb.bases("chr1", 24, 74, False, True) == {'A': 6, 'C': 6, 'T': 6, 'G': 6, 'N': 26})
+        tb.close()
+        # Compare against counting the bases of random regions, with and without a composition index
+        rng = random.Random(0)
+        fname = os.path.join(self.tmpdir, "stats.2bit")
+        seq = randomSequence(5000, rng, nFraction=0.2, meanRun=30)
+        seq = seq[:1000] + "nnnnnNNNNNnnnnn" + seq[1015:]
+        write2bit(fname, [("chr1", seq)])
+        for kwargs in [{}, {"compositionIndex": 16}]:
+            tb = py2bit.open(fname, True, **kwargs)
+            for i in range(200):
+                start = rng.randrange(len(seq))
+                end = rng.randint(start + 1, len(seq))
+                sub = seq[start:end]
+                expected = {b: sub.upper().count(b) for b in "ACTGN"}
+                expected["soft-masked"] = sum(c.islower() for c in sub)
+                expected["unmasked"] = sum(sub.count(b) for b in "ACGT")
+                expected["unmasked GC"] = sub.count("C") + sub.count("G")
+                assert(tb.bases("chr1", start, end, False, True) == expected)
+            tb.close()
+
+    def testWindowBases(self):
+        tb = py2bit.open(self.fname)
+        assert(tb.window_bases("chr1", 48, 64, 8, 4, fraction=False).tolist() == [[2, 2, 1, 1, 2], [2, 2, 2, 2, 0], [2, 1, 3, 2, 0]])
+        assert(tb.window_bases("chr1", 48, 64, 8, 4).tolist()[0] == [0.25, 0.25, 0.125, 0.125, 0.25])
+        assert(tb.window_bases("chr2", 0, 0, 30).tolist() == [[tb.sequence("chr2", s, s + 30).count(b) / 30 for b in "ACGTN"] for s in [0, 30, 60]])
+        for args in [("chr1", 10, 20, 11), ("chr1", 0, 0, 0), ("chr3", 0, 0, 10)]:
+            try:
+                tb.window_bases(*args)
+                assert(False)
+            except RuntimeError:
+                pass
+        tb.close()
+        # Compare against counting the bases of each window, with many N blocks and overlapping or gapped windows
+        rng = random.Random(0)
+        fname = os.path.join(self.tmpdir, "windows.2bit")
+        seq = randomSequence(5000, rng, nFraction=0.3, meanRun=20).upper()
+        write2bit(fname, [("chr1", seq)])
+        tb = py2bit.open(fname)
+        for width, step in [(1, 1), (7, 1), (10, 10), (64, 3), (5, 13), (333, 50)]:
+            start = rng.randrange(100)
+            end = rng.randrange(4000, 5001)
+            expected = [[seq[s:s + width].count(b) for b in "ACGTN"] for s in range(start, end - width + 1, step)]
+            assert(tb.window_bases("chr1", start, end, width, step, fraction=False).tolist() == expected)
+        tb.close()
+
+    def testDinucleotides(self):
+        tb = py2bit.open(self.fname)
+        assert(tb.dinucleotides("chr1", 48, 64) == {'AA': 0, 'AC': 3, 'AG': 1, 'AT': 0, 'CA': 0, 'CC': 0, 'CG': 3, 'CT': 0, 'GA': 0, 'GC': 0, 'GG': 0, 'GT': 3, 'TA': 3, 'TC': 0, 'TG': 0, 'TT': 0})
+        assert(tb.window_dinucleotides("chr1", 48, 64, 8, 4).tolist() == [[0, 2, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 1, 0, 0, 0], [0, 2, 0, 0, 0, 0, 1, 0, 0, 0, 0, 2, 2, 0, 0, 0], [0, 1, 1, 0, 0, 0, 1, 0, 0, 0, 0, 2, 2, 0, 0, 0]])
+        tb.close()
+        # Compare against counting the pairs of each window, with many N blocks and overlapping or gapped windows
+        rng = random.Random(0)
+        fname = os.path.join(self.tmpdir, "pairs.2bit")
+        seq = randomSequence(5000, rng, nFraction=0.3, meanRun=20).upper()
+        write2bit(fname, [("chr1", seq)])
+        tb = py2bit.open(fname)
+        pairs = [a + b for a in "ACGT" for b in "ACGT"]
+
+        def expected(s):
+            counts = dict.fromkeys(pairs, 0)
+            for i in range(len(s) - 1):
+                if s[i:i + 2] in counts:
+                    counts[s[i:i + 2]] += 1
+            return counts
+        for i in range(100):
+            start = rng.randrange(len(seq))
+            end = rng.randint(start + 1, len(seq))
+            assert(tb.dinucleotides("chr1", start, end) == expected(seq[start:end]))
+        for width, step in [(1, 1), (2, 1), (7, 3), (32, 32), (33, 5), (5, 13), (333, 50)]:
+            start = rng.randrange(100)
+            end = rng.randrange(4000, 5001)
+            windows = [expected(seq[s:s + width]) for s in range(start, end - width + 1, step)]
+            assert(tb.window_dinucleotides("chr1", start, end, width, step).tolist() == [[w[p] for p in pairs] for w in windows])
+        tb.close()
+
+    def testKmerCounts(self):
+        tb = py2bit.open(self.fname)
+        assert(tb.kmer_counts("chr1", 48, 64, 2).tolist() == [0, 3, 1, 0, 0, 0, 3, 0, 0, 0, 0, 3, 3, 0, 0, 0])
+        assert(tb.kmer_counts("chr1", 48, 64, 2, canonical=True).tolist() == [0, 6, 1, 0, 0, 0, 3, 0, 0, 0, 0, 0, 3, 0, 0, 0])
+        assert(tb.kmer_counts_genome(1).tolist() == [24, 24, 26, 26])
+        out = array.array('Q', [0] * 16)
+        assert(tb.kmer_counts("chr1", 48, 64, 2, out=out) is None)
+        assert(tb.kmer_counts("chr1", 48, 64, 2, out=out) is None)
+        assert(out.tolist() == [0, 6, 2, 0, 0, 0, 6, 0, 0, 0, 0, 6, 6, 0, 0, 0])
+        for args, kwargs in [(("chr1", 0, 0, 0), {}), (("chr1", 0, 0, 17), {}), (("chr1", 0, 0, 2), {"out": array.array('Q', [0] * 15)}), (("chr1", 0, 0, 2), {"out": bytearray(128)})]:
+            try:
+                tb.kmer_counts(*args, **kwargs)
+                assert(False)
+            except RuntimeError:
+                pass
+        tb.close()
+        # Compare against counting the k-mers of the sequence in python, skipping any containing an N
+        rng = random.Random(0)
+        fname = os.path.join(self.tmpdir, "kmers.2bit")
+        chroms = [("chr%d" % i, randomSequence(rng.randint(1, 3000), rng, nFraction=0.1, meanRun=20)) for i in range(10)]
+        write2bit(fname, chroms)
+        tb = py2bit.open(fname)
+        code = {"A": 0, "C": 1, "G": 2, "T": 3}
+        rc = str.maketrans("ACGT", "TGCA")
+
+        def expected(seqs, k, canonical):
+            counts = [0] * 4 ** k
+            for seq in seqs:
+                seq = seq.upper()
+                for i in range(len(seq) - k + 1):
+                    kmer = seq[i:i + k]
+                    if "N" in kmer:
+                        continue
+                    if canonical:
+                        kmer = min(kmer, kmer.translate(rc)[::-1])
+                    counts[sum(code[b] << (2 * (k - 1 - j)) for j, b in enumerate(kmer))] += 1
+            return counts
+        for k in [1, 2, 3, 5, 11]:
+            for canonical in [False, True]:
+                for i in range(5):
+                    chrom, seq = rng.choice(chroms)
+                    start = rng.randrange(len(seq))
+                    end = rng.randint(start + 1, len(seq))
+                    assert(tb.kmer_counts(chrom, start, end, k, canonical).tolist() == expected([seq[start:end]], k, canonical))
+                genome = expected([seq for _, seq in chroms], k, canonical)
+                for threads in [1, 3]:
+                    assert(tb.kmer_counts_genome(k, canonical, threads).tolist() == genome)
+        tb.close()
+
+    def testFindMotif(self):
+        tb = py2bit.open(self.fname)
+        hits = tb.find_motif("GATC")
+        assert({k: v.tolist() for k, v in hits.items()} == {"chr1": [70, 74, 96], "chr2": [20, 24, 46]})
+        assert(tb.find_motif("TAGC", "chr1", both_strands=False)["chr1"].tolist() == [61, 65, 79, 83, 87, 91])
+        assert(tb.find_motif("tagc", ["chr1"])["chr1"].tolist() == [61, 63, 65, 79, 81, 83, 85, 87, 89, 91])
+        assert(tb.find_motif("AAAA", "chr1")["chr1"].tolist() == [])
+        for args in [("",), ("A" * 33,), ("GAXC",), ("GATC", "chr3")]:
+            try:
+                tb.find_motif(*args)
+                assert(False)
+            except RuntimeError:
+                pass
+        tb.close()
+        # Compare against overlapping regular expression matches of the pattern and its reverse complement
+        rng = random.Random(0)
+        fname = os.path.join(self.tmpdir, "motifs.2bit")
+        chroms = [("chr%d" % i, randomSequence(rng.randint(1, 5000), rng, nFraction=0.1, meanRun=20)) for i in range(5)]
+        write2bit(fname, chroms)
+        tb = py2bit.open(fname)
+        iupac = {"A": "A", "C": "C", "G": "G", "T": "T", "R": "AG", "Y": "CT", "S": "CG", "W": "AT", "K": "GT", "M": "AC", "B": "CGT", "D": "AGT", "H": "ACT", "V": "ACG", "N": "ACGT"}
+        comp = {"A": "T", "C": "G", "G": "C", "T": "A", "R": "Y", "Y": "R", "S": "S", "W": "W", "K": "M", "M": "K", "B": "V", "D": "H", "H": "D", "V": "B", "N": "N"}
+
+        def regex(pattern):
+            return re.compile("(?=(%s))" % "".join("[%s]" % iupac[c] for c in pattern))
+        for pattern in ["GATC", "AAGCTT", "GANTC", "RGCGCY", "CTNAG", "ACGTN", "ANNNNNNT", "A" * 32, "T", "TGCANNNNNNNNNNNNNNNNNNNNNNNNNNWS"]:
+            rc = "".join(comp[c] for c in reversed(pattern))
+            for bothStrands in [False, True]:
+                hits = tb.find_motif(pattern, both_strands=bothStrands)
+                for chrom, seq in chroms:
+                    seq = seq.upper()
+                    expected = set(m.start() for m in regex(pattern).finditer(seq))
+                    if bothStrands:
+                        expected |= set(m.start() for m in regex(rc).finditer(seq))
+                    assert(hits[chrom].tolist() == sorted(expected))
+        tb.close()
+
+    def testWrite(self):
+        rng = random.Random(0)
+        chroms = [("chr%d" % i, randomSequence(rng.choice([0, 1, 63, 64, 65, rng.randint(1, 20000)]), rng, nFraction=0.1, maskFraction=0.3, meanRun=rng.choice([1, 20]))) for i in range(12)]
+        chroms.append(("odd", "ACGTRYacgtnx-" * 10))
+        write2bit(os.path.join(self.tmpdir, "expected.2bit"), chroms)
+        with open(os.path.join(self.tmpdir, "expected.2bit"), "rb") as f:
+            expected = f.read()
+        fname = os.path.join(self.tmpdir, "written.2bit")
+        # The output should be identical to the reference writer's, regardless of the number of threads or input type
+        for threads, seqs in [(1, dict(chroms)), (3, iter(chroms)), (0, [(name.encode(), seq.encode()) for name, seq in chroms])]:
+            assert(py2bit.write(fname, seqs, threads=threads) is None)
+            with open(fname, "rb") as f:
+                assert(f.read() == expected)
+        tb = py2bit.open(fname, True)
+        assert(tb.sequence("odd", 0, 13) == "ACGTNNacgtNNN")
+        tb.close()
+        # A failed write leaves any existing file as it was, so these start without one
+        os.remove(fname)
+        for seqs in [{"": "ACGT"}, {"a" * 256: "ACGT"}, {"chr1": 5}, [("chr1",)]]:
+            try:
+                py2bit.write(fname, seqs)
+                assert(False)
+            except (RuntimeError, TypeError):
+                pass
+            assert(not os.path.exists(fname))
+        # Nor should any temporary files be
+        assert(os.listdir(self.tmpdir) == ["expected.2bit"])
+        # Overwriting a file that's open leaves the open handle reading the old contents, and a failed write leaves it intact
+        py2bit.write(fname, [("chr1", "ACGTacgt")])
+        os.chmod(fname, 0o640)
+        tb = py2bit.open(fname, True)
+        py2bit.write(fname, [("chr2", "TTTTNNNN" * 1000)])
+        assert(tb.chroms() == {"chr1": 8})
+        assert(tb.sequence("chr1") == "ACGTacgt")
+        tb.close()
+        assert(os.stat(fname).st_mode & 0o777 == 0o640)
+        with open(fname, "rb") as f:
+            written = f.read()
+        tb = py2bit.open(fname)
+        try:
+            py2bit.write(fname, [("chr1", "ACGT"), ("", "ACGT")])
+            assert(False)
+        except RuntimeError:
+            pass
+        assert(tb.sequence("chr2") == "TTTTNNNN" * 1000)
+        tb.close()
+        with open(fname, "rb") as f:
+            assert(f.read() == written)
+        assert(sorted(os.listdir(self.tmpdir)) == ["expected.2bit", "written.2bit"])
+
+    def testSubset(self):
+        fname = os.path.join(self.tmpdir, "subset.2bit")
+        tb = py2bit.open(self.fname)
+        tb.subset(fname, "chr1", regions=[("chr1", 49, 71), ("chr2", 10, 20, "chr2_part")])
+        out = py2bit.open(fname, True)
+        assert(out.chroms() == {"chr1": 150, "chr1:49-71": 22, "chr2_part": 10})
+        assert(out.sequence("chr1:49-71") == "NACGTACGTACGTagctagctG")
+        assert(out.softMaskedBlocks("chr1:49-71") == [(13, 21)])
+        assert(out.hardMaskedBlocks("chr1:49-71") == [(0, 1)])
+        assert(out.sequence("chr2_part") == tb.sequence("chr2", 10, 20))
+        out.close()
+        os.remove(fname)
+        for args in [(fname, "chr3"), (fname, None, [("chr1", 10, 5)]), (fname, None, [("chr1", 0, 10, "x" * 256)])]:
+            try:
+                tb.subset(*args)
+                assert(False)
+            except RuntimeError:
+                pass
+            assert(not os.path.exists(fname))
+        tb.close()
+        # The file being read can be replaced by a subset of itself, while the open handle keeps reading the original
+        source = os.path.join(self.tmpdir, "source.2bit")
+        shutil.copy(self.fname, source)
+        tb = py2bit.open(self.fname)
+        tb.subset(fname, "chr1")
+        tb.close()
+        with open(fname, "rb") as f:
+            expected = f.read()
+        with open(source, "rb") as f:
+            buf = f.read()
+        for tb in [py2bit.open(source), py2bit.open_buffer(buf)]:
+            chr2 = tb.sequence("chr2")
+            tb.subset(source, "chr1")
+            assert(tb.sequence("chr2") == chr2)
+            tb.close()
+            with open(source, "rb") as f:
+                assert(f.read() == expected)
+            with open(source, "wb") as f:
+                f.write(buf)
+        # Whole chromosomes and regions at every alignment should match the reference writer, for either byte order
+        rng = random.Random(0)
+        chroms = [("chr%d" % i, randomSequence(rng.randint(1, 3000), rng, nFraction=0.1, maskFraction=0.3, meanRun=20)) for i in range(4)]
+        regions = [("chr0", 0, 0)] + [(chrom, start, start + rng.randint(1, 500)) for chrom, _ in chroms for start in range(4)]
+        expected = [chroms[1], chroms[3]] + [("%s:%d-%d" % (chrom, start, end or len(dict(chroms)[chrom])), dict(chroms)[chrom][start:end or None]) for chrom, start, end in regions]
+        write2bit(os.path.join(self.tmpdir, "expected.2bit"), expected)
+        with open(os.path.join(self.tmpdir, "expected.2bit"), "rb") as f:
+            expected = f.read()
+        for byteorder in "<>":
+            write2bit(os.path.join(self.tmpdir, "input.2bit"), chroms, byteorder=byteorder)
+            tb = py2bit.open(os.path.join(self.tmpdir, "input.2bit"))
+            tb.subset(fname, ["chr1", "chr3"], regions)
+            tb.close()
+            with open(fname, "rb") as f:
+                assert(f.read() == expected)
+
+    def testCompositionIndex(self):
+        tb = py2bit.open(self.fname, True)
+        for step in [4, 8, 16, 64]:
+            tbc = py2bit.open(self.fname, True, compositionIndex=step)
+            for chrom in ["chr1", "chr2"]:
+                for start in range(0, tb.chroms(chrom), 7):
+                    for end in range(start + 1, tb.chroms(chrom) + 1, 13):
+                        assert(tbc.bases(chrom, start, end, False) == tb.bases(chrom, start, end, False))
+            tbc.close()
         tb.close()
 
     def testHardMaskedBlocks(self):
@@ -60,3 +604,18 @@ class Test():
         assert(tb.softMaskedBlocks("chr1") == [(62, 70)])
         assert(tb.softMaskedBlocks("chr1", 0, 50) == [])
         tb.close()
+        # Enough blocks to span several groups of the compact encoding
+        rng = random.Random(0)
+        seq = randomSequence(100000, rng, meanRun=50)
+        blocks = [(s, s + n) for s, n in runs(seq, lambda c: c.islower())]
+        fname = os.path.join(self.tmpdir, "masked.2bit")
+        write2bit(fname, [("chr1", seq)])
+        tb = py2bit.open(fname, storeMasked=True)
+        assert(tb.softMaskedBlocks("chr1") == blocks)
+        assert(tb.sequence("chr1") == seq)
+        for i in range(200):
+            start = rng.randrange(len(seq))
+            end = rng.randint(start + 1, len(seq))
+            assert(tb.softMaskedBlocks("chr1", start, end) == [b for b in blocks if b[1] > start and b[0] < end])
+            assert(tb.sequence("chr1", start, end) == seq[start:end])
+        tb.close()